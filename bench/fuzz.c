@@ -0,0 +1,540 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Differential fuzzer: replace.c kernels against bench/replace_ref.c, the
+ * streaming field engine (field.c) against the per-line field kernel and,
+ * for --csv, against a byte-at-a-time RFC 4180 walk, and the line matcher
+ * (match.c) against a plain regexec() and, for -I literals, against a
+ * search over arrays of folded code points. The piece table (piece.c) takes
+ * random inserts and deletes next to a flat string; its text, line count
+ * and line offsets must agree. XXH64 (hash.c) fed in random pieces must
+ * give the one-shot digest.
+ *
+ *   fuzz [iterations] [seed]
+ *
+ * Random lines, patterns and replacements over a tiny alphabet (so matches,
+ * overlaps and empty fields are common) go through both implementations;
+ * output and replacement count must be identical. The first mismatch is
+ * printed with its seed and iteration and the exit status is 1.
+ *
+ * Regex replacements draw from "&", "\\0", "\\1", "\\&" and literals, so
+ * the compiled substitution program meets group references, escapes and
+ * groups the pattern does not have. Matcher patterns are random EREs (those
+ * regcomp() rejects are skipped), so the required-literal prefilter meets
+ * quantifiers, brackets, groups and escapes in every position. */
+
+#define _POSIX_C_SOURCE 200809L
+#include "../iv.h"
+#include "replace_ref.h"
+#include <unistd.h>
+
+static unsigned long long rng_state;
+
+static unsigned rnd(unsigned bound)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned)((rng_state * 2685821657736338717ULL) >> 33) % bound;
+}
+
+static void rand_text(char *buf, int maxlen, const char *alpha)
+{
+    int len = (int)rnd((unsigned)maxlen + 1);
+    size_t na = strlen(alpha);
+    for (int i = 0; i < len; i++)
+        buf[i] = alpha[rnd((unsigned)na)];
+    buf[len] = '\0';
+}
+
+static const char *const regexes[] = {
+    "a", "b", "ab", "a+", "[ab]", "a|b", "^a", "b$", "(ab)+", "a.b",
+    ",", "[^,]+", "b{2}", "a[ab]*b", "\n", "a*", "(a)(b)?", "x?", "^",
+    "(a|b)*,",
+};
+
+/* field_stream() over text, replacing one field, as a malloc'd string. */
+static char *field_stream_text(const char *text, int field, const char *value,
+                               int csv)
+{
+    IvFieldSpec spec;
+    char list[16];
+    snprintf(list, sizeof(list), "%d", field);
+    if (field_spec_init(&spec, ',', list, NULL) != 0)
+        return NULL;
+    spec.value = value;
+    spec.csv = csv;
+    FILE *in = tmpfile();
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (in && out)
+    {
+        fputs(text, in);
+        fflush(in);
+        lseek(fileno(in), 0, SEEK_SET);
+        field_stream(fileno(in), out, &spec);
+    }
+    if (in)
+        fclose(in);
+    if (out)
+        fclose(out);
+    field_spec_free(&spec);
+    return buf;
+}
+
+/* Reference for --csv: walk the text one byte at a time with a quote flag. */
+static char *ref_csv_replace(const char *t, int field, const char *value)
+{
+    char *buf = NULL;
+    size_t blen = 0;
+    FILE *out = open_memstream(&buf, &blen);
+    if (!out)
+        return NULL;
+    size_t len = strlen(t), rs = 0;
+    while (rs < len)
+    {
+        size_t re = rs;
+        for (int inq = 0; re < len && (inq || t[re] != '\n'); re++)
+            if (t[re] == '"')
+                inq = !inq;
+        int has_nl = re < len;
+        size_t ce = has_nl && re > rs && t[re - 1] == '\r' ? re - 1 : re;
+        int f = 1, inq = 0;
+        for (size_t i = rs; i <= ce; i++)
+        {
+            if (i < ce && (inq || t[i] != ','))
+            {
+                if (t[i] == '"')
+                    inq = !inq;
+                if (f != field)
+                    fputc(t[i], out);
+                continue;
+            }
+            if (f == field)
+            {
+                int q = strpbrk(value, ",\"\r\n") != NULL;
+                if (q)
+                    fputc('"', out);
+                for (const char *v = value; *v; v++)
+                {
+                    if (q && *v == '"')
+                        fputc('"', out);
+                    fputc(*v, out);
+                }
+                if (q)
+                    fputc('"', out);
+            }
+            if (i < ce)
+                fputc(',', out);
+            f++;
+        }
+        fwrite(t + ce, 1, re - ce + (has_nl ? 1 : 0), out);
+        rs = re + 1;
+    }
+    fclose(out);
+    return buf;
+}
+
+/* Text from tokens: ASCII in both cases, characters whose folding crosses
+ * into ASCII or changes length, and bytes that are not valid UTF-8 */
+static const char *const fold_tokens[] = {
+    "a", "A", "k", "K", "s", "S", ",", "\xe2\x84\xaa" /* KELVIN SIGN */,
+    "\xc5\xbf" /* LONG S */, "\xc3\xa9", "\xc3\x89", "\xc8\xba" /* U+023A */,
+    "\xe2\xb1\xa5" /* U+2C65 */, "\xc3", "\x84", "\xcf\x82", "\xcf\x83",
+};
+
+static void rand_tokens(char *buf, int maxtokens)
+{
+    int n = (int)rnd((unsigned)maxtokens + 1);
+    buf[0] = '\0';
+    for (int i = 0; i < n; i++)
+        strcat(buf, fold_tokens[rnd(sizeof(fold_tokens) / sizeof(fold_tokens[0]))]);
+}
+
+/* Reference for -I literal replace: both strings become arrays of folded
+ * code points with their byte offsets, searched naively. */
+static char *ref_fold_replace(const char *line, const char *pat,
+                              const char *repl, int global, int *n)
+{
+    size_t ll = strlen(line), pl = strlen(pat), nl = 0, np = 0;
+    unsigned *lr = malloc((ll + 1) * sizeof(unsigned));
+    unsigned *pr = malloc((pl + 1) * sizeof(unsigned));
+    size_t *off = malloc((ll + 1) * sizeof(size_t));
+    char *out = malloc(ll * (strlen(repl) + 1) + 1);
+    for (size_t i = 0; i < ll; nl++)
+    {
+        off[nl] = i;
+        i += utf8_decode(line + i, ll - i, &lr[nl]);
+        lr[nl] = fold_rune(lr[nl]);
+    }
+    off[nl] = ll;
+    for (size_t i = 0; i < pl; np++)
+    {
+        i += utf8_decode(pat + i, pl - i, &pr[np]);
+        pr[np] = fold_rune(pr[np]);
+    }
+    size_t len = 0, r = 0;
+    *n = 0;
+    while (r < nl)
+    {
+        if (np && r + np <= nl && (global || *n == 0) &&
+            memcmp(lr + r, pr, np * sizeof(unsigned)) == 0)
+        {
+            strcpy(out + len, repl);
+            len += strlen(repl);
+            r += np;
+            (*n)++;
+            continue;
+        }
+        memcpy(out + len, line + off[r], off[r + 1] - off[r]);
+        len += off[r + 1] - off[r];
+        r++;
+    }
+    out[len] = '\0';
+    free(lr);
+    free(pr);
+    free(off);
+    return out;
+}
+
+/* Reference for replace_subst_in_string(): the frozen kernel on the line
+ * without its '\n', put back after */
+static char *ref_subst_line(const char *line, regex_t *re, const char *repl,
+                            int global, int *n)
+{
+    size_t len = strlen(line);
+    if (!len || line[len - 1] != '\n')
+        return ref_replace_regex_in_string(line, re, repl, global, n);
+    char *copy = strndup(line, len - 1);
+    char *out = copy ? ref_replace_regex_in_string(copy, re, repl, global, n) : NULL;
+    free(copy);
+    size_t olen = out ? strlen(out) : 0;
+    char *tmp = out ? realloc(out, olen + 2) : NULL;
+    if (!tmp)
+    {
+        free(out);
+        return NULL;
+    }
+    memcpy(tmp + olen, "\n", 2);
+    return tmp;
+}
+
+/* Reference for matcher_match(): regexec() on the line without '\n' */
+static int ref_match(const char *line, const char *pat, int icase, int *ok)
+{
+    regex_t re;
+    char *copy = strdup(line);
+    size_t len = strlen(copy);
+    if (len && copy[len - 1] == '\n')
+        copy[len - 1] = '\0';
+    *ok = regcomp(&re, pat, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)) == 0;
+    int r = *ok && regexec(&re, copy, 0, NULL, 0) == 0;
+    if (*ok)
+        regfree(&re);
+    free(copy);
+    return r;
+}
+
+/* Offset of line (1-based) in a flat string, as doc_line_offset() */
+static size_t flat_line_offset(const char *s, size_t len, long long line)
+{
+    size_t off = 0;
+    for (long long l = 1; l < line && off < len; l++)
+    {
+        const char *nl = memchr(s + off, '\n', len - off);
+        off = nl ? (size_t)(nl - s) + 1 : len;
+    }
+    return off;
+}
+
+static long long flat_lines(const char *s, size_t len)
+{
+    long long n = 0;
+    for (size_t i = 0; i < len; i++)
+        n += s[i] == '\n';
+    return n + (len && s[len - 1] != '\n');
+}
+
+static unsigned long long seed;
+static long iter;
+
+static void show(const char *label, const char *s)
+{
+    fprintf(stderr, "  %s: \"", label);
+    for (; s && *s; s++)
+        if (*s == '\n')
+            fputs("\\n", stderr);
+        else
+            fputc(*s, stderr);
+    fprintf(stderr, "\"%s\n", s ? "" : " (NULL)");
+}
+
+static int differ(const char *kernel, const char *line, const char *arg,
+                  const char *want, int want_n, const char *got, int got_n)
+{
+    if ((!want || !got) ? want == got
+                        : strcmp(want, got) == 0 && want_n == got_n)
+        return 0;
+    fprintf(stderr, "fuzz: %s mismatch (seed %llu, iteration %ld)\n",
+            kernel, seed, iter);
+    show("line", line);
+    show("arg", arg);
+    show("reference", want);
+    show("replace.c", got);
+    fprintf(stderr, "  count: reference %d, replace.c %d\n", want_n, got_n);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    rng_state = seed ? seed : 1;
+
+    regex_t res[sizeof(regexes) / sizeof(regexes[0])];
+    size_t nre = sizeof(regexes) / sizeof(regexes[0]);
+    for (size_t i = 0; i < nre; i++)
+        if (regcomp(&res[i], regexes[i], REG_EXTENDED) != 0)
+            return 2;
+
+    char line[600], pat[8], repl[8], text[4096];
+    for (iter = 0; iter < iterations; iter++)
+    {
+        rand_text(line, rnd(8) == 0 ? 512 : 40, "aab,\n");
+        rand_text(repl, 4, "abX,");
+        int g = (int)rnd(2), n1 = 0, n2 = 0;
+        char *want, *got;
+
+        do
+            rand_text(pat, 4, "ab,");
+        while (!*pat);
+        want = ref_replace_in_string(line, pat, repl, g, &n1);
+        got = replace_in_string(line, pat, repl, g, &n2);
+        int bad = differ("literal", line, pat, want, n1, got, n2);
+        free(want);
+        free(got);
+
+        size_t r = rnd((unsigned)nre);
+        char srepl[8];
+        IvSubst prog;
+        rand_text(srepl, 6, "aX&\\01");
+        if (subst_compile(&prog, srepl) != 0)
+            return 2;
+        /* A line split at '\n' never ends in two: the frozen kernel would
+         * stop before the inner one */
+        size_t ll = strlen(line);
+        while (ll > 1 && line[ll - 1] == '\n' && line[ll - 2] == '\n')
+            line[--ll] = '\0';
+        want = ref_subst_line(line, &res[r], srepl, g, &n1);
+        got = replace_subst_in_string(line, &res[r], &prog, g, &n2);
+        bad |= differ("regex", line, regexes[r], want, n1, got, n2);
+        if (bad)
+            show("replacement", srepl);
+        subst_free(&prog);
+        free(want);
+        free(got);
+
+        int field = 1 + (int)rnd(6);
+        want = ref_replace_field_in_line(line, ',', field, repl);
+        got = replace_field_in_line(line, ',', field, repl);
+        bad |= differ("field", line, repl, want, 0, got, 0);
+        free(want);
+        free(got);
+
+        /* Matcher: random ERE, random case folding, one line */
+        if (iter % 2 == 0)
+        {
+            char mpat[12];
+            int ok, icase = (int)rnd(2);
+            IvMatcher m;
+            rand_text(mpat, 10, "aabB,.*+?()[]^$\\{2}");
+            char *mline = strchr(line, '\n') ? strndup(line, (size_t)(strchr(line, '\n') - line) + 1)
+                                              : strdup(line);
+            int want_m = ref_match(mline, mpat, icase, &ok);
+            if (ok && matcher_compile(&m, mpat, IV_MATCH_REGEX | (icase ? IV_MATCH_ICASE : 0)) == 0)
+            {
+                int got_m = matcher_match(&m, mline, strlen(mline));
+                if (got_m != want_m)
+                {
+                    fprintf(stderr, "fuzz: matcher mismatch (seed %llu, iteration %ld)\n",
+                            seed, iter);
+                    show("line", mline);
+                    show("pattern", mpat);
+                    fprintf(stderr, "  icase %d: regexec %d, matcher %d\n",
+                            icase, want_m, got_m);
+                    for (int k = 0; k < m.nneed; k++)
+                        show("needs", m.need[k]);
+                    bad = 1;
+                }
+                matcher_free(&m);
+            }
+            free(mline);
+        }
+
+        /* -I literal: matcher_find() through the replace kernel */
+        if (iter % 2 == 1)
+        {
+            char fline[256], fpat[64];
+            IvMatcher m;
+            rand_tokens(fline, 24);
+            do
+                rand_tokens(fpat, 3);
+            while (!*fpat);
+            if (matcher_compile(&m, fpat, IV_MATCH_ICASE) != 0)
+                return 2;
+            want = ref_fold_replace(fline, fpat, "<>", g, &n1);
+            got = replace_matcher_in_string(fline, &m, "<>", g, &n2);
+            bad |= differ("ignore-case", fline, fpat, want, n1, got, n2);
+            if (matcher_match(&m, fline, strlen(fline)) != (n1 > 0))
+            {
+                fprintf(stderr, "fuzz: ignore-case match mismatch (seed %llu, iteration %ld)\n",
+                        seed, iter);
+                show("line", fline);
+                show("pattern", fpat);
+                bad = 1;
+            }
+            matcher_free(&m);
+            free(want);
+            free(got);
+        }
+
+        /* Several lines through field.c vs the kernel line by line */
+        if (iter % 8 == 0)
+        {
+            size_t tl = 0, wl = 0;
+            char *expect = calloc(8, sizeof(text));
+            int lines = 1 + (int)rnd(6);
+            for (int l = 0; l < lines && expect; l++)
+            {
+                rand_text(line, rnd(16) == 0 ? 512 : 30, "ab,,");
+                if (l < lines - 1 || rnd(2))
+                    strcat(line, "\n");
+                size_t ll = strlen(line);
+                if (ll == 0) /* not a line: nothing follows it */
+                    continue;
+                if (tl + ll >= sizeof(text))
+                    break;
+                memcpy(text + tl, line, ll + 1);
+                tl += ll;
+                char *r = ref_replace_field_in_line(line, ',', field, repl);
+                size_t rl = r ? strlen(r) : 0;
+                memcpy(expect + wl, r, rl + 1);
+                wl += rl;
+                free(r);
+            }
+            text[tl] = '\0';
+            got = field_stream_text(text, field, repl, 0);
+            bad |= differ("field_stream", text, repl, expect, 0, got, 0);
+            free(expect);
+            free(got);
+        }
+
+        /* --csv: quotes, CRLF and records spanning lines and 64-byte chunks */
+        if (iter % 8 == 4)
+        {
+            rand_text(text, rnd(8) == 0 ? 4000 : 200, "aaa,,\"\"\n\r");
+            rand_text(repl, 4, "a,\"\n");
+            want = ref_csv_replace(text, field, repl);
+            got = field_stream_text(text, field, repl, 1);
+            bad |= differ("csv", text, repl, want, 0, got, 0);
+            free(want);
+            free(got);
+        }
+
+        /* Piece table: random edits against a flat copy */
+        if (iter % 8 == 2)
+        {
+            int fds[2];
+            rand_text(text, rnd(4) == 0 ? 2000 : 60, "ab\n");
+            size_t flen = strlen(text);
+            char *flat = malloc(sizeof(text) * 4);
+            IvDoc d;
+            if (!flat || pipe(fds) != 0 || write(fds[1], text, flen) != (ssize_t)flen)
+                return 2;
+            close(fds[1]);
+            if (doc_load(&d, fds[0]) != 0)
+                return 2;
+            close(fds[0]);
+            memcpy(flat, text, flen);
+            for (int e = (int)rnd(24); e > 0; e--)
+            {
+                size_t pos = rnd((unsigned)flen + 1);
+                if (rnd(2) && flen + 8 < sizeof(text) * 4)
+                {
+                    rand_text(repl, 6, "XY\n");
+                    size_t rl = strlen(repl);
+                    memmove(flat + pos + rl, flat + pos, flen - pos);
+                    memcpy(flat + pos, repl, rl);
+                    flen += rl;
+                    if (doc_insert(&d, pos, repl, rl) != 0)
+                        return 2;
+                }
+                else
+                {
+                    size_t n = rnd((unsigned)(flen - pos) + 1);
+                    memmove(flat + pos, flat + pos + n, flen - pos - n);
+                    flen -= n;
+                    if (doc_delete(&d, pos, n) != 0)
+                        return 2;
+                }
+            }
+            flat[flen] = '\0';
+            char *out = NULL;
+            size_t out_len = 0;
+            FILE *mf = open_memstream(&out, &out_len);
+            if (!mf)
+                return 2;
+            doc_write(&d, mf);
+            fclose(mf);
+            bad |= differ("piece", text, "", flat, (int)flat_lines(flat, flen),
+                          out, (int)doc_lines(&d));
+            long long probe = 1 + (long long)rnd((unsigned)flat_lines(flat, flen) + 2);
+            if (!bad && doc_line_offset(&d, probe) != flat_line_offset(flat, flen, probe))
+            {
+                fprintf(stderr, "fuzz: piece line offset mismatch (seed %llu, iteration %ld)\n",
+                        seed, iter);
+                show("text", flat);
+                fprintf(stderr, "  line %lld: flat %zu, piece %zu\n", probe,
+                        flat_line_offset(flat, flen, probe), doc_line_offset(&d, probe));
+                bad = 1;
+            }
+            free(out);
+            free(flat);
+            doc_free(&d);
+        }
+
+        /* XXH64: the same digest whatever the split of the input */
+        if (iter % 8 == 6)
+        {
+            rand_text(text, rnd(4) == 0 ? 4000 : 100, "abc\n");
+            size_t hlen = strlen(text), pos = 0;
+            uint64_t want_h = hash64(text, hlen);
+            IvHash h;
+            hash_init(&h);
+            while (pos < hlen)
+            {
+                size_t n = rnd(40);
+                if (n > hlen - pos)
+                    n = hlen - pos;
+                hash_update(&h, text + pos, n);
+                pos += n;
+            }
+            if (hash_digest(&h) != want_h)
+            {
+                fprintf(stderr, "fuzz: hash mismatch (seed %llu, iteration %ld)\n",
+                        seed, iter);
+                show("text", text);
+                bad = 1;
+            }
+        }
+
+        if (bad)
+            return 1;
+    }
+    for (size_t i = 0; i < nre; i++)
+        regfree(&res[i]);
+    printf("fuzz: %ld iterations, seed %llu, no differences\n", iterations, seed);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Deterministic synthetic corpus for `make bench`.
+ *
+ *   gencorpus BYTES LINE_LEN MATCH_EVERY [SEED] > file
+ *
+ * Writes about BYTES bytes of comma-separated words, lines of roughly
+ * LINE_LEN bytes. Every MATCH_EVERY-th line (on average) contains the token
+ * NEEDLE, so `-n`, `-s` and `-m` runs can pick rare or frequent matches.
+ * The same arguments always produce the same bytes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static uint64_t state;
+
+/* xorshift64*: fast, and identical on every platform */
+static uint64_t next_rand(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+static const char *words[] = {
+    "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta",
+    "iota", "kappa", "lambda", "mu", "nu", "xi", "omicron", "pi", "rho",
+    "sigma", "tau", "upsilon", "phi", "chi", "psi", "omega", "0", "17",
+    "2048", "foo", "bar", "baz", "qux", "value", "key", "id"};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s BYTES LINE_LEN MATCH_EVERY [SEED]\n", argv[0]);
+        return 1;
+    }
+    long long total = atoll(argv[1]);
+    int line_len = atoi(argv[2]);
+    long match_every = atol(argv[3]);
+    state = argc > 4 ? strtoull(argv[4], NULL, 10) : 0x9E3779B97F4A7C15ULL;
+    if (!state)
+        state = 1;
+    if (line_len < 8)
+        line_len = 8;
+    if (match_every < 1)
+        match_every = 1;
+
+    static char out[1 << 16];
+    size_t used = 0;
+    long long written = 0;
+    const int nwords = (int)(sizeof(words) / sizeof(words[0]));
+    while (written < total)
+    {
+        char line[8192];
+        int len = 0;
+        int target = line_len / 2 + (int)(next_rand() % (uint64_t)line_len);
+        if (target > (int)sizeof(line) - 32)
+            target = (int)sizeof(line) - 32;
+        int needle = next_rand() % (uint64_t)match_every == 0;
+        int at = needle ? (int)(next_rand() % (uint64_t)(target / 8 + 1)) : -1;
+        for (int w = 0; len < target; w++)
+        {
+            const char *word = (w == at) ? "NEEDLE" : words[next_rand() % (uint64_t)nwords];
+            size_t wl = strlen(word);
+            if (len)
+                line[len++] = ',';
+            memcpy(line + len, word, wl);
+            len += (int)wl;
+        }
+        if (needle && at * 2 >= target)
+        {
+            memcpy(line + len, ",NEEDLE", 7);
+            len += 7;
+        }
+        line[len++] = '\n';
+        if (used + (size_t)len > sizeof(out))
+        {
+            fwrite(out, 1, used, stdout);
+            used = 0;
+        }
+        memcpy(out + used, line, (size_t)len);
+        used += (size_t)len;
+        written += len;
+    }
+    fwrite(out, 1, used, stdout);
+    return 0;
+}
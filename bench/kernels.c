@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Microbenchmarks for the replace kernels, reference vs replace.c.
+ *
+ *   kernels [filter] [min_seconds]
+ *
+ * One line per case, Google Benchmark style:
+ *   BM_<kernel>/<variant>/len:N/pat:N/density:N%/g:N   ns/op   iterations   MB/s
+ * density is the share of the line covered by matches. BM_regex replaces
+ * with a literal, BM_backref with "<&:\\0>" (the ref variant re-reads it at
+ * every match, replace.c runs the compiled program). BM_match tests a line
+ * against the ERE "<pat>[0-9]*": regexec() as -s -m used to, against
+ * match.c with its literal prefilter. BM_icase looks for the pattern in
+ * capitals: a lowercased copy of the line and strstr() against match.c's
+ * in-place SSE2 fold. filter keeps only the cases whose name contains it. */
+
+#define _POSIX_C_SOURCE 200809L
+#include "../iv.h"
+#include "replace_ref.h"
+#include <time.h>
+#include <ctype.h>
+
+typedef char *(*LiteralFn)(const char *, const char *, const char *, int, int *);
+typedef char *(*FieldFn)(const char *, char, int, const char *);
+
+/* The regex kernels differ in signature: variant 0 is the reference */
+static const struct
+{
+    const char *name;
+    LiteralFn literal;
+    FieldFn field;
+} variants[] = {
+    {"ref", ref_replace_in_string, ref_replace_field_in_line},
+    {"iv", replace_in_string, replace_field_in_line},
+};
+
+static char *regex_variant(size_t v, const char *line, regex_t *re,
+                           const char *repl, const IvSubst *prog, int g, int *n)
+{
+    return v == 0 ? ref_replace_regex_in_string(line, re, repl, g, n)
+                  : replace_subst_in_string(line, re, prog, g, n);
+}
+
+static const int line_lens[] = {16, 80, 512, 4096};
+static const int pat_lens[] = {1, 4, 16};
+static const int densities[] = {0, 1, 10, 50};
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/* Filler never contains pattern bytes ('x'..'z') or ','. */
+static void make_line(char *line, int len, const char *pat, int density)
+{
+    int plen = (int)strlen(pat);
+    for (int i = 0; i < len; i++)
+        line[i] = (char)('a' + i % 7);
+    if (density > 0)
+    {
+        int step = plen * 100 / density;
+        for (int i = 0; i + plen <= len; i += step)
+            memcpy(line + i, pat, (size_t)plen);
+    }
+    line[len - 1] = '\n';
+    line[len] = '\0';
+}
+
+static void make_csv_line(char *line, int len)
+{
+    for (int i = 0; i < len; i++)
+        line[i] = i % 8 == 7 ? ',' : (char)('a' + i % 7);
+    line[len - 1] = '\n';
+    line[len] = '\0';
+}
+
+static void report(const char *name, int len, double secs, long iters)
+{
+    double ns = secs * 1e9 / (double)iters;
+    printf("%-52s %10.1f ns %12ld %10.1f MB/s\n", name, ns, iters,
+           (double)len * (double)iters / secs / 1e6);
+}
+
+/* Run fn until min_secs have passed; returns elapsed seconds. */
+#define TIME_LOOP(min_secs, iters, body)                   \
+    do                                                     \
+    {                                                      \
+        double t0_ = now(), el_ = 0;                       \
+        long batch_ = 16;                                  \
+        iters = 0;                                         \
+        while (el_ < (min_secs))                           \
+        {                                                  \
+            for (long k_ = 0; k_ < batch_; k_++)           \
+            {                                              \
+                body;                                      \
+            }                                              \
+            iters += batch_;                               \
+            batch_ *= 2;                                   \
+            el_ = now() - t0_;                             \
+        }                                                  \
+        elapsed = el_;                                     \
+    } while (0)
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+    double min_secs = argc > 2 ? atof(argv[2]) : 0.1;
+    char line[4097], pat[17], name[128];
+    double elapsed;
+    long iters;
+    int n;
+    IvSubst lit_prog, ref_prog;
+    if (subst_compile(&lit_prog, "RR") != 0 || subst_compile(&ref_prog, "<&:\\0>") != 0)
+        return 1;
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+        for (size_t li = 0; li < sizeof(line_lens) / sizeof(int); li++)
+        {
+            int len = line_lens[li];
+            for (size_t pi = 0; pi < sizeof(pat_lens) / sizeof(int); pi++)
+            {
+                int plen = pat_lens[pi];
+                if (plen >= len)
+                    continue;
+                for (int i = 0; i < plen; i++)
+                    pat[i] = (char)('x' + i % 3);
+                pat[plen] = '\0';
+                regex_t re, mre;
+                IvMatcher m, im;
+                char mpat[32], upat[17], lower[4097];
+                snprintf(mpat, sizeof(mpat), "%s[0-9]*", pat);
+                for (int i = 0; i <= plen; i++)
+                    upat[i] = (char)toupper((unsigned char)pat[i]);
+                if (regcomp(&re, pat, REG_EXTENDED) != 0 ||
+                    regcomp(&mre, mpat, REG_EXTENDED) != 0 ||
+                    matcher_compile(&m, mpat, IV_MATCH_REGEX) != 0 ||
+                    matcher_compile(&im, upat, IV_MATCH_ICASE) != 0)
+                    return 1;
+                for (size_t di = 0; di < sizeof(densities) / sizeof(int); di++)
+                {
+                    make_line(line, len, pat, densities[di]);
+                    snprintf(name, sizeof(name), "BM_match/%s/len:%d/pat:%d/density:%d%%",
+                             variants[v].name, len, plen, densities[di]);
+                    if (strstr(name, filter))
+                    {
+                        regmatch_t pm[1];
+                        if (v == 0)
+                            TIME_LOOP(min_secs, iters, n = regexec(&mre, line, 1, pm, 0));
+                        else
+                            TIME_LOOP(min_secs, iters, n = matcher_match(&m, line, (size_t)len));
+                        report(name, len, elapsed, iters);
+                    }
+                    snprintf(name, sizeof(name), "BM_icase/%s/len:%d/pat:%d/density:%d%%",
+                             variants[v].name, len, plen, densities[di]);
+                    if (strstr(name, filter))
+                    {
+                        if (v == 0)
+                            TIME_LOOP(min_secs, iters, {
+                                for (int i = 0; i <= len; i++)
+                                    lower[i] = (char)tolower((unsigned char)line[i]);
+                                n = strstr(lower, pat) != NULL;
+                            });
+                        else
+                            TIME_LOOP(min_secs, iters, n = matcher_match(&im, line, (size_t)len));
+                        report(name, len, elapsed, iters);
+                    }
+                    for (int g = 0; g <= 1; g++)
+                    {
+                        snprintf(name, sizeof(name), "BM_literal/%s/len:%d/pat:%d/density:%d%%/g:%d",
+                                 variants[v].name, len, plen, densities[di], g);
+                        if (strstr(name, filter))
+                        {
+                            TIME_LOOP(min_secs, iters,
+                                      free(variants[v].literal(line, pat, "RR", g, &n)));
+                            report(name, len, elapsed, iters);
+                        }
+                        snprintf(name, sizeof(name), "BM_regex/%s/len:%d/pat:%d/density:%d%%/g:%d",
+                                 variants[v].name, len, plen, densities[di], g);
+                        if (strstr(name, filter))
+                        {
+                            TIME_LOOP(min_secs, iters,
+                                      free(regex_variant(v, line, &re, "RR", &lit_prog, g, &n)));
+                            report(name, len, elapsed, iters);
+                        }
+                        snprintf(name, sizeof(name), "BM_backref/%s/len:%d/pat:%d/density:%d%%/g:%d",
+                                 variants[v].name, len, plen, densities[di], g);
+                        if (strstr(name, filter))
+                        {
+                            TIME_LOOP(min_secs, iters,
+                                      free(regex_variant(v, line, &re, "<&:\\0>", &ref_prog, g, &n)));
+                            report(name, len, elapsed, iters);
+                        }
+                    }
+                }
+                regfree(&re);
+                regfree(&mre);
+                matcher_free(&m);
+                matcher_free(&im);
+            }
+            make_csv_line(line, len);
+            snprintf(name, sizeof(name), "BM_field/%s/len:%d/field:3", variants[v].name, len);
+            if (strstr(name, filter))
+            {
+                TIME_LOOP(min_secs, iters,
+                          free(variants[v].field(line, ',', 3, "value")));
+                report(name, len, elapsed, iters);
+            }
+        }
+    subst_free(&lit_prog);
+    subst_free(&ref_prog);
+    return 0;
+}
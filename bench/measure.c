@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Run one command and print a JSON record of what it cost.
+ *
+ *   measure NAME BYTES -- command [args...]
+ *
+ * Output: {"name":..., "bytes":..., "wall_s":..., "user_s":..., "sys_s":...,
+ *          "maxrss_kb":..., "mb_per_s":..., "status":...}
+ * The command's stdout and stderr are discarded. BYTES is the input
+ * size used for the throughput figure (0 = not meaningful). */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static double tv_s(struct timeval tv)
+{
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5 || strcmp(argv[3], "--") != 0)
+    {
+        fprintf(stderr, "usage: %s NAME BYTES -- command [args...]\n", argv[0]);
+        return 1;
+    }
+    const char *name = argv[1];
+    long long bytes = atoll(argv[2]);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+        {
+            dup2(null, 1);
+            dup2(null, 2);
+        }
+        execvp(argv[4], argv + 4);
+        perror(argv[4]);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+    {
+        perror("wait4");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mbps = (bytes > 0 && wall > 0) ? (double)bytes / wall / 1e6 : 0;
+    printf("{\"name\":\"%s\",\"bytes\":%lld,\"wall_s\":%.6f,\"user_s\":%.6f,"
+           "\"sys_s\":%.6f,\"maxrss_kb\":%ld,\"mb_per_s\":%.1f,\"status\":%d}\n",
+           name, bytes, wall, tv_s(ru.ru_utime), tv_s(ru.ru_stime),
+           ru.ru_maxrss, mbps, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+}
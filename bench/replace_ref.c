@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Reference replace kernels: frozen copies of replace.c as of the split,
+ * without instrumentation. bench/fuzz checks that replace.c (and whatever
+ * optimized variant replaces it) stays byte-identical to these; do not
+ * optimize this file. The regex one is the old loop re-reading the
+ * replacement at every match, with \0..\9 and & semantics. */
+
+#include "replace_ref.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ── Literal ────────────────────────────────────────────────────────────── */
+
+char *ref_replace_in_string(const char *line, const char *pat,
+                            const char *repl, int global, int *n)
+{
+    size_t plen = strlen(pat);
+    size_t rlen = strlen(repl);
+    size_t cap = strlen(line) + 256;
+    char *out = malloc(cap);
+    if (!out)
+        return NULL;
+    size_t len = 0;
+    const char *cur = line;
+    *n = 0;
+    while (*cur)
+    {
+        const char *p = strstr(cur, pat);
+        if (!p)
+        {
+            size_t rest = strlen(cur);
+            if (len + rest + 1 >= cap)
+            {
+                cap = len + rest + 1;
+                char *tmp = realloc(out, cap);
+                if (!tmp)
+                {
+                    free(out);
+                    return NULL;
+                }
+                out = tmp;
+            }
+            memcpy(out + len, cur, rest);
+            len += rest;
+            break;
+        }
+        size_t before = (size_t)(p - cur);
+        if (len + before + rlen + 1 >= cap)
+        {
+            cap = len + before + rlen + 256;
+            char *tmp = realloc(out, cap);
+            if (!tmp)
+            {
+                free(out);
+                return NULL;
+            }
+            out = tmp;
+        }
+        memcpy(out + len, cur, before);
+        len += before;
+        memcpy(out + len, repl, rlen);
+        len += rlen;
+        cur = p + plen;
+        (*n)++;
+        if (!global)
+        {
+            size_t rest = strlen(cur);
+            if (len + rest + 1 >= cap)
+            {
+                cap = len + rest + 256;
+                char *tmp = realloc(out, cap);
+                if (!tmp)
+                {
+                    free(out);
+                    return NULL;
+                }
+                out = tmp;
+            }
+            memcpy(out + len, cur, rest);
+            len += rest;
+            break;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/* ── Regex ──────────────────────────────────────────────────────────────── */
+
+/* Append the replacement for one match, reading repl from scratch. */
+static size_t ref_expand(char *out, const char *repl, const char *cur,
+                         const regmatch_t *m)
+{
+    size_t len = 0;
+    for (const char *p = repl; *p; p++)
+    {
+        int g = -1;
+        if (*p == '&')
+            g = 0;
+        else if (*p == '\\' && p[1] >= '0' && p[1] <= '9')
+            g = *++p - '0';
+        else if (*p == '\\' && (p[1] == '&' || p[1] == '\\'))
+            p++;
+        if (g < 0)
+        {
+            if (out)
+                out[len] = *p;
+            len++;
+        }
+        else if (m[g].rm_so >= 0)
+        {
+            size_t gl = (size_t)(m[g].rm_eo - m[g].rm_so);
+            if (out)
+                memcpy(out + len, cur + m[g].rm_so, gl);
+            len += gl;
+        }
+    }
+    return len;
+}
+
+char *ref_replace_regex_in_string(const char *line, regex_t *re,
+                                  const char *repl, int global, int *n)
+{
+    size_t cap = strlen(line) + 256;
+    char *out = malloc(cap);
+    if (!out)
+        return NULL;
+    size_t len = 0;
+    const char *cur = line;
+    regmatch_t m[10];
+    int after_match = 0;
+    *n = 0;
+    while (regexec(re, cur, 10, m, cur == line ? 0 : REG_NOTBOL) == 0)
+    {
+        size_t before = (size_t)m[0].rm_so;
+        int empty = m[0].rm_so == m[0].rm_eo;
+        if (!(empty && before == 0 && after_match))
+        {
+            size_t rlen = ref_expand(NULL, repl, cur, m);
+            if (len + before + rlen + 2 >= cap)
+            {
+                cap = len + before + rlen + 256;
+                char *tmp = realloc(out, cap);
+                if (!tmp)
+                {
+                    free(out);
+                    return NULL;
+                }
+                out = tmp;
+            }
+            memcpy(out + len, cur, before);
+            len += before;
+            len += ref_expand(out + len, repl, cur, m);
+            cur += m[0].rm_eo;
+            (*n)++;
+            after_match = !empty;
+            if (!global)
+                break;
+            if (!empty)
+                continue;
+        }
+        if (!*cur || (*cur == '\n' && !cur[1]))
+            break;
+        out[len++] = *cur++;
+        after_match = 0;
+    }
+    size_t rest = strlen(cur);
+    if (len + rest + 1 >= cap)
+    {
+        char *tmp = realloc(out, len + rest + 1);
+        if (!tmp)
+        {
+            free(out);
+            return NULL;
+        }
+        out = tmp;
+    }
+    memcpy(out + len, cur, rest + 1);
+    return out;
+}
+
+/* ── Field ──────────────────────────────────────────────────────────────── */
+
+char *ref_replace_field_in_line(const char *line, char delim,
+                                int field_num, const char *value)
+{
+    size_t vlen = strlen(value);
+    size_t linelen = strlen(line);
+    char *out = malloc(linelen + vlen + 64);
+    if (!out)
+        return NULL;
+    const char *p = line, *field_start = line;
+    int f = 1;
+    while (f < field_num && *p)
+    {
+        if (*p == delim)
+        {
+            f++;
+            p++;
+            field_start = p;
+        }
+        else
+            p++;
+    }
+    if (f != field_num)
+    {
+        strcpy(out, line);
+        return out;
+    }
+    size_t len = (size_t)(field_start - line);
+    memcpy(out, line, len);
+    memcpy(out + len, value, vlen + 1);
+    len += vlen;
+    while (*p && *p != delim && *p != '\n')
+        p++;
+    strcpy(out + len, p);
+    return out;
+}
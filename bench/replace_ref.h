@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+#ifndef IV_REPLACE_REF_H
+#define IV_REPLACE_REF_H
+
+#include <regex.h>
+
+/* Same contracts as the kernels declared in iv.h; the regex one takes
+ * the replacement text where replace.c takes a compiled IvSubst. */
+char *ref_replace_in_string(const char *line, const char *pat,
+                            const char *repl, int global, int *n);
+char *ref_replace_regex_in_string(const char *line, regex_t *re,
+                                  const char *repl, int global, int *n);
+char *ref_replace_field_in_line(const char *line, char delim,
+                                int field_num, const char *value);
+
+#endif
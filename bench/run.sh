@@ -0,0 +1,139 @@
+#!/bin/sh
+# Benchmark iv commands on a deterministic synthetic corpus.
+#
+#   bench/run.sh ./iv > results.jsonl
+#
+# One JSON record per line (see measure.c), plus "corpus" and "syscalls"
+# (null when strace is not installed). Environment:
+#   BENCH_SIZES  corpus sizes to run: small (1 MB), medium (32 MB), huge (512 MB)
+#                default "small medium"
+#   BENCH_WORK   scratch directory (default bench/corpus)
+#   BENCH_SLOTS  backup slots to pre-create for the rotation benchmark (200)
+
+set -e
+
+IV=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=${BENCH_WORK:-$HERE/corpus}
+SIZES=${BENCH_SIZES:-"small medium"}
+SLOTS=${BENCH_SLOTS:-200}
+
+mkdir -p "$WORK"
+export IV_BACKUP_DIR="$WORK/backups"
+export IV_BACKUP_MAX_SLOTS=0 IV_BACKUP_MAX_BYTES=0 # keep every rotation slot
+unset IV_SOCKET IV_STATS
+
+if command -v strace >/dev/null 2>&1; then HAVE_STRACE=1; else HAVE_STRACE=0; fi
+
+size_bytes()
+{
+    case $1 in
+        small) echo 1000000 ;;
+        medium) echo 32000000 ;;
+        huge) echo 512000000 ;;
+        *) echo "unknown size $1" >&2; exit 1 ;;
+    esac
+}
+
+# corpus NAME BYTES LINE_LEN MATCH_EVERY: generate once, reuse across runs
+corpus()
+{
+    CORPUS=$1
+    SRC="$WORK/$1.txt"
+    [ -f "$SRC" ] || "$HERE/gencorpus" "$2" "$3" "$4" > "$SRC"
+    BYTES=$(wc -c < "$SRC")
+}
+
+syscalls()
+{
+    if [ "$HAVE_STRACE" = 1 ]; then
+        strace -f -c -o "$WORK/strace.out" "$@" > /dev/null 2>&1 || true
+        awk '$NF == "total" { print $4 }' "$WORK/strace.out"
+    else
+        echo null
+    fi
+}
+
+emit()
+{
+    rec=$1
+    echo "${rec%\}},\"corpus\":\"$CORPUS\",\"syscalls\":${2:-null}}"
+}
+
+# run NAME -- command: read-only commands on the corpus itself
+run()
+{
+    name=$1
+    shift 2
+    rec=$("$HERE/measure" "$name" "$BYTES" -- "$@")
+    emit "$rec" "$(syscalls "$@")"
+}
+
+# edit NAME -- command: each run works on a fresh copy at $W
+edit()
+{
+    name=$1
+    shift 2
+    cp "$SRC" "$W"
+    rec=$("$HERE/measure" "$name" "$BYTES" -- "$@")
+    cp "$SRC" "$W"
+    emit "$rec" "$(syscalls "$@")"
+}
+
+W="$WORK/work.txt"
+for size in $SIZES; do
+    bytes=$(size_bytes "$size")
+    for shape in short-rare:40:10000 short-freq:40:4 long-rare:400:10000; do
+        name=${shape%%:*}
+        rest=${shape#*:}
+        corpus "$size-$name" "$bytes" "${rest%%:*}" "${rest#*:}"
+
+        run view-v -- "$IV" -v "$SRC"
+        run view-va -- "$IV" -va 1000-2000 "$SRC"
+        run wc -- "$IV" -wc "$SRC"
+        run find-n -- "$IV" -n "$SRC" NEEDLE
+        run find-nv -- "$IV" -nv "$SRC" NEEDLE
+        run find-first -- "$IV" -n "$SRC" NEEDLE --first
+        run find-count -- "$IV" -n "$SRC" NEEDLE --count
+        run find-regex -- "$IV" -n "$SRC" "NE+DLE" -E
+        run find-icase -- "$IV" -nv "$SRC" needle -I
+
+        edit s-literal -- "$IV" -s "$W" NEEDLE HAYSTACK --no-backup
+        edit s-regex -- "$IV" -s "$W" "NE+DLE" X -E --no-backup
+        edit s-global -- "$IV" -s "$W" alpha ALPHA -g --no-backup
+        edit s-pairs -- "$IV" -s "$W" alpha A -e beta B -e gamma G -g --no-backup
+        edit s-field -- "$IV" -s "$W" -F , 2 X --no-backup
+        edit d-match -- "$IV" -d "$W" -m NEEDLE --no-backup
+        edit i-range -- "$IV" -i "$W" 10 HEADER -q --no-backup
+        edit append -- "$IV" -a "$W" TAIL -q
+        edit s-backup -- "$IV" -s "$W" NEEDLE HAYSTACK
+        edit diff -- "$IV" -diff "$W"
+
+        cp "$SRC" "$W.2"
+        cp "$SRC" "$W.3"
+        edit p-multi -- "$IV" -p "$W" "$W.2" "$W.3" PATCH -q --no-backup
+        rm -f "$W.2" "$W.3"
+    done
+done
+
+# Backup rotation with many existing slots, on a small file
+CORPUS=rotation
+SRC="$WORK/rotation.txt"
+"$HERE/gencorpus" 4096 40 4 > "$SRC"
+BYTES=$(wc -c < "$SRC")
+R="$WORK/rotate.txt"
+cp "$SRC" "$R"
+"$IV" -rmbak "$R" 2> /dev/null || true
+# Each edit must change the file, or there is nothing to back up
+i=0
+while [ $i -lt "$SLOTS" ]; do
+    if [ $((i % 2)) -eq 0 ]; then FROM=NEEDLE TO=NEEDLX; else FROM=NEEDLX TO=NEEDLE; fi
+    "$IV" -s "$R" $FROM $TO > /dev/null 2>&1
+    i=$((i + 1))
+done
+if [ $((i % 2)) -eq 0 ]; then FROM=NEEDLE TO=NEEDLX; else FROM=NEEDLX TO=NEEDLE; fi
+run backup-rotate -- "$IV" -s "$R" $FROM $TO
+"$IV" -rmbak "$R" 2> /dev/null || true
+
+rm -f "$W" "$R" "$WORK/strace.out"
+rm -rf "$IV_BACKUP_DIR"
@@ -10,8 +10,8 @@ _iv()
     cur=${COMP_WORDS[COMP_CWORD]}
     prev=${COMP_WORDS[COMP_CWORD-1]}
 
-    local cmds="-h --help -V --version -v -va -wc -n -nv -u -diff -i -insert -a -p -pi -d -delete -r -replace -s -l -lb -lsbak -rmbak -z"
-    local opts="--dry-run --no-backup --no-numbers -g -E --regex -q --stdout --json --persist --unpersist -persistence -unpersist -m -F -e"
+    local cmds="-h --help -V --version -v -va -wc -n -nv -u -diff -i -insert -a -p -pi -d -delete -r -replace -s -l -lb -lsbak -rmbak -rebuildbak -z --gc"
+    local opts="--dry-run --no-backup --no-numbers -g -E --regex -I --ignore-case -q --stdout --json --persist --unpersist -persistence -unpersist -m -F --where --csv -e --follow -A -B -C --max --first --count --serve --stats --stats=json"
 
     # If completing the first argument (the main command/flag)
     if [[ ${COMP_CWORD} -eq 1 ]]; then
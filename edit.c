@@ -11,6 +11,8 @@
 #include <pwd.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 /* ── Internal utilities ─────────────────────────────────────────────────── */
 
@@ -110,6 +112,21 @@ static int join_path_num(char *dst, size_t dstsz, const char *a,
     return join_path2(dst, dstsz, a, tail);
 }
 
+/* mkstemp() of dir/name (name ending in XXXXXX), with the mode fopen()
+ * would have given the file. Returns the descriptor or -1. */
+static int make_temp_in(const char *dir, const char *name, char *path, size_t size)
+{
+    if (join_path2(path, size, dir, name) != 0)
+        return -1;
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    return fd;
+}
+
 /* ── Backup root ────────────────────────────────────────────────────────── */
 
 const char *get_backup_root(int persisted)
@@ -166,10 +183,56 @@ const char *get_backup_root(int persisted)
 
 /* ── Per-file subdirectory ──────────────────────────────────────────────── */
 
+/* Repo roots already found during this run, keyed by the directory the
+ * walk started from, so files in the same directory share one walk. Only
+ * .git roots go in: without one the name is the file's own. */
+#define REPO_CACHE_SIZE 16
+
+static struct
+{
+    char dir[PATH_MAX];
+    char name[256];
+} repo_cache[REPO_CACHE_SIZE];
+static int repo_cache_used, repo_cache_next;
+
+static int find_repo_root_name_uncached(const char *abspath, char *repo_name,
+                                        size_t size);
+
+static void find_repo_root_name(const char *abspath, char *repo_name, size_t size)
+{
+    const char *slash = strrchr(abspath ? abspath : "", '/');
+    size_t dlen = slash ? (size_t)(slash - abspath) : 0;
+    if (size == 0 || dlen >= PATH_MAX)
+    {
+        find_repo_root_name_uncached(abspath, repo_name, size);
+        return;
+    }
+    for (int i = 0; i < repo_cache_used; i++)
+        if (strncmp(repo_cache[i].dir, abspath, dlen) == 0 &&
+            repo_cache[i].dir[dlen] == '\0')
+        {
+            snprintf(repo_name, size, "%s", repo_cache[i].name);
+            return;
+        }
+
+    if (!find_repo_root_name_uncached(abspath, repo_name, size))
+        return;
+
+    int i = repo_cache_next;
+    repo_cache_next = (repo_cache_next + 1) % REPO_CACHE_SIZE;
+    if (repo_cache_used < REPO_CACHE_SIZE)
+        repo_cache_used++;
+    memcpy(repo_cache[i].dir, abspath, dlen);
+    repo_cache[i].dir[dlen] = '\0';
+    snprintf(repo_cache[i].name, sizeof(repo_cache[i].name), "%s", repo_name);
+}
+
 /* Find the repository root directory by walking up from path:
  * the first directory that contains .git, or the highest reachable directory.
- * Copies the basename (not the full path) into repo_name. */
-static void find_repo_root_name(const char *abspath, char *repo_name, size_t size)
+ * Copies the basename (not the full path) into repo_name. Returns 1 if a
+ * .git was found. */
+static int find_repo_root_name_uncached(const char *abspath, char *repo_name,
+                                        size_t size)
 {
     char dir[PATH_MAX];
     if (!abspath)
@@ -192,6 +255,7 @@ static void find_repo_root_name(const char *abspath, char *repo_name, size_t siz
         best[dlen] = '\0';
     }
 
+    int found = 0;
     for (;;)
     {
         char probe[PATH_MAX];
@@ -200,6 +264,7 @@ static void find_repo_root_name(const char *abspath, char *repo_name, size_t siz
         struct stat st;
         if (stat(probe, &st) == 0)
         {
+            found = 1;
             /* Found .git: repo root is dir */
             {
                 size_t dlen = strlen(dir);
@@ -223,7 +288,7 @@ static void find_repo_root_name(const char *abspath, char *repo_name, size_t siz
     const char *base = strrchr(best, '/');
     const char *src = base ? base + 1 : best;
     if (size == 0)
-        return;
+        return found;
     {
         size_t slen = strlen(src);
         if (slen >= size)
@@ -233,6 +298,7 @@ static void find_repo_root_name(const char *abspath, char *repo_name, size_t siz
     }
     if (!repo_name[0])
         snprintf(repo_name, size, "root");
+    return found;
 }
 
 void get_backup_subdir(const char *filename, char *buf, size_t size)
@@ -306,9 +372,38 @@ void get_backup_subdir(const char *filename, char *buf, size_t size)
     }
 }
 
+/* Backup directories resolved during this run, with mkdir_p() already done.
+ * Keyed by the filename as given, so --serve resets it per request. */
+#define DIR_CACHE_SIZE 16
+
+static struct
+{
+    char file[PATH_MAX];
+    int persisted;
+    char dir[PATH_MAX];
+} dir_cache[DIR_CACHE_SIZE];
+static int dir_cache_used, dir_cache_next;
+
+void backup_cache_reset(void)
+{
+    dir_cache_used = 0;
+    dir_cache_next = 0;
+    repo_cache_used = 0;
+    repo_cache_next = 0;
+}
+
 void get_backup_dir_for_file(const char *filename, int persisted,
                              char *buf, size_t size)
 {
+    for (int i = 0; i < dir_cache_used; i++)
+        if (dir_cache[i].persisted == persisted &&
+            strcmp(dir_cache[i].file, filename) == 0)
+        {
+            if (snprintf(buf, size, "%s", dir_cache[i].dir) >= (int)size && size)
+                buf[0] = '\0';
+            return;
+        }
+
     char subdir[PATH_MAX];
     get_backup_subdir(filename, subdir, sizeof(subdir));
     if (join_path2(buf, size, get_backup_root(persisted), subdir) != 0)
@@ -318,6 +413,16 @@ void get_backup_dir_for_file(const char *filename, int persisted,
         return;
     }
     mkdir_p(buf);
+
+    if (strlen(filename) >= PATH_MAX || strlen(buf) >= PATH_MAX)
+        return;
+    int i = dir_cache_next;
+    dir_cache_next = (dir_cache_next + 1) % DIR_CACHE_SIZE;
+    if (dir_cache_used < DIR_CACHE_SIZE)
+        dir_cache_used++;
+    strcpy(dir_cache[i].file, filename);
+    dir_cache[i].persisted = persisted;
+    strcpy(dir_cache[i].dir, buf);
 }
 
 void get_backup_path_n(const char *filename, int persisted, int n,
@@ -346,16 +451,120 @@ void get_backup_meta_path(const char *filename, int persisted, int n,
     }
 }
 
-/* ── Backup: create ─────────────────────────────────────────────────────── */
+/* ── Metadata ───────────────────────────────────────────────────────────── */
+
+typedef struct
+{
+    time_t ts;
+    char user[256];
+    long long trunc_size; /* append-undo slot: size before the append, else -1 */
+    long long trunc_from; /* append-undo slot: size right after the append */
+    int has_hash;         /* full copy whose .meta records its XXH64 */
+    uint64_t hash;
+    long long size;
+    int has_tail;         /* append-undo slot that records its window hash */
+    uint64_t tail_hash;
+} BackupMeta;
+
+/* An append-undo slot records, besides the sizes, the XXH64 of the window
+ * [undo_window_start(trunc_size), trunc_from) of the file as the append
+ * left it: the appended bytes and up to IV_UNDO_WINDOW bytes before them.
+ * Undoing requires the file to still be trunc_from bytes long and to hash
+ * the same there, so a file rewritten meanwhile is not cut short. The
+ * window keeps -a from reading the whole file. */
+#define IV_UNDO_WINDOW 65536
+
+static long long undo_window_start(long long trunc_size)
+{
+    return trunc_size > IV_UNDO_WINDOW ? trunc_size - IV_UNDO_WINDOW : 0;
+}
+
+/* Feed len bytes of fd, from off on, to h; -1 if they cannot all be read. */
+static int hash_fd_range(IvHash *h, int fd, long long off, long long len)
+{
+    char buf[65536];
+    while (len > 0)
+    {
+        size_t chunk = len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf);
+        ssize_t r = pread(fd, buf, chunk, (off_t)off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        IV_STAT(bytes_read, r);
+        hash_update(h, buf, (size_t)r);
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* A .meta is "epoch user" followed by optional lines, each read only by the
+ * versions that know it: "truncate <size> <from> [<window xxh64>]" for an
+ * append-undo slot, "xxh64 <hex> <size>" for a full copy. */
+static int read_backup_meta(const char *path_meta, BackupMeta *m)
+{
+    m->ts = 0;
+    m->user[0] = '\0';
+    m->trunc_size = -1;
+    m->trunc_from = -1;
+    m->has_hash = 0;
+    m->hash = 0;
+    m->size = -1;
+    m->has_tail = 0;
+    m->tail_hash = 0;
+    FILE *f = fopen(path_meta, "r");
+    if (!f)
+        return -1;
+    char line[512];
+    long epoch = 0;
+    int n = fgets(line, sizeof(line), f) ? sscanf(line, "%ld %255s", &epoch, m->user) : 0;
+    while (n >= 1 && fgets(line, sizeof(line), f))
+    {
+        long long a, b;
+        unsigned long long h;
+        int k = sscanf(line, "truncate %lld %lld %16llx", &a, &b, &h);
+        if (k >= 2)
+        {
+            m->trunc_size = a;
+            m->trunc_from = b;
+            m->has_tail = k == 3;
+            m->tail_hash = k == 3 ? (uint64_t)h : 0;
+        }
+        else if (sscanf(line, "xxh64 %16llx %lld", &h, &a) == 2)
+        {
+            m->has_hash = 1;
+            m->hash = (uint64_t)h;
+            m->size = a;
+        }
+    }
+    fclose(f);
+    if (n >= 1)
+    {
+        m->ts = (time_t)epoch;
+        if (n < 2)
+            m->user[0] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+/* ── Backup packs ───────────────────────────────────────────────────────── */
 
-/* Count how many backup slots exist for filename. */
-static int count_backup_slots(const char *filename, int persisted)
+/* A backup directory holds either N.bak + N.meta per slot or, with the
+ * pack backend (pack.c), a single pack. IV_BACKUP_PACK=1 makes new backups
+ * go to a pack, moving the directory's N.bak slots into it first; a
+ * directory that has a pack keeps using it whatever the setting. */
+
+/* Count how many backup slots exist in a file's backup directory. */
+static int count_backup_slots(const char *dir)
 {
     char path[PATH_MAX];
     int n = 1;
     while (1)
     {
-        get_backup_path_n(filename, persisted, n, path, sizeof(path));
+        if (join_path_num(path, sizeof(path), dir, n, ".bak") != 0)
+            break;
         struct stat st;
         if (stat(path, &st) != 0)
             break;
@@ -364,163 +573,1267 @@ static int count_backup_slots(const char *filename, int persisted)
     return n - 1;
 }
 
-void backup_file(const char *filename, int persisted)
+static int pack_wanted(void)
 {
-    int slots = count_backup_slots(filename, persisted);
+    const char *v = getenv("IV_BACKUP_PACK");
+    return v && strcmp(v, "1") == 0;
+}
 
-    /* Rotate all existing slots upward (no fixed limit) */
-    char src[PATH_MAX], dst[PATH_MAX];
-    for (int k = slots; k >= 1; k--)
-    {
-        get_backup_path_n(filename, persisted, k, src, sizeof(src));
-        get_backup_path_n(filename, persisted, k + 1, dst, sizeof(dst));
-        rename(src, dst);
+static int dir_pack_path(const char *dir, char *buf, size_t size)
+{
+    return join_path2(buf, size, dir, IV_PACK_NAME);
+}
 
-        get_backup_meta_path(filename, persisted, k, src, sizeof(src));
-        get_backup_meta_path(filename, persisted, k + 1, dst, sizeof(dst));
-        rename(src, dst);
-    }
+static int dir_has_pack(const char *dir)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    return dir_pack_path(dir, path, sizeof(path)) == 0 && stat(path, &st) == 0;
+}
 
-    /* Write slot 1 */
-    get_backup_path_n(filename, persisted, 1, dst, sizeof(dst));
-    FILE *fsrc = fopen(filename, "r");
-    if (!fsrc)
-        return;
-    FILE *fdst = fopen(dst, "w");
-    if (!fdst)
+static void pack_entry_meta(const IvPackEntry *e, BackupMeta *m)
+{
+    m->ts = (time_t)(e->epoch >= 0 ? e->epoch : 0);
+    snprintf(m->user, sizeof(m->user), "%.*s", (int)sizeof(e->user), e->user);
+    m->trunc_size = e->trunc_size;
+    m->trunc_from = e->trunc_from;
+    m->has_hash = e->has_hash && e->trunc_size < 0;
+    m->hash = e->hash;
+    m->size = m->has_hash ? (long long)e->len : -1;
+    m->has_tail = e->has_hash && e->trunc_size >= 0;
+    m->tail_hash = m->has_tail ? e->hash : 0;
+}
+
+/* A new entry stamped now by this user; a full copy unless trunc_size >= 0. */
+static void pack_entry_init(IvPackEntry *e, long long trunc_size, long long trunc_from)
+{
+    memset(e, 0, sizeof(*e));
+    e->epoch = (int64_t)time(NULL);
+    snprintf(e->user, sizeof(e->user), "%s", get_username());
+    e->trunc_size = trunc_size;
+    e->trunc_from = trunc_from;
+}
+
+/* Open the pack in dir. For reading, 0 only if there is a sound one. For
+ * writing it is created if missing, taking over the N.bak slots; a damaged
+ * one is set aside as pack.bad and a new one started. */
+static int open_dir_pack(const char *dir, IvPack *p, int write)
+{
+    char path[PATH_MAX], bad[PATH_MAX + 8];
+    if (dir_pack_path(dir, path, sizeof(path)) != 0)
+        return -1;
+    int had = dir_has_pack(dir);
+    int rc = pack_open(p, path, write);
+    if (rc == -2)
     {
-        fclose(fsrc);
-        return;
+        fprintf(stderr, "iv: damaged backup pack %s\n", path);
+        if (!write)
+            return -1;
+        snprintf(bad, sizeof(bad), "%s.bad", path);
+        if (rename(path, bad) == 0)
+            fprintf(stderr, "iv: moved it to %s and started a new one\n", bad);
+        rc = pack_open(p, path, 1);
     }
-    char *line = NULL;
-    size_t cap = 0;
-    while (getline(&line, &cap, fsrc) != -1)
-        fputs(line, fdst);
-    free(line);
-    fclose(fsrc);
-    fclose(fdst);
+    if (rc != 0 || !write || had || p->n)
+        return rc; /* p->n: another run took the slots over while we waited */
 
-    /* Write metadata */
-    get_backup_meta_path(filename, persisted, 1, dst, sizeof(dst));
-    FILE *meta = fopen(dst, "w");
-    if (meta)
+    /* New pack: the existing slots go in first, oldest first */
+    int slots = count_backup_slots(dir);
+    for (int k = slots; k >= 1; k--)
+    {
+        char bak[PATH_MAX], meta[PATH_MAX];
+        BackupMeta m;
+        IvPackEntry e;
+        if (join_path_num(bak, sizeof(bak), dir, k, ".bak") != 0 ||
+            join_path_num(meta, sizeof(meta), dir, k, ".meta") != 0)
+            break;
+        int has_meta = read_backup_meta(meta, &m) == 0;
+        pack_entry_init(&e, has_meta ? m.trunc_size : -1, has_meta ? m.trunc_from : -1);
+        e.epoch = has_meta ? (int64_t)m.ts : -1;
+        e.has_hash = has_meta && m.has_tail;
+        e.hash = e.has_hash ? m.tail_hash : 0;
+        snprintf(e.user, sizeof(e.user), "%.*s", (int)sizeof(e.user) - 1,
+                 has_meta ? m.user : "");
+        FILE *f = e.trunc_size < 0 ? fopen(bak, "rb") : NULL;
+        rc = e.trunc_size < 0 && (!f || pack_copy_in(p, f, &e) != 0) ? -1 : pack_add(p, &e);
+        if (f)
+            fclose(f);
+        if (rc != 0)
+        {
+            /* Keep the N.bak slots; the next backup tries again */
+            pack_close(p);
+            unlink(path);
+            return -1;
+        }
+    }
+    for (int k = slots; k >= 1; k--)
     {
-        fprintf(meta, "%ld %s\n", (long)time(NULL), get_username());
-        fclose(meta);
+        char old[PATH_MAX];
+        if (join_path_num(old, sizeof(old), dir, k, ".bak") == 0)
+            unlink(old);
+        if (join_path_num(old, sizeof(old), dir, k, ".meta") == 0)
+            unlink(old);
     }
+    return 0;
 }
 
-/* ── persist / unpersist ────────────────────────────────────────────────── */
+/* Metadata of slot n of filename, from its .meta or its pack entry. */
+static int read_slot_meta(const char *filename, int persisted, int n, BackupMeta *m)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    get_backup_dir_for_file(filename, persisted, dir, sizeof(dir));
+    if (dir_has_pack(dir))
+    {
+        IvPack p;
+        if (open_dir_pack(dir, &p, 0) != 0)
+            return -1;
+        const IvPackEntry *e = pack_slot(&p, n);
+        if (e)
+            pack_entry_meta(e, m);
+        int ok = e && e->epoch >= 0;
+        pack_close(&p);
+        return ok ? 0 : -1;
+    }
+    get_backup_meta_path(filename, persisted, n, path, sizeof(path));
+    return read_backup_meta(path, m);
+}
 
-int transfer_backup_repo(const char *filename, int to_persist)
+/* ── Backup catalog ─────────────────────────────────────────────────────── */
+
+/* <root>/.catalog has one line per slot in the root, sorted by directory
+ * and slot:
+ *   <slot> <bytes> <epoch> <user> <xxh64> <truncate> <subdir>
+ * with "-" for a hash that is not known, -1 for an epoch without .meta and
+ * for the truncate size of a full copy; <slot> reads "N@pack" for a slot
+ * kept in the directory's pack. Listing reads it instead of
+ * opening every slot directory and .meta. Writers hold a lock on
+ * <root>/.catalog.lock and replace the file by rename, so a reader sees
+ * either the old catalog or the new one; a backup parses only the lines
+ * of its own file and copies the rest as they are. A missing catalog is
+ * rebuilt from the directories; iv -rebuildbak rebuilds it on request. */
+
+typedef struct
 {
-    char src_dir[PATH_MAX], dst_dir[PATH_MAX];
-    get_backup_dir_for_file(filename, !to_persist, src_dir, sizeof(src_dir));
-    get_backup_dir_for_file(filename, to_persist, dst_dir, sizeof(dst_dir));
+    char *subdir;
+    int slot;
+    int packed;     /* in the directory's pack, not N.bak */
+    long long size; /* bytes in N.bak or in its pack entry */
+    int has_meta;
+    BackupMeta m;
+} CatRec;
+
+typedef struct
+{
+    CatRec *r;
+    size_t n, cap;
+    int persisted;
+    const char *only; /* records of this directory only; NULL = all */
+    int lock_fd;      /* -1 unless opened for writing */
+    /* Whole root, as of the last catalog_store() */
+    long long total;  /* bytes in slots */
+    long long live;   /* slots */
+    long oldest;      /* epoch of the oldest slot with .meta, -1 if none */
+} Catalog;
+
+static int cmp_catrec(const void *a, const void *b)
+{
+    const CatRec *x = a, *y = b;
+    int c = strcmp(x->subdir, y->subdir);
+    return c ? c : (x->slot > y->slot) - (x->slot < y->slot);
+}
 
-    /* Try atomic rename first */
-    if (rename(src_dir, dst_dir) == 0)
-        return 0;
-    if (errno != EXDEV)
+static CatRec *catalog_push(Catalog *c, const char *subdir, int slot)
+{
+    if (c->n == c->cap)
     {
-        perror("iv: transfer_backup_repo rename");
-        return -1;
+        size_t cap = c->cap ? c->cap * 2 : 64;
+        CatRec *tmp = realloc(c->r, cap * sizeof(*tmp));
+        if (!tmp)
+            return NULL;
+        c->r = tmp;
+        c->cap = cap;
     }
+    CatRec *r = &c->r[c->n];
+    memset(r, 0, sizeof(*r));
+    if (!(r->subdir = strdup(subdir)))
+        return NULL;
+    r->slot = slot;
+    r->m.trunc_size = -1;
+    r->m.trunc_from = -1;
+    c->n++;
+    return r;
+}
 
-    /* Cross-filesystem: copy file by file */
-    DIR *d = opendir(src_dir);
-    if (!d)
+/* Remove the records of one backup directory (keep=0), or of all the
+ * others (keep=1). */
+static void catalog_drop(Catalog *c, const char *subdir, int keep)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < c->n; i++)
     {
-        perror(src_dir);
-        return -1;
+        if ((strcmp(c->r[i].subdir, subdir) == 0) != keep)
+            free(c->r[i].subdir);
+        else
+            c->r[j++] = c->r[i];
     }
+    c->n = j;
+}
 
-    struct dirent *e;
-
-    int ok = 0;
-
-    while ((e = readdir(d)))
+/* Add records for the slots found in root/subdir, as they are on disk. */
+static void catalog_scan_dir(Catalog *c, const char *subdir)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    if (join_path2(dir, sizeof(dir), get_backup_root(c->persisted), subdir) != 0)
+        return;
+    if (dir_has_pack(dir))
     {
-        if (e->d_name[0] == '.')
-            continue;
-
-        char s[PATH_MAX * 2], t[PATH_MAX * 2];
-
-        if (join_path2(s, sizeof(s), src_dir, e->d_name) != 0)
+        IvPack p;
+        if (open_dir_pack(dir, &p, 0) != 0)
+            return;
+        for (int n = 1; n <= (int)p.n; n++)
         {
-            if (sizeof(s))
-                s[0] = '\0';
-            continue;
+            const IvPackEntry *e = pack_slot(&p, n);
+            CatRec *r = catalog_push(c, subdir, n);
+            if (!r)
+                break;
+            r->packed = 1;
+            r->size = (long long)e->len;
+            r->has_meta = e->epoch >= 0;
+            pack_entry_meta(e, &r->m);
         }
-        if (join_path2(t, sizeof(t), dst_dir, e->d_name) != 0)
-        {
-            if (sizeof(t))
-                t[0] = '\0';
+        pack_close(&p);
+        return;
+    }
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        char *end;
+        long slot = strtol(e->d_name, &end, 10);
+        struct stat st;
+        if (e->d_name[0] < '1' || e->d_name[0] > '9' || strcmp(end, ".bak") != 0 ||
+            slot > INT_MAX || join_path2(path, sizeof(path), dir, e->d_name) != 0 ||
+            stat(path, &st) != 0)
             continue;
-        }
-
-        if (move_file(s, t) != 0)
-        {
-            fprintf(stderr, "iv: failed to move %s → %s\n", s, t);
-            ok = -1;
-        }
+        CatRec *r = catalog_push(c, subdir, (int)slot);
+        if (!r)
+            break;
+        r->size = (long long)st.st_size;
+        snprintf(path + strlen(path) - 3, 5, "meta");
+        r->has_meta = read_backup_meta(path, &r->m) == 0;
     }
     closedir(d);
+}
 
-    if (ok == 0)
-        rmdir(src_dir);
-
-    return ok;
+/* Records for every backup directory in the root; -1 (errno kept) if the
+ * root cannot be read. */
+static int catalog_scan(Catalog *c)
+{
+    DIR *d = opendir(get_backup_root(c->persisted));
+    if (!d)
+        return -1;
+    struct dirent *e;
+    while ((e = readdir(d)))
+        if (e->d_name[0] != '.')
+            catalog_scan_dir(c, e->d_name);
+    closedir(d);
+    return 0;
 }
 
-/* ── Write with escapes ─────────────────────────────────────────────────── */
+/* The directory field of a catalog line, after the other six; NULL for
+ * the header or a line that is not a record. */
+static const char *catline_subdir(const char *line)
+{
+    if (line[0] == '#')
+        return NULL;
+    for (int f = 0; f < 6; f++)
+    {
+        if (!(line = strchr(line, ' ')))
+            return NULL;
+        line++;
+    }
+    return *line ? line : NULL;
+}
 
-void write_with_escapes(FILE *f, const char *text)
+static int catalog_parse(Catalog *c, FILE *f)
 {
-    for (const char *p = text; *p; p++)
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int rc = 0;
+    while ((len = getline(&line, &cap, f)) != -1)
     {
-        if (*p == '\\' && *(p + 1))
-        {
-            p++;
-            switch (*p)
-            {
-            case 'n':
-                fputc('\n', f);
-                break;
-            case 't':
-                fputc('\t', f);
-                break;
-            case '\\':
-                fputc('\\', f);
-                break;
-            case 'r':
-                fputc('\r', f);
-                break;
-            default:
-                fputc('\\', f);
-                fputc(*p, f);
-                break;
-            }
-        }
-        else
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        const char *subdir = catline_subdir(line);
+        char *rest;
+        long slot = strtol(line, &rest, 10);
+        int packed = strncmp(rest, "@pack", 5) == 0;
+        long long size, trunc;
+        long ts;
+        char user[256], hash[17];
+        if (!subdir || (c->only && strcmp(subdir, c->only) != 0) || slot > INT_MAX ||
+            sscanf(rest + (packed ? 5 : 0), "%lld %ld %255s %16s %lld", &size, &ts,
+                   user, hash, &trunc) != 5)
+            continue;
+        CatRec *r = catalog_push(c, subdir, (int)slot);
+        if (!r)
         {
-            fputc(*p, f);
+            rc = -1;
+            break;
         }
+        r->packed = packed;
+        r->size = size;
+        r->has_meta = ts >= 0;
+        r->m.ts = (time_t)(ts >= 0 ? ts : 0);
+        snprintf(r->m.user, sizeof(r->m.user), "%s", strcmp(user, "?") ? user : "");
+        r->m.trunc_size = trunc;
+        r->m.has_hash = strcmp(hash, "-") != 0;
+        r->m.hash = r->m.has_hash ? (uint64_t)strtoull(hash, NULL, 16) : 0;
+        r->m.size = r->m.has_hash ? size : -1;
     }
-    fputc('\n', f);
+    free(line);
+    return rc;
 }
 
-/* ── apply_patch ────────────────────────────────────────────────────────── */
+static void catalog_clear(Catalog *c)
+{
+    for (size_t i = 0; i < c->n; i++)
+        free(c->r[i].subdir);
+    free(c->r);
+    c->r = NULL;
+    c->n = c->cap = 0;
+}
 
-int apply_patch(const char *filename, char *lines[], int count,
-                int start, int end, const char *new_text, int mode,
-                const IvOpts *opts)
+static void catalog_free(Catalog *c)
 {
-    int do_backup = !opts->no_backup && !opts->to_stdout;
-    int dry = opts->dry_run;
+    catalog_clear(c);
+    if (c->lock_fd >= 0)
+        close(c->lock_fd); /* releases the lock */
+    c->lock_fd = -1;
+}
 
-    if (do_backup && !dry)
-        backup_file(filename, 0); /* ephemeral backups by default */
+static int catalog_lock(Catalog *c)
+{
+    char path[PATH_MAX];
+    if (join_path2(path, sizeof(path), get_backup_root(c->persisted), ".catalog.lock") != 0 ||
+        (c->lock_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    while (fcntl(c->lock_fd, F_SETLKW, &fl) != 0)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+static void catalog_write_rec(Catalog *c, FILE *f, const CatRec *r)
+{
+    if (r->slot <= 0)
+        return; /* evicted */
+    c->total += r->size;
+    c->live++;
+    if (r->has_meta && (c->oldest < 0 || (long)r->m.ts < c->oldest))
+        c->oldest = (long)r->m.ts;
+    char hash[17] = "-";
+    if (r->m.has_hash)
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r->m.hash);
+    fprintf(f, "%d%s %lld %ld %s %s %lld %s\n", r->slot, r->packed ? "@pack" : "", r->size,
+            r->has_meta ? (long)r->m.ts : -1L,
+            r->has_meta && r->m.user[0] ? r->m.user : "?", hash,
+            r->m.trunc_size, r->subdir);
+}
+
+/* Write the catalog, and the totals of the root into c. With c->only, the
+ * lines of the other directories are copied from the current catalog and
+ * the records in c take the place of that directory's lines. */
+static int catalog_store(Catalog *c)
+{
+    const char *root = get_backup_root(c->persisted);
+    char tmp[PATH_MAX], path[PATH_MAX];
+    if (join_path2(path, sizeof(path), root, ".catalog") != 0)
+        return -1;
+    FILE *old = c->only ? fopen(path, "r") : NULL;
+    if (c->only && !old)
+    {
+        /* Gone meanwhile: the directories are up to date, read them all */
+        catalog_clear(c);
+        c->only = NULL;
+        if (catalog_scan(c) != 0)
+            return -1;
+    }
+    int fd = make_temp_in(root, ".catalog.XXXXXX", tmp, sizeof(tmp));
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!f)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        if (old)
+            fclose(old);
+        return -1;
+    }
+    qsort(c->r, c->n, sizeof(*c->r), cmp_catrec);
+    fprintf(f, "# iv backup catalog: slot bytes epoch user xxh64 truncate subdir\n");
+    c->total = c->live = 0;
+    c->oldest = -1;
+    size_t i = 0;
+    if (old)
+    {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, old)) != -1)
+        {
+            if (len && line[len - 1] == '\n')
+                line[--len] = '\0';
+            const char *subdir = catline_subdir(line);
+            int cmp = subdir ? strcmp(subdir, c->only) : 0;
+            if (cmp == 0)
+                continue;
+            for (; cmp > 0 && i < c->n; i++)
+                catalog_write_rec(c, f, &c->r[i]);
+            char *p = strchr(line, ' ');
+            long long size = strtoll(p, &p, 10);
+            long ts = strtol(p, &p, 10);
+            c->total += size;
+            c->live++;
+            if (ts >= 0 && (c->oldest < 0 || ts < c->oldest))
+                c->oldest = ts;
+            fprintf(f, "%s\n", line);
+        }
+        free(line);
+        fclose(old);
+    }
+    for (; i < c->n; i++)
+        catalog_write_rec(c, f, &c->r[i]);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load the records of a backup root (only those of directory only, if not
+ * NULL); with write, also take the lock that catalog_commit() releases, and
+ * a missing catalog is rebuilt and stored first. Without write nothing in
+ * the root is created: a missing catalog is rebuilt in memory only. Returns
+ * 0, or -1 with errno set if the root cannot be read. */
+static int catalog_open(Catalog *c, int persisted, int write, const char *only)
+{
+    memset(c, 0, sizeof(*c));
+    c->persisted = persisted;
+    c->lock_fd = -1;
+    char path[PATH_MAX];
+    if (join_path2(path, sizeof(path), get_backup_root(persisted), ".catalog") != 0)
+        return -1;
+    if (write)
+    {
+        mkdir_p(get_backup_root(persisted));
+        catalog_lock(c);
+    }
+    FILE *f = fopen(path, "r");
+    if (f)
+    {
+        c->only = only;
+        int rc = catalog_parse(c, f);
+        fclose(f);
+        if (rc == 0)
+            return 0;
+        catalog_clear(c);
+    }
+    c->only = NULL;
+    if (catalog_scan(c) != 0)
+    {
+        int err = errno;
+        catalog_free(c);
+        errno = err;
+        return -1;
+    }
+    if (write)
+        catalog_store(c);
+    if ((c->only = only))
+        catalog_drop(c, only, 1);
+    return 0;
+}
+
+static void catalog_commit(Catalog *c)
+{
+    catalog_store(c);
+    catalog_free(c);
+}
+
+/* Name of a backup directory inside its root, from its full path. */
+static const char *backup_subdir_of(const char *dir, int persisted)
+{
+    size_t rl = strlen(get_backup_root(persisted));
+    return strlen(dir) > rl ? dir + rl + 1 : "";
+}
+
+/* Slots of subdir moved one up, as rotate_backup_slots() just did on
+ * disk, then, if added, a record for the new slot 1 from its .meta. */
+static void catalog_rotate(Catalog *c, const char *subdir, int added, long long size)
+{
+    char dir[PATH_MAX], mpath[PATH_MAX];
+    for (size_t i = 0; i < c->n; i++)
+        if (c->r[i].slot > 0 && strcmp(c->r[i].subdir, subdir) == 0)
+            c->r[i].slot++;
+    CatRec *r = added ? catalog_push(c, subdir, 1) : NULL;
+    if (r)
+    {
+        r->size = size;
+        r->has_meta = join_path2(dir, sizeof(dir), get_backup_root(c->persisted), subdir) == 0 &&
+                      join_path_num(mpath, sizeof(mpath), dir, 1, ".meta") == 0 &&
+                      read_backup_meta(mpath, &r->m) == 0;
+    }
+}
+
+int rebuild_backup_catalog(int persisted)
+{
+    Catalog c;
+    memset(&c, 0, sizeof(c));
+    c.persisted = persisted;
+    c.lock_fd = -1;
+    catalog_lock(&c);
+    if (catalog_scan(&c) != 0)
+    {
+        int err = errno;
+        catalog_free(&c);
+        errno = err;
+        return -1;
+    }
+    int n = (int)c.n;
+    if (catalog_store(&c) != 0)
+        n = -1;
+    catalog_free(&c);
+    return n;
+}
+
+/* ── Backup GC ──────────────────────────────────────────────────────────── */
+
+/* Limits from the environment, 0 turning one off:
+ *   IV_BACKUP_MAX_SLOTS  slots per file                      (default 100)
+ *   IV_BACKUP_MAX_BYTES  bytes in the root, K/M/G suffixes   (default 256M)
+ *   IV_BACKUP_MAX_AGE    seconds, s/m/h/d suffixes           (default 30d)
+ * A backup to the ephemeral repo enforces the slot cap on its own file and,
+ * if the root is then over the quota or holds a slot past the age, evicts
+ * at most IV_GC_BATCH more slots across the root: every slot removed counts,
+ * including the older ones that go with a chosen slot, so an edit never
+ * evicts more than its own file's excess plus IV_GC_BATCH. iv --gc runs a whole pass (on the persisted
+ * repo with --persist). Over the quota, eviction goes down to 90% of it. */
+#define IV_GC_BATCH 32
+
+typedef struct
+{
+    long long max_slots, max_bytes, max_age;
+} GcLimits;
+
+static long long env_limit(const char *name, long long def, const char *units,
+                           const long long *mult)
+{
+    const char *v = getenv(name);
+    if (!v || !*v)
+        return def;
+    char *end;
+    errno = 0;
+    long long n = strtoll(v, &end, 10);
+    const char *u = *end ? strchr(units, *end) : NULL;
+    if (errno || n < 0 || end == v || (*end && (!u || end[1])))
+    {
+        fprintf(stderr, "iv: ignoring invalid %s=%s\n", name, v);
+        return def;
+    }
+    if (!u)
+        return n;
+    return n > LLONG_MAX / mult[u - units] ? LLONG_MAX : n * mult[u - units];
+}
+
+static void gc_limits(GcLimits *l)
+{
+    static const long long bytes[] = {1LL << 10, 1LL << 20, 1LL << 30};
+    static const long long secs[] = {1, 60, 3600, 86400};
+    l->max_slots = env_limit("IV_BACKUP_MAX_SLOTS", 100, "", NULL);
+    l->max_bytes = env_limit("IV_BACKUP_MAX_BYTES", 256LL << 20, "KMG", bytes);
+    l->max_age = env_limit("IV_BACKUP_MAX_AGE", 30 * 86400LL, "smhd", secs);
+}
+
+/* Delete slot r (N.bak and N.meta, and the directory with slot 1) and mark
+ * its record evicted. In a pack, the index is cut down to the slots below
+ * r, or the pack removed with slot 1. Returns the bytes freed. */
+static long long gc_evict(Catalog *c, CatRec *r)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    IvPack p;
+    if (r->packed &&
+        join_path2(dir, sizeof(dir), get_backup_root(c->persisted), r->subdir) == 0)
+    {
+        if (r->slot == 1)
+        {
+            if (dir_pack_path(dir, path, sizeof(path)) == 0)
+                unlink(path);
+            rmdir(dir);
+        }
+        else if (dir_has_pack(dir) && open_dir_pack(dir, &p, 1) == 0)
+        {
+            pack_keep(&p, (size_t)r->slot - 1);
+            pack_close(&p);
+        }
+    }
+    else if (join_path2(dir, sizeof(dir), get_backup_root(c->persisted), r->subdir) == 0)
+    {
+        if (join_path_num(path, sizeof(path), dir, r->slot, ".bak") == 0)
+            unlink(path);
+        if (join_path_num(path, sizeof(path), dir, r->slot, ".meta") == 0)
+            unlink(path);
+        if (r->slot == 1)
+            rmdir(dir);
+    }
+    r->slot = 0;
+    return r->size;
+}
+
+/* Slots past max_slots in every file of c, highest first, stopping after
+ * budget slots (0: no bound). */
+static long gc_cap_slots(Catalog *c, long long max_slots, long budget, long long *freed)
+{
+    long n = 0;
+    qsort(c->r, c->n, sizeof(*c->r), cmp_catrec);
+    for (size_t i = c->n; i-- > 0 && (!budget || n < budget);)
+        if (c->r[i].slot > max_slots)
+        {
+            *freed += gc_evict(c, &c->r[i]);
+            n++;
+        }
+    return n;
+}
+
+typedef struct
+{
+    long ts; /* -1 without .meta: first to go for the quota, never for age */
+    int slot;
+    size_t i;
+} GcKey;
+
+static int cmp_gckey(const void *a, const void *b)
+{
+    const GcKey *x = a, *y = b;
+    if (x->ts != y->ts)
+        return x->ts < y->ts ? -1 : 1;
+    return (x->slot < y->slot) - (x->slot > y->slot);
+}
+
+/* Evict oldest first until the root in c is within l: a slot goes with the
+ * older slots above it, so every file keeps slots 1..N. Slot 1 of keep is
+ * spared. Stops after budget slots (0: no bound), counting each one, so a
+ * file may be left partly trimmed from the top. Returns slots evicted. */
+static long gc_pass(Catalog *c, const GcLimits *l, const char *keep, long budget,
+                    long long *freed)
+{
+    long n = l->max_slots ? gc_cap_slots(c, l->max_slots, budget, freed) : 0;
+    GcKey *keys = malloc((c->n ? c->n : 1) * sizeof(*keys));
+    if (!keys)
+        return n;
+    long long total = 0;
+    size_t nk = 0;
+    for (size_t i = 0; i < c->n; i++)
+        if (c->r[i].slot > 0)
+        {
+            total += c->r[i].size;
+            keys[nk].ts = c->r[i].has_meta ? (long)c->r[i].m.ts : -1;
+            keys[nk].slot = c->r[i].slot;
+            keys[nk++].i = i;
+        }
+    qsort(keys, nk, sizeof(*keys), cmp_gckey);
+    long long target = l->max_bytes && total > l->max_bytes ? l->max_bytes - l->max_bytes / 10
+                                                            : l->max_bytes;
+    long cutoff = l->max_age ? (long)time(NULL) - (long)l->max_age : 0;
+
+    for (size_t k = 0; k < nk && (!budget || n < budget); k++)
+    {
+        CatRec *r = &c->r[keys[k].i];
+        int old = l->max_age && keys[k].ts >= 0 && keys[k].ts < cutoff;
+        if (r->slot <= 0 || (!old && !(l->max_bytes && total > target)))
+        {
+            if (r->slot > 0 && keys[k].ts >= 0)
+                break; /* nothing after it is older */
+            continue;
+        }
+        if (keep && r->slot == 1 && strcmp(r->subdir, keep) == 0)
+            continue;
+        size_t end = keys[k].i + 1;
+        while (end < c->n && strcmp(c->r[end].subdir, r->subdir) == 0)
+            end++;
+        for (size_t j = end; j-- > keys[k].i && (!budget || n < budget);)
+            if (c->r[j].slot > 0)
+            {
+                long long b = gc_evict(c, &c->r[j]);
+                total -= b;
+                *freed += b;
+                n++;
+            }
+    }
+    free(keys);
+    return n;
+}
+
+/* A GC pass over a whole root; the slots and bytes left go to *live and
+ * *total if not NULL. Returns slots evicted, -1 if the root cannot be read. */
+static long gc_root(int persisted, const char *keep, long budget, long long *freed,
+                    long long *live, long long *total)
+{
+    GcLimits l;
+    Catalog c;
+    gc_limits(&l);
+    *freed = 0;
+    if (catalog_open(&c, persisted, 1, NULL) != 0)
+        return -1;
+    long n = gc_pass(&c, &l, keep, budget, freed);
+    if (n)
+        backup_cache_reset();
+    catalog_store(&c);
+    if (live)
+    {
+        *live = c.live;
+        *total = c.total;
+    }
+    catalog_free(&c);
+    return n;
+}
+
+/* Once a backup's records are in c: its file's slot cap, the catalog
+ * and, for the ephemeral repo over its limits, a bounded GC pass. */
+static void finish_backup(Catalog *c)
+{
+    GcLimits l;
+    long long freed = 0;
+    gc_limits(&l);
+    if (!c->persisted && l.max_slots)
+        gc_cap_slots(c, l.max_slots, 0, &freed);
+    catalog_store(c);
+    int over = !c->persisted &&
+               ((l.max_bytes && c->total > l.max_bytes) ||
+                (l.max_age && c->oldest >= 0 && c->oldest < (long)time(NULL) - l.max_age));
+    catalog_free(c);
+    if (over)
+        gc_root(0, c->only, IV_GC_BATCH, &freed, NULL, NULL);
+}
+
+int gc_backups(int persisted)
+{
+    long long freed, live, total;
+    long n = gc_root(persisted, NULL, 0, &freed, &live, &total);
+    if (n < 0)
+        return -1;
+    fprintf(stderr, "iv: gc %s: evicted %ld slot(s), %lld bytes; %lld slot(s), %lld bytes left\n",
+            get_backup_root(persisted), n, freed, live, total);
+    return 0;
+}
+
+/* ── Backup: create ─────────────────────────────────────────────────────── */
+
+/* Shift every existing slot (and its .meta) one position up so that
+ * slot 1 is free for a new backup. */
+static void rotate_backup_slots(const char *filename, int persisted)
+{
+    char dir[PATH_MAX];
+    get_backup_dir_for_file(filename, persisted, dir, sizeof(dir));
+    int slots = count_backup_slots(dir);
+
+    /* Rotate all existing slots upward (no fixed limit) */
+    char src[PATH_MAX], dst[PATH_MAX];
+    for (int k = slots; k >= 1; k--)
+    {
+        if (join_path_num(src, sizeof(src), dir, k, ".bak") == 0 &&
+            join_path_num(dst, sizeof(dst), dir, k + 1, ".bak") == 0)
+            rename(src, dst);
+        if (join_path_num(src, sizeof(src), dir, k, ".meta") == 0 &&
+            join_path_num(dst, sizeof(dst), dir, k + 1, ".meta") == 0)
+            rename(src, dst);
+    }
+}
+
+/* Write the .meta for slot N: "epoch user", plus a "truncate <size> <from>"
+ * line when the slot is an append-undo entry instead of a full copy (hash,
+ * if given, is then the window hash), or an "xxh64 <hash> <size>" line
+ * when the content hash is known. */
+static void write_backup_meta(const char *filename, int persisted, int n,
+                              long long trunc_size, long long trunc_from,
+                              const IvHash *hash)
+{
+    char path[PATH_MAX];
+    get_backup_meta_path(filename, persisted, n, path, sizeof(path));
+    FILE *meta = fopen(path, "w");
+    if (!meta)
+        return;
+    fprintf(meta, "%ld %s\n", (long)time(NULL), get_username());
+    if (trunc_size >= 0 && hash)
+        fprintf(meta, "truncate %lld %lld %016llx\n", trunc_size, trunc_from,
+                (unsigned long long)hash_digest(hash));
+    else if (trunc_size >= 0)
+        fprintf(meta, "truncate %lld %lld\n", trunc_size, trunc_from);
+    else if (hash)
+        fprintf(meta, "xxh64 %016llx %llu\n", (unsigned long long)hash_digest(hash),
+                (unsigned long long)hash->total);
+    fclose(meta);
+}
+
+/* Whether slot 1 already holds exactly this content: a full copy whose
+ * .meta records the same hash and size, and whose .bak is still there. */
+static int same_as_slot1(const char *filename, int persisted, const IvHash *h)
+{
+    char path[PATH_MAX];
+    BackupMeta m;
+    struct stat st;
+    get_backup_meta_path(filename, persisted, 1, path, sizeof(path));
+    if (read_backup_meta(path, &m) != 0 || !m.has_hash || m.trunc_size >= 0 ||
+        m.hash != hash_digest(h) || m.size != (long long)h->total)
+        return 0;
+    get_backup_path_n(filename, persisted, 1, path, sizeof(path));
+    return stat(path, &st) == 0 && (long long)st.st_size == m.size;
+}
+
+/* backup_file() and backup_append_undo() for a directory kept in a pack:
+ * the copy (none for an append undo) goes after the pack's content and
+ * becomes slot 1 with the next index. A copy identical to slot 1 never
+ * gets an index, and pack_close() cuts it off again. */
+static int pack_backup(const char *filename, int persisted, const char *dir,
+                       long long trunc_size, long long trunc_from, const IvHash *tail)
+{
+    const char *subdir = backup_subdir_of(dir, persisted);
+    Catalog c;
+    IvPack p;
+    IvPackEntry e;
+    int cat = catalog_open(&c, persisted, 1, subdir);
+    int had = dir_has_pack(dir);
+    int opened = open_dir_pack(dir, &p, 1) == 0;
+    int rc = opened ? 0 : -1, added = 0;
+    pack_entry_init(&e, trunc_size, trunc_from);
+    if (trunc_size >= 0 && tail)
+    {
+        e.hash = hash_digest(tail);
+        e.has_hash = 1;
+    }
+    if (rc == 0 && trunc_size < 0)
+    {
+        FILE *f = fopen(filename, "rb");
+        rc = f ? pack_copy_in(&p, f, &e) : -1;
+        if (f)
+            fclose(f);
+    }
+    const IvPackEntry *s1 = rc == 0 ? pack_slot(&p, 1) : NULL;
+    if (rc == 0 && !(trunc_size < 0 && s1 && s1->has_hash && s1->trunc_size < 0 &&
+                     s1->hash == e.hash && s1->len == e.len))
+        added = (rc = pack_add(&p, &e)) == 0;
+    if (opened)
+        pack_close(&p);
+    if (cat != 0)
+        return rc;
+    if (!added && had)
+    {
+        catalog_free(&c);
+        return rc;
+    }
+    catalog_drop(&c, subdir, 0);
+    catalog_scan_dir(&c, subdir);
+    finish_backup(&c);
+    return rc;
+}
+
+/* The copy goes to a temporary in the backup directory, hashed on the way;
+ * only then is it known whether a new slot is needed. Backing up the same
+ * content twice in a row (an edit, -u, the same edit again) leaves the
+ * slots as they were.
+ *
+ * backup_start() is called as soon as the file to edit is open. For a file
+ * of IV_BACKUP_ASYNC_MIN bytes or more the copy runs on a thread while the
+ * edit is computed, and backup_finish() joins it right before the file is
+ * replaced; a smaller one is copied by backup_finish() itself, where a
+ * thread would cost more than it hides. The thread only reads the file and
+ * writes the temporary: opening both, the umask and the stats stay on the
+ * calling thread. */
+#define IV_BACKUP_ASYNC_MIN (1 << 20)
+
+struct IvBackupJob
+{
+    char filename[PATH_MAX], dir[PATH_MAX], tmp[PATH_MAX];
+    int persisted;
+    int src, dst;  /* -1 until the copy is set up */
+    int threaded;
+    pthread_t thread;
+    int failed;
+    IvHash h;
+    long long nread, nwritten;
+};
+
+static int backup_job_open(IvBackupJob *j)
+{
+    j->src = open(j->filename, O_RDONLY);
+    j->dst = j->src >= 0 ? make_temp_in(j->dir, "new.XXXXXX", j->tmp, sizeof(j->tmp)) : -1;
+    if (j->dst >= 0)
+        return 0;
+    if (j->src >= 0)
+        close(j->src);
+    j->src = -1;
+    j->tmp[0] = '\0';
+    return -1;
+}
+
+static void *backup_job_copy(void *arg)
+{
+    IvBackupJob *j = arg;
+    char buf[65536];
+    ssize_t n;
+    hash_init(&j->h);
+    while ((n = read(j->src, buf, sizeof(buf))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            j->failed = 1;
+            break;
+        }
+        j->nread += n;
+        hash_update(&j->h, buf, (size_t)n);
+        for (ssize_t off = 0, w; off < n; off += w)
+        {
+            w = write(j->dst, buf + off, (size_t)(n - off));
+            if (w < 0 && errno == EINTR)
+                w = 0;
+            else if (w <= 0)
+            {
+                j->failed = 1;
+                return NULL;
+            }
+            j->nwritten += w;
+        }
+    }
+    return NULL;
+}
+
+static IvBackupJob *backup_job_new(const char *filename, int persisted)
+{
+    IvBackupJob *j = calloc(1, sizeof(*j));
+    IV_STAT(allocs, 1);
+    if (!j)
+        return NULL;
+    snprintf(j->filename, sizeof(j->filename), "%s", filename);
+    j->persisted = persisted;
+    j->src = j->dst = -1;
+    get_backup_dir_for_file(filename, persisted, j->dir, sizeof(j->dir));
+    return j;
+}
+
+/* Stop the copy if it still runs and drop its temporary. */
+static void backup_job_free(IvBackupJob *j)
+{
+    if (j->threaded)
+    {
+        pthread_cancel(j->thread);
+        pthread_join(j->thread, NULL);
+    }
+    if (j->src >= 0)
+        close(j->src);
+    if (j->dst >= 0)
+        close(j->dst);
+    if (j->tmp[0])
+        unlink(j->tmp);
+    free(j);
+}
+
+IvBackupJob *backup_start(const char *filename, int persisted)
+{
+    IvBackupJob *j = backup_job_new(filename, persisted);
+    struct stat st;
+    if (j && stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= IV_BACKUP_ASYNC_MIN && backup_job_open(j) == 0)
+        j->threaded = pthread_create(&j->thread, NULL, backup_job_copy, j) == 0;
+    return j;
+}
+
+void backup_abandon(IvBackupJob *j)
+{
+    if (j)
+        backup_job_free(j);
+}
+
+void backup_finish(IvBackupJob *j)
+{
+    if (!j)
+        return;
+    stats_phase_begin(IV_PHASE_BACKUP);
+    if (!j->threaded && (dir_has_pack(j->dir) || pack_wanted()))
+    {
+        /* Straight into the pack, without the temporary */
+        pack_backup(j->filename, j->persisted, j->dir, -1, -1, NULL);
+        backup_job_free(j);
+        stats_phase_end(IV_PHASE_BACKUP);
+        return;
+    }
+    if (j->threaded)
+    {
+        pthread_join(j->thread, NULL);
+        j->threaded = 0;
+    }
+    else if (j->src >= 0 || backup_job_open(j) == 0)
+        backup_job_copy(j);
+    else
+        j->failed = 1;
+    IV_STAT(bytes_read, j->nread);
+    IV_STAT(bytes_written, j->nwritten);
+    if (j->dst >= 0 && close(j->dst) != 0)
+        j->failed = 1;
+    j->dst = -1;
+
+    if (j->failed || same_as_slot1(j->filename, j->persisted, &j->h))
+        ;
+    else if (dir_has_pack(j->dir) || pack_wanted())
+        pack_backup(j->tmp, j->persisted, j->dir, -1, -1, NULL);
+    else
+    {
+        Catalog c;
+        int cat = catalog_open(&c, j->persisted, 1, backup_subdir_of(j->dir, j->persisted));
+        rotate_backup_slots(j->filename, j->persisted);
+        char dst[PATH_MAX];
+        get_backup_path_n(j->filename, j->persisted, 1, dst, sizeof(dst));
+        int added = rename(j->tmp, dst) == 0;
+        if (added)
+        {
+            j->tmp[0] = '\0';
+            write_backup_meta(j->filename, j->persisted, 1, -1, -1, &j->h);
+        }
+        if (cat == 0)
+        {
+            catalog_rotate(&c, backup_subdir_of(j->dir, j->persisted), added,
+                           (long long)j->h.total);
+            finish_backup(&c);
+        }
+    }
+    backup_job_free(j);
+    stats_phase_end(IV_PHASE_BACKUP);
+}
+
+void backup_file(const char *filename, int persisted)
+{
+    backup_finish(backup_job_new(filename, persisted));
+}
+
+int backup_append_undo(const char *filename, int persisted,
+                       long long old_size, long long new_size, const IvHash *tail)
+{
+    stats_phase_begin(IV_PHASE_BACKUP);
+    char dir[PATH_MAX];
+    get_backup_dir_for_file(filename, persisted, dir, sizeof(dir));
+    if (dir_has_pack(dir) || pack_wanted())
+    {
+        int rc = pack_backup(filename, persisted, dir, old_size, new_size, tail);
+        stats_phase_end(IV_PHASE_BACKUP);
+        return rc;
+    }
+    Catalog c;
+    int cat = catalog_open(&c, persisted, 1, backup_subdir_of(dir, persisted));
+    rotate_backup_slots(filename, persisted);
+
+    /* Slot 1 stays an empty placeholder so slot counting and listing keep
+     * working; the .meta carries the size to truncate back to. */
+    char dst[PATH_MAX];
+    get_backup_path_n(filename, persisted, 1, dst, sizeof(dst));
+    FILE *fdst = fopen(dst, "w");
+    if (fdst)
+    {
+        fclose(fdst);
+        write_backup_meta(filename, persisted, 1, old_size, new_size, tail);
+    }
+    if (cat == 0)
+    {
+        catalog_rotate(&c, backup_subdir_of(dir, persisted), fdst != NULL, 0);
+        finish_backup(&c);
+    }
+    stats_phase_end(IV_PHASE_BACKUP);
+    return fdst ? 0 : -1;
+}
+
+/* ── persist / unpersist ────────────────────────────────────────────────── */
+
+static int move_backup_dir(const char *src_dir, const char *dst_dir)
+{
+    /* Try atomic rename first */
+    if (rename(src_dir, dst_dir) == 0)
+    {
+        backup_cache_reset();
+        return 0;
+    }
+    if (errno != EXDEV)
+    {
+        perror("iv: transfer_backup_repo rename");
+        return -1;
+    }
+
+    /* Cross-filesystem: copy file by file */
+    DIR *d = opendir(src_dir);
+    if (!d)
+    {
+        perror(src_dir);
+        return -1;
+    }
+
+    struct dirent *e;
+
+    int ok = 0;
+
+    while ((e = readdir(d)))
+    {
+        if (e->d_name[0] == '.')
+            continue;
+
+        char s[PATH_MAX * 2], t[PATH_MAX * 2];
+
+        if (join_path2(s, sizeof(s), src_dir, e->d_name) != 0)
+        {
+            if (sizeof(s))
+                s[0] = '\0';
+            continue;
+        }
+        if (join_path2(t, sizeof(t), dst_dir, e->d_name) != 0)
+        {
+            if (sizeof(t))
+                t[0] = '\0';
+            continue;
+        }
+
+        if (move_file(s, t) != 0)
+        {
+            fprintf(stderr, "iv: failed to move %s → %s\n", s, t);
+            ok = -1;
+        }
+    }
+    closedir(d);
+
+    if (ok == 0)
+        rmdir(src_dir);
+    backup_cache_reset();
+
+    return ok;
+}
+
+int transfer_backup_repo(const char *filename, int to_persist)
+{
+    char src_dir[PATH_MAX], dst_dir[PATH_MAX];
+    get_backup_dir_for_file(filename, !to_persist, src_dir, sizeof(src_dir));
+    get_backup_dir_for_file(filename, to_persist, dst_dir, sizeof(dst_dir));
+
+    /* Both catalogs are locked in the same order (ephemeral first) by
+     * every writer, and re-read the directory once it has moved. */
+    char subdir[PATH_MAX];
+    snprintf(subdir, sizeof(subdir), "%s", backup_subdir_of(src_dir, !to_persist));
+    Catalog c[2];
+    int cat[2];
+    for (int p = 0; p < 2; p++)
+        cat[p] = catalog_open(&c[p], p, 1, subdir);
+    int ok = move_backup_dir(src_dir, dst_dir);
+    for (int p = 0; p < 2; p++)
+        if (cat[p] == 0)
+        {
+            catalog_drop(&c[p], subdir, 0);
+            catalog_scan_dir(&c[p], subdir);
+            catalog_commit(&c[p]);
+        }
+    return ok;
+}
+
+/* ── Write with escapes ─────────────────────────────────────────────────── */
+
+void write_with_escapes(FILE *f, const char *text)
+{
+    for (const char *p = text; *p; p++)
+    {
+        if (*p == '\\' && *(p + 1))
+        {
+            p++;
+            switch (*p)
+            {
+            case 'n':
+                fputc('\n', f);
+                break;
+            case 't':
+                fputc('\t', f);
+                break;
+            case '\\':
+                fputc('\\', f);
+                break;
+            case 'r':
+                fputc('\r', f);
+                break;
+            default:
+                fputc('\\', f);
+                fputc(*p, f);
+                break;
+            }
+        }
+        else
+        {
+            fputc(*p, f);
+        }
+    }
+    fputc('\n', f);
+}
+
+/* ── apply_patch ────────────────────────────────────────────────────────── */
+
+/* Whether patch_lines() would write back the bytes it read: no line to
+ * delete or insert before, and every line to replace already holds the
+ * text. *in_range: some line was in iv. */
+static int patch_lines_noop(char *lines[], long long count, const IvInterval *iv,
+                            size_t n, int append, const char *new_text, int mode,
+                            int *in_range)
+{
+    *in_range = 0;
+    if (mode == 4 || append)
+        return 0;
+    char *text = NULL;
+    size_t tlen = 0;
+    if (mode == 3)
+    {
+        FILE *mem = open_memstream(&text, &tlen);
+        if (!mem)
+            return 0;
+        write_with_escapes(mem, new_text);
+        fclose(mem);
+    }
+    int same = 1;
+    for (size_t k = 0; same && k < n; k++)
+        for (long long i = iv[k].start < 1 ? 1 : iv[k].start;
+             same && i <= iv[k].end && i <= count; i++)
+        {
+            *in_range = 1;
+            same = mode == 3 && strlen(lines[i - 1]) == tlen &&
+                   memcmp(lines[i - 1], text, tlen) == 0;
+        }
+    free(text);
+    return same;
+}
+
+/* Lines in iv[0..n) get new_text per mode; append: also after the last
+ * line (mode 4 inserts before iv[0].start). */
+static int patch_lines(const char *filename, char *lines[], long long count,
+                       const IvInterval *iv, size_t n, int append,
+                       const char *new_text, int mode, const IvOpts *opts)
+{
+    int do_backup = !opts->no_backup && !opts->to_stdout;
+    int dry = opts->dry_run;
+
+    /* Nothing would change: no backup, and the file keeps its mtime */
+    int in_range;
+    if (!dry && !opts->to_stdout &&
+        patch_lines_noop(lines, count, iv, n, append, new_text, mode, &in_range))
+        return mode == 3 && in_range ? 0 : -1;
+
+    if (do_backup && !dry)
+        backup_file(filename, 0); /* ephemeral backups by default */
 
     FILE *f;
     if (dry)
@@ -536,15 +1849,16 @@ int apply_patch(const char *filename, char *lines[], int count,
             return -1;
         }
     }
+    stats_phase_begin(IV_PHASE_WRITE);
 
     int wrote_new = 0;
 
     /* mode 4: patch insert — insert before start, shift the rest down */
     if (mode == 4)
     {
-        for (int i = 0; i < count; i++)
+        for (long long i = 0; i < count; i++)
         {
-            if (i + 1 == start)
+            if (i + 1 == iv[0].start)
             {
                 if (f)
                     write_with_escapes(f, new_text);
@@ -553,20 +1867,25 @@ int apply_patch(const char *filename, char *lines[], int count,
             if (f)
                 fputs(lines[i], f);
         }
-        if (start > count || count == 0)
+        if (iv[0].start > count || count == 0)
         {
             if (f)
                 write_with_escapes(f, new_text);
             wrote_new = 1;
         }
+        stats_count_written(f);
         if (f && f != stdout)
             fclose(f);
+        stats_phase_end(IV_PHASE_WRITE);
         return wrote_new ? 0 : -1;
     }
 
-    for (int i = 0; i < count; i++)
+    size_t k = 0; /* first interval not entirely before line i + 1 */
+    for (long long i = 0; i < count; i++)
     {
-        if (i + 1 >= start && i + 1 <= end)
+        while (k < n && iv[k].end < i + 1)
+            k++;
+        if (k < n && i + 1 >= iv[k].start)
         {
             if (mode == 2)
                 continue; /* delete */
@@ -592,319 +1911,284 @@ int apply_patch(const char *filename, char *lines[], int count,
         }
     }
 
-    if ((mode == 1 || mode == 3) && (start > count || count == 0))
+    if (append)
     {
         if (f)
             write_with_escapes(f, new_text);
         wrote_new = 1;
     }
 
+    stats_count_written(f);
     if (f && f != stdout)
         fclose(f);
+    stats_phase_end(IV_PHASE_WRITE);
     return wrote_new ? 0 : -1;
 }
 
-/* ── Search / replace ───────────────────────────────────────────────────── */
+int apply_patch(const char *filename, char *lines[], long long count,
+                long long start, long long end, const char *new_text, int mode,
+                const IvOpts *opts)
+{
+    IvInterval one = {start, end};
+    return patch_lines(filename, lines, count, &one, 1,
+                       (mode == 1 || mode == 3) && (start > count || count == 0),
+                       new_text, mode, opts);
+}
 
-static char *replace_in_string(const char *line, const char *pat,
-                               const char *repl, int global, int *n)
+int apply_patch_set(const char *filename, char *lines[], long long count,
+                    const IvRangeSet *sel, const char *new_text, int mode,
+                    const IvOpts *opts)
 {
-    size_t plen = strlen(pat);
-    size_t rlen = strlen(repl);
-    size_t cap = strlen(line) + 256;
-    char *out = malloc(cap);
-    if (!out)
-        return NULL;
-    size_t len = 0;
-    const char *cur = line;
-    *n = 0;
-    while (*cur)
+    return patch_lines(filename, lines, count, sel->iv, sel->n, 0, new_text,
+                       mode, opts);
+}
+
+/* ── Append in place ────────────────────────────────────────────────────── */
+
+/* Null-byte check on the first and last block only, so that appending does
+ * not cost a read of the whole file. */
+static int is_binary_sample(int fd, off_t size)
+{
+    unsigned char buf[4096];
+    off_t offs[2] = {0, size > (off_t)sizeof(buf) ? size - (off_t)sizeof(buf) : 0};
+    for (int k = 0; k < 2; k++)
     {
-        const char *p = strstr(cur, pat);
-        if (!p)
-        {
-            size_t rest = strlen(cur);
-            if (len + rest + 1 >= cap)
-            {
-                cap = len + rest + 1;
-                char *tmp = realloc(out, cap);
-                if (!tmp)
-                {
-                    free(out);
-                    return NULL;
-                }
-                out = tmp;
-            }
-            memcpy(out + len, cur, rest);
-            len += rest;
-            break;
-        }
-        size_t before = (size_t)(p - cur);
-        if (len + before + rlen + 1 >= cap)
-        {
-            cap = len + before + rlen + 256;
-            char *tmp = realloc(out, cap);
-            if (!tmp)
-            {
-                free(out);
-                return NULL;
-            }
-            out = tmp;
-        }
-        memcpy(out + len, cur, before);
-        len += before;
-        memcpy(out + len, repl, rlen);
-        len += rlen;
-        cur = p + plen;
-        (*n)++;
-        if (!global)
-        {
-            size_t rest = strlen(cur);
-            if (len + rest + 1 >= cap)
-            {
-                cap = len + rest + 256;
-                char *tmp = realloc(out, cap);
-                if (!tmp)
-                {
-                    free(out);
-                    return NULL;
-                }
-                out = tmp;
-            }
-            memcpy(out + len, cur, rest);
-            len += rest;
+        ssize_t n = pread(fd, buf, sizeof(buf), offs[k]);
+        for (ssize_t i = 0; i < n; i++)
+            if (buf[i] == 0)
+                return 1;
+        if (offs[1] == 0)
             break;
-        }
     }
-    out[len] = '\0';
-    return out;
+    return 0;
 }
 
-int search_replace(char *lines[], int count, const char *pattern,
-                   const char *replacement, int global)
+int append_in_place(const char *filename, const char *new_text,
+                    const IvOpts *opts)
 {
-    if (!pattern || !*pattern)
-        return 0;
-    int total = 0;
-    for (int i = 0; i < count; i++)
+    if (opts->dry_run || opts->to_stdout || strcmp(filename, "-") == 0)
+        return 1;
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem)
+        return 1;
+    write_with_escapes(mem, new_text);
+    fclose(mem);
+
+    int fd = open(filename, O_RDWR | O_APPEND | O_CREAT, 0666);
+    if (fd < 0)
     {
-        int n;
-        char *nl = replace_in_string(lines[i], pattern, replacement, global, &n);
-        if (nl && n > 0)
-        {
-            free(lines[i]);
-            lines[i] = nl;
-            total += n;
-        }
-        else
-            free(nl);
+        free(buf);
+        perror(filename);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        free(buf);
+        return 1;
+    }
+    if (is_binary_sample(fd, st.st_size))
+    {
+        close(fd);
+        free(buf);
+        return 2;
     }
-    return total;
-}
 
-static char *replace_regex_in_string(const char *line, regex_t *re,
-                                     const char *repl, int global, int *n)
-{
-    size_t rlen = strlen(repl);
-    size_t cap = strlen(line) + 256;
-    char *out = malloc(cap);
-    if (!out)
-        return NULL;
-    size_t len = 0;
-    const char *cur = line;
-    regmatch_t m;
-    *n = 0;
-    while (regexec(re, cur, 1, &m, 0) == 0)
+    if (!opts->no_backup)
     {
-        size_t before = (size_t)m.rm_so;
-        if (len + before + rlen + 1 >= cap)
-        {
-            cap = len + before + rlen + 256;
-            char *tmp = realloc(out, cap);
-            if (!tmp)
-            {
-                free(out);
-                return NULL;
-            }
-            out = tmp;
-        }
-        memcpy(out + len, cur, before);
-        len += before;
-        memcpy(out + len, repl, rlen);
-        len += rlen;
-        cur += m.rm_eo;
-        (*n)++;
-        if (!global)
-        {
-            size_t rest = strlen(cur);
-            if (len + rest + 1 >= cap)
-            {
-                cap = len + rest + 256;
-                char *tmp = realloc(out, cap);
-                if (!tmp)
-                {
-                    free(out);
-                    return NULL;
-                }
-                out = tmp;
-            }
-            memcpy(out + len, cur, rest);
-            len += rest;
-            break;
-        }
+        /* The window hash: the end of the file as it is, then the text */
+        IvHash tail;
+        long long from = undo_window_start((long long)st.st_size);
+        hash_init(&tail);
+        int ok = hash_fd_range(&tail, fd, from, (long long)st.st_size - from) == 0;
+        hash_update(&tail, buf, len);
+        backup_append_undo(filename, 0, (long long)st.st_size,
+                           (long long)st.st_size + (long long)len, ok ? &tail : NULL);
     }
-    if (*n == 0)
+
+    stats_phase_begin(IV_PHASE_WRITE);
+    size_t off = 0;
+    while (off < len)
     {
-        size_t l = strlen(line);
-        if (l + 1 > cap)
+        ssize_t w = write(fd, buf + off, len - off);
+        if (w < 0)
         {
-            char *tmp = realloc(out, l + 1);
-            if (tmp)
-                out = tmp;
+            if (errno == EINTR)
+                continue;
+            perror("Could not write file");
+            close(fd);
+            free(buf);
+            stats_phase_end(IV_PHASE_WRITE);
+            return -1;
         }
-        strcpy(out, line);
-        len = l;
+        off += (size_t)w;
     }
-    out[len] = '\0';
-    return out;
+    IV_STAT(bytes_written, (long long)len);
+    close(fd);
+    free(buf);
+    stats_phase_end(IV_PHASE_WRITE);
+    return 0;
 }
 
-int search_replace_regex(char *lines[], int count, const char *pattern,
+/* ── Search / replace ───────────────────────────────────────────────────── */
+
+long long search_replace(char *lines[], long long count, const char *pattern,
                          const char *replacement, int global)
 {
-    if (!pattern || !*pattern)
-        return 0;
-    regex_t re;
-    if (regcomp(&re, pattern, REG_EXTENDED) != 0)
-        return -1;
-    int total = 0;
-    for (int i = 0; i < count; i++)
-    {
-        int n;
-        char *nl = replace_regex_in_string(lines[i], &re, replacement, global, &n);
-        if (nl && n > 0)
-        {
-            free(lines[i]);
-            lines[i] = nl;
-            total += n;
-        }
-        else
-            free(nl);
-    }
-    regfree(&re);
-    return total;
+    return search_replace_filtered(lines, count, pattern, replacement, global, 0,
+                                   NULL);
+}
+
+long long search_replace_regex(char *lines[], long long count, const char *pattern,
+                               const char *replacement, int global)
+{
+    return search_replace_regex_filtered(lines, count, pattern, replacement,
+                                         global, 0, NULL);
 }
 
-int search_replace_filtered(char *lines[], int count, const char *pattern,
-                            const char *replacement, int global,
-                            const char *filter)
+/* An -E pair keeps the literal run every match needs in r->m (prefilter),
+ * so lines without it never reach regexec(); -I literals keep the folded
+ * pattern there instead. */
+int replacer_compile(IvReplacer *r, const char *pattern, const char *replacement,
+                     int regex, int icase)
 {
+    memset(r, 0, sizeof(*r));
     if (!pattern || !*pattern)
         return 0;
-    int total = 0;
-    for (int i = 0; i < count; i++)
+    if (!regex)
     {
-        if (filter && !strstr(lines[i], filter))
-            continue;
-        int n;
-        char *nl = replace_in_string(lines[i], pattern, replacement, global, &n);
-        if (nl && n > 0)
+        if (icase && matcher_compile(&r->m, pattern, IV_MATCH_ICASE) != 0)
+            return 0;
+    }
+    else
+    {
+        if (regcomp(&r->re, pattern, REG_EXTENDED | (icase ? REG_ICASE : 0)) != 0)
+            return -1;
+        if (subst_compile(&r->prog, replacement) != 0 ||
+            (size_t)r->prog.max_group > r->re.re_nsub ||
+            matcher_compile(&r->m, pattern, IV_MATCH_REGEX | (icase ? IV_MATCH_ICASE : 0)) != 0)
         {
-            free(lines[i]);
-            lines[i] = nl;
-            total += n;
+            subst_free(&r->prog);
+            regfree(&r->re);
+            return -1;
         }
-        else
-            free(nl);
     }
-    return total;
+    r->pattern = pattern;
+    r->replacement = replacement;
+    r->regex = regex;
+    r->icase = icase;
+    return 0;
 }
 
-int search_replace_regex_filtered(char *lines[], int count, const char *pattern,
-                                  const char *replacement, int global,
-                                  const char *filter)
+char *replacer_line(const IvReplacer *r, const char *line, size_t len, int global,
+                    int *n)
 {
-    if (!pattern || !*pattern)
-        return 0;
-    regex_t re;
-    if (regcomp(&re, pattern, REG_EXTENDED) != 0)
-        return -1;
-    int total = 0;
-    for (int i = 0; i < count; i++)
+    *n = 0;
+    if (!r->pattern)
+        return NULL;
+    if (r->regex)
+        return matcher_prefilter(&r->m, line, len)
+                   ? replace_subst_in_string(line, &r->re, &r->prog, global, n)
+                   : NULL;
+    if (r->icase)
+        return replace_matcher_in_string(line, &r->m, r->replacement, global, n);
+    return replace_in_string(line, r->pattern, r->replacement, global, n);
+}
+
+void replacer_free(IvReplacer *r)
+{
+    if (r->pattern && (r->regex || r->icase))
+        matcher_free(&r->m);
+    if (r->pattern && r->regex)
     {
-        if (filter && !strstr(lines[i], filter))
-            continue;
-        int n;
-        char *nl = replace_regex_in_string(lines[i], &re, replacement, global, &n);
-        if (nl && n > 0)
-        {
-            free(lines[i]);
-            lines[i] = nl;
-            total += n;
-        }
-        else
-            free(nl);
+        subst_free(&r->prog);
+        regfree(&r->re);
     }
-    regfree(&re);
-    return total;
+    memset(r, 0, sizeof(*r));
 }
 
-static char *replace_field_in_line(const char *line, char delim,
-                                   int field_num, const char *value)
+char *substitute_line(const IvReplacer *pairs, int npairs, int global,
+                      const IvMatcher *filter, const char *line, size_t len,
+                      long long *n)
 {
-    size_t vlen = strlen(value);
-    size_t linelen = strlen(line);
-    char *out = malloc(linelen + vlen + 64);
-    if (!out)
-        return NULL;
-    const char *p = line, *field_start = line;
-    int f = 1;
-    while (f < field_num && *p)
+    const char *cur = line;
+    char *out = NULL;
+    size_t cur_len = len;
+    *n = 0;
+    for (int p = 0; p < npairs; p++)
     {
-        if (*p == delim)
+        if (filter && !matcher_match(filter, cur, cur_len))
+            continue;
+        int k;
+        char *next = replacer_line(&pairs[p], cur, cur_len, global, &k);
+        if (next && k > 0)
         {
-            f++;
-            p++;
-            field_start = p;
+            free(out);
+            cur = out = next;
+            cur_len = strlen(next);
+            *n += k;
         }
         else
-            p++;
+            free(next);
     }
-    if (f != field_num)
-    {
-        strcpy(out, line);
+    if (out && (cur_len != len || memcmp(out, line, len) != 0))
         return out;
-    }
-    size_t len = (size_t)(field_start - line);
-    memcpy(out, line, len);
-    memcpy(out + len, value, vlen + 1);
-    len += vlen;
-    while (*p && *p != delim && *p != '\n')
-        p++;
-    strcpy(out + len, p);
-    return out;
+    free(out);
+    *n = 0;
+    return NULL;
 }
 
-int replace_field(char *lines[], int count, char delim, int field_num,
-                  const char *value)
+long long substitute_lines(char *lines[], long long count, const IvReplacer *pairs,
+                           int npairs, int global, const IvMatcher *filter)
 {
-    if (!delim || field_num < 1)
-        return 0;
-    for (int i = 0; i < count; i++)
+    stats_phase_begin(IV_PHASE_EDIT);
+    long long total = 0;
+    for (long long i = 0; i < count; i++)
     {
-        char *nl = replace_field_in_line(lines[i], delim, field_num, value);
+        long long n;
+        char *nl = substitute_line(pairs, npairs, global, filter, lines[i],
+                                   strlen(lines[i]), &n);
         if (nl)
         {
             free(lines[i]);
             lines[i] = nl;
+            total += n;
         }
     }
-    return count;
+    stats_phase_end(IV_PHASE_EDIT);
+    return total;
+}
+
+long long search_replace_filtered(char *lines[], long long count, const char *pattern,
+                                  const char *replacement, int global, int icase,
+                                  const IvMatcher *filter)
+{
+    IvReplacer r;
+    replacer_compile(&r, pattern, replacement, 0, icase);
+    long long total = substitute_lines(lines, count, &r, 1, global, filter);
+    replacer_free(&r);
+    return total;
+}
+
+long long search_replace_regex_filtered(char *lines[], long long count, const char *pattern,
+                                        const char *replacement, int global, int icase,
+                                        const IvMatcher *filter)
+{
+    IvReplacer r;
+    if (replacer_compile(&r, pattern, replacement, 1, icase) != 0)
+        return -1;
+    long long total = substitute_lines(lines, count, &r, 1, global, filter);
+    replacer_free(&r);
+    return total;
 }
 
 /* ── Write lines ────────────────────────────────────────────────────────── */
 
-void write_lines_to_file(const char *filename, char *lines[], int count)
+void write_lines_to_file(const char *filename, char *lines[], long long count)
 {
     FILE *f = fopen(filename, "w");
     if (!f)
@@ -912,192 +2196,354 @@ void write_lines_to_file(const char *filename, char *lines[], int count)
         perror("Could not write file");
         return;
     }
-    for (int i = 0; i < count; i++)
+    stats_phase_begin(IV_PHASE_WRITE);
+    for (long long i = 0; i < count; i++)
         fputs(lines[i], f);
+    stats_count_written(f);
     fclose(f);
+    stats_phase_end(IV_PHASE_WRITE);
 }
 
-void write_lines_to_stream(FILE *f, char *lines[], int count)
+void write_lines_to_stream(FILE *f, char *lines[], long long count)
 {
-    for (int i = 0; i < count; i++)
+    stats_phase_begin(IV_PHASE_WRITE);
+    for (long long i = 0; i < count; i++)
         fputs(lines[i], f);
+    stats_phase_end(IV_PHASE_WRITE);
 }
 
-/* ── Metadata ───────────────────────────────────────────────────────────── */
+/* ── Backup: restore ────────────────────────────────────────────────────── */
 
-static int read_backup_meta(const char *path_meta, time_t *out_ts,
-                            char *out_user, size_t user_size __attribute__((unused)))
+/* Whether src, from offset on len bytes long, still holds what the
+ * append-undo slot m was taken against: trunc_from bytes, with the window
+ * hash when m records one. */
+static int undo_source_ok(const char *src, long long offset, long long len,
+                          const BackupMeta *m)
 {
-    FILE *f = fopen(path_meta, "r");
+    if (len != m->trunc_from)
+        return 0;
+    if (!m->has_tail)
+        return 1;
+    int fd = open(src, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    IvHash h;
+    long long from = undo_window_start(m->trunc_size);
+    hash_init(&h);
+    int ok = hash_fd_range(&h, fd, offset + from, m->trunc_from - from) == 0 &&
+             hash_digest(&h) == m->tail_hash;
+    close(fd);
+    return ok;
+}
+
+/* Resolve where the content of slot N lives. Full copies live in N.bak,
+ * or in the pack at *offset. An append-undo slot is a prefix of the state
+ * right after that append, i.e. of the nearest newer full copy, or of the
+ * current file when every newer slot is an append-undo too. That source
+ * must be what the newest of those appends left (undo_source_ok()), and
+ * each append in between must have started where the previous one ended.
+ * Writes the source path to src, where the content starts to *offset and
+ * the number of bytes to take to *limit (-1 = to the end of the file).
+ * Returns 0 on success, -1 if the slot does not exist, -2 if the prefix
+ * source no longer holds that content. */
+static int resolve_backup_slot(const char *filename, int persisted, int n,
+                               char *src, size_t size, long long *offset,
+                               long long *limit)
+{
+    char dir[PATH_MAX], path[PATH_MAX], mpath[PATH_MAX];
+    struct stat st;
+    BackupMeta m, link;
+
+    *offset = 0;
+    get_backup_dir_for_file(filename, persisted, dir, sizeof(dir));
+    if (dir_has_pack(dir))
+    {
+        IvPack p;
+        if (open_dir_pack(dir, &p, 0) != 0)
+            return -1;
+        const IvPackEntry *e = pack_slot(&p, n), *full = e, *last = e;
+        int chained = 1;
+        for (int k = n - 1; full && full->trunc_size >= 0; k--)
+            if ((full = pack_slot(&p, k)) && full->trunc_size >= 0) /* NULL past slot 1 */
+            {
+                chained &= full->trunc_size == last->trunc_from;
+                last = full;
+            }
+        int rc = e ? 0 : -1;
+        if (e && e->trunc_size < 0)
+        {
+            snprintf(src, size, "%s", p.path);
+            *offset = (long long)full->off;
+            *limit = (long long)full->len;
+        }
+        else if (e)
+        {
+            long long len = -1;
+            pack_entry_meta(last, &link);
+            snprintf(src, size, "%s", full ? p.path : filename);
+            if (full)
+            {
+                *offset = (long long)full->off;
+                len = (long long)full->len;
+            }
+            else if (stat(src, &st) == 0)
+                len = (long long)st.st_size;
+            *limit = e->trunc_size;
+            if (!chained || len < 0 || !undo_source_ok(src, *offset, len, &link))
+                rc = -2;
+        }
+        pack_close(&p);
+        return rc;
+    }
+
+    get_backup_path_n(filename, persisted, n, path, sizeof(path));
+    if (stat(path, &st) != 0)
+        return -1;
+    get_backup_meta_path(filename, persisted, n, mpath, sizeof(mpath));
+    if (read_backup_meta(mpath, &m) != 0 || m.trunc_size < 0)
+    {
+        snprintf(src, size, "%s", path);
+        *limit = -1;
+        return 0;
+    }
+
+    int chained = 1;
+    link = m;
+    snprintf(src, size, "%s", filename);
+    for (int k = n - 1; k >= 1; k--)
+    {
+        BackupMeta mk;
+        get_backup_meta_path(filename, persisted, k, mpath, sizeof(mpath));
+        if (read_backup_meta(mpath, &mk) == 0 && mk.trunc_size >= 0)
+        {
+            chained &= mk.trunc_size == link.trunc_from;
+            link = mk;
+            continue;
+        }
+        get_backup_path_n(filename, persisted, k, src, size);
+        break;
+    }
+    if (!chained || stat(src, &st) != 0 ||
+        !undo_source_ok(src, 0, (long long)st.st_size, &link))
+        return -2;
+    *limit = m.trunc_size;
+    return 0;
+}
+
+/* Copy at most limit bytes (-1 = all) of path, from offset on, to out. */
+static int copy_prefix_to_stream(const char *path, long long offset, long long limit,
+                                 FILE *out)
+{
+    FILE *f = fopen(path, "rb");
     if (!f)
         return -1;
-    long epoch = 0;
-    int n = fscanf(f, "%ld %255s", &epoch, out_user);
+    if (offset && fseeko(f, (off_t)offset, SEEK_SET) != 0)
+    {
+        fclose(f);
+        return -1;
+    }
+    char buf[8192];
+    size_t n;
+    while (limit != 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        if (limit > 0 && (long long)n > limit)
+            n = (size_t)limit;
+        fwrite(buf, 1, n, out);
+        if (limit > 0)
+            limit -= (long long)n;
+    }
     fclose(f);
-    if (n >= 1)
+    return 0;
+}
+
+int restore_backup_slot(const char *filename, int persisted, int n)
+{
+    char src[PATH_MAX];
+    long long offset, limit;
+    int r = resolve_backup_slot(filename, persisted, n, src, sizeof(src), &offset, &limit);
+    if (r == -1)
     {
-        *out_ts = (time_t)epoch;
-        if (n < 2)
-            out_user[0] = '\0';
+        get_backup_path_n(filename, persisted, n, src, sizeof(src));
+        fprintf(stderr, "iv: no backup %d found (%s)\n", n, src);
+        return -1;
+    }
+    if (r == -2)
+    {
+        fprintf(stderr, "iv: backup %d is an append undo and %s no longer "
+                        "contains that content\n", n, filename);
+        return -1;
+    }
+
+    /* Undoing appends on the live file is just a truncate */
+    if (limit >= 0 && strcmp(src, filename) == 0)
+    {
+        if (truncate(filename, (off_t)limit) != 0)
+        {
+            perror(filename);
+            return -1;
+        }
         return 0;
     }
-    return -1;
+
+    FILE *fsrc = fopen(src, "r");
+    if (!fsrc)
+    {
+        fprintf(stderr, "iv: no backup %d found (%s)\n", n, src);
+        return -1;
+    }
+    fclose(fsrc);
+    FILE *dst = fopen(filename, "w");
+    if (!dst)
+    {
+        perror(filename);
+        return -1;
+    }
+    copy_prefix_to_stream(src, offset, limit, dst);
+    fclose(dst);
+    return 0;
+}
+
+int backup_slot_path(const char *filename, int persisted, int n,
+                     char *buf, size_t size)
+{
+    char src[PATH_MAX];
+    long long offset, limit;
+    int r = resolve_backup_slot(filename, persisted, n, src, sizeof(src), &offset, &limit);
+    if (r != 0)
+    {
+        get_backup_path_n(filename, persisted, n, buf, size);
+        return r;
+    }
+    if (limit < 0)
+    {
+        snprintf(buf, size, "%s", src);
+        return 0;
+    }
+
+    /* Append-undo or pack slot: materialize its content in a temporary file */
+    snprintf(buf, size, "/tmp/iv_slot_XXXXXX");
+    int fd = mkstemp(buf);
+    if (fd < 0)
+        return -1;
+    FILE *out = fdopen(fd, "w");
+    if (!out)
+    {
+        close(fd);
+        unlink(buf);
+        return -1;
+    }
+    copy_prefix_to_stream(src, offset, limit, out);
+    fclose(out);
+    return 1;
+}
+
+void backup_slot_name(const char *filename, int persisted, int n, char *buf, size_t size)
+{
+    char dir[PATH_MAX];
+    get_backup_dir_for_file(filename, persisted, dir, sizeof(dir));
+    if (dir_has_pack(dir))
+        snprintf(buf, size, "%s/pack:%d", dir, n);
+    else
+        get_backup_path_n(filename, persisted, n, buf, size);
 }
 
 /* ── Backup listing ─────────────────────────────────────────────────────── */
 
+/* Both list from the root's catalog; with a filter, only the lines of that
+ * file's directory are parsed. */
 void list_backups(const char *filter, int persisted)
 {
     const char *root = get_backup_root(persisted);
-    DIR *d = opendir(root);
-    if (!d)
+    char want[PATH_MAX];
+    if (filter && *filter)
+        get_backup_subdir(filter, want, sizeof(want));
+    Catalog c;
+    if (catalog_open(&c, persisted, 0, filter && *filter ? want : NULL) != 0)
     {
         perror(root);
         return;
     }
 
-    struct dirent *e;
-    while ((e = readdir(d)))
+    for (size_t i = 0; i < c.n; i++)
     {
-        if (e->d_name[0] == '.')
-            continue;
-
-        /* If there is a filter, verify that the subdir matches the file */
-        if (filter && *filter)
-        {
-            char subdir[PATH_MAX];
-            get_backup_subdir(filter, subdir, sizeof(subdir));
-            if (strcmp(e->d_name, subdir) != 0)
-                continue;
-        }
-
-        char subpath[PATH_MAX];
-        if (join_path2(subpath, sizeof(subpath), root, e->d_name) != 0)
-            continue;
-
-        /* List slots inside the subdirectory */
-        DIR *sd = opendir(subpath);
-        if (!sd)
-            continue;
-        struct dirent *se;
-        while ((se = readdir(sd)))
-        {
-            if (se->d_name[0] == '.')
-                continue;
-            size_t len = strlen(se->d_name);
-            if (len < 5 || strcmp(se->d_name + len - 4, ".bak") != 0)
-                continue;
-            char spath[PATH_MAX];
-            if (join_path2(spath, sizeof(spath), subpath, se->d_name) != 0)
-                continue;
-            struct stat st;
-            if (stat(spath, &st) == 0)
-                printf("%s  %zu bytes\n", spath, (size_t)st.st_size);
-        }
-        closedir(sd);
+        const CatRec *r = &c.r[i];
+        printf(r->packed ? "%s/%s/pack:%d  %lld bytes\n" : "%s/%s/%d.bak  %lld bytes\n",
+               root, r->subdir, r->slot, r->size);
     }
-    closedir(d);
+    catalog_free(&c);
 }
 
 void list_backups_with_meta(const char *filter, int persisted)
 {
     const char *root = get_backup_root(persisted);
-    DIR *d = opendir(root);
-    if (!d)
+    char want[PATH_MAX];
+    if (filter && *filter)
+        get_backup_subdir(filter, want, sizeof(want));
+    Catalog c;
+    if (catalog_open(&c, persisted, 0, filter && *filter ? want : NULL) != 0)
     {
         perror(root);
         return;
     }
 
-    struct dirent *e;
-    while ((e = readdir(d)))
+    for (size_t i = 0; i < c.n; i++)
     {
-        if (e->d_name[0] == '.')
-            continue;
+        const CatRec *r = &c.r[i];
 
-        if (filter && *filter)
-        {
-            char subdir[PATH_MAX];
-            get_backup_subdir(filter, subdir, sizeof(subdir));
-            if (strcmp(e->d_name, subdir) != 0)
-                continue;
-        }
-
-        char subpath[PATH_MAX];
-        if (join_path2(subpath, sizeof(subpath), root, e->d_name) != 0)
-            continue;
-
-        DIR *sd = opendir(subpath);
-        if (!sd)
-            continue;
-        struct dirent *se;
-        while ((se = readdir(sd)))
+        printf(r->packed ? "%s/%s/pack:%d  %lld bytes" : "%s/%s/%d.bak  %lld bytes",
+               root, r->subdir, r->slot, r->size);
+        if (r->has_meta)
         {
-            if (se->d_name[0] == '.')
-                continue;
-            size_t len = strlen(se->d_name);
-            if (len < 5 || strcmp(se->d_name + len - 4, ".bak") != 0)
-                continue;
-
-            char spath[PATH_MAX];
-            if (join_path2(spath, sizeof(spath), subpath, se->d_name) != 0)
-                continue;
-            struct stat st;
-            if (stat(spath, &st) != 0)
-                continue;
-
-            /* Read corresponding .meta */
-            char mpath[PATH_MAX];
-            snprintf(mpath, sizeof(mpath), "%.*smeta",
-                     (int)(strlen(spath) - 3), spath);
-            time_t ts = 0;
-            char user[256] = "";
-            int has_meta = (read_backup_meta(mpath, &ts, user, sizeof(user)) == 0);
-
-            printf("%s  %zu bytes", spath, (size_t)st.st_size);
-            if (has_meta)
-            {
-                char tbuf[64];
-                struct tm *tm = localtime(&ts);
-                if (tm && strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm) > 0)
-                    printf("  %s  %s", tbuf, user[0] ? user : "?");
-            }
-            printf("\n");
+            const BackupMeta *m = &r->m;
+            char tbuf[64];
+            struct tm *tm = localtime(&m->ts);
+            if (tm && strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm) > 0)
+                printf("  %s  %s", tbuf, m->user[0] ? m->user : "?");
+            if (m->trunc_size >= 0)
+                printf("  (append undo: truncate to %lld bytes)", m->trunc_size);
+            else if (m->has_hash)
+                printf("  xxh64:%016llx", (unsigned long long)m->hash);
         }
-        closedir(sd);
+        printf("\n");
     }
-    closedir(d);
+    catalog_free(&c);
 }
 
 int show_backup_slot(const char *filename, int persisted, int n)
 {
-    char path_bak[PATH_MAX], path_meta[PATH_MAX];
-    get_backup_path_n(filename, persisted, n, path_bak, sizeof(path_bak));
-    get_backup_meta_path(filename, persisted, n, path_meta, sizeof(path_meta));
+    char src[PATH_MAX];
+    long long offset, limit;
 
-    FILE *f = fopen(path_bak, "r");
-    if (!f)
+    int r = resolve_backup_slot(filename, persisted, n, src, sizeof(src), &offset, &limit);
+    if (r == -2)
+    {
+        fprintf(stderr, "iv: backup %d is an append undo and %s no longer "
+                        "contains that content\n", n, filename);
+        return -1;
+    }
+    if (r != 0)
     {
         fprintf(stderr, "iv: no backup %d found for %s\n", n, filename);
         return -1;
     }
 
-    time_t ts = 0;
-    char user[256] = "";
-    if (read_backup_meta(path_meta, &ts, user, sizeof(user)) == 0)
+    BackupMeta m;
+    if (read_slot_meta(filename, persisted, n, &m) == 0)
     {
         char buf[64];
-        struct tm *tm = localtime(&ts);
+        struct tm *tm = localtime(&m.ts);
         if (tm && strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tm) > 0)
-            fprintf(stderr, "# backup %d  %s  user: %s\n", n, buf,
-                    user[0] ? user : "?");
+        {
+            char hbuf[32] = "";
+            if (m.has_hash && m.trunc_size < 0)
+                snprintf(hbuf, sizeof(hbuf), "  xxh64:%016llx", (unsigned long long)m.hash);
+            fprintf(stderr, "# backup %d  %s  user: %s%s%s\n", n, buf,
+                    m.user[0] ? m.user : "?",
+                    m.trunc_size >= 0 ? "  (append undo)" : "", hbuf);
+        }
     }
 
-    char line[4096];
-    while (fgets(line, sizeof(line), f))
-        fputs(line, stdout);
-    fclose(f);
-    return 0;
+    return copy_prefix_to_stream(src, offset, limit, stdout);
 }
 
 /* ── Backup cleanup ─────────────────────────────────────────────────────── */
@@ -1112,6 +2558,12 @@ void clean_backups(const char *filter, int persisted)
         return;
     }
 
+    char want[PATH_MAX * 2];
+    if (filter && *filter)
+        get_backup_subdir(filter, want, sizeof(want));
+
+    Catalog c;
+    int cat = catalog_open(&c, persisted, 1, filter && *filter ? want : NULL);
     struct dirent *e;
     int removed = 0;
     while ((e = readdir(d)))
@@ -1119,14 +2571,8 @@ void clean_backups(const char *filter, int persisted)
         if (e->d_name[0] == '.')
             continue;
 
-        if (filter && *filter)
-        {
-            char subdir[PATH_MAX * 2];
-
-            get_backup_subdir(filter, subdir, sizeof(subdir));
-            if (strcmp(e->d_name, subdir) != 0)
-                continue;
-        }
+        if (filter && *filter && strcmp(e->d_name, want) != 0)
+            continue;
 
         char subpath[PATH_MAX * 2];
         snprintf(subpath, sizeof(subpath), "%s/%s", root, e->d_name);
@@ -1153,8 +2599,16 @@ void clean_backups(const char *filter, int persisted)
         }
         closedir(sd);
         rmdir(subpath);
+        if (cat == 0)
+        {
+            catalog_drop(&c, e->d_name, 0);
+            catalog_scan_dir(&c, e->d_name); /* whatever could not be removed */
+        }
     }
     closedir(d);
+    if (cat == 0)
+        catalog_commit(&c);
+    backup_cache_reset();
 
     if (removed > 0)
         fprintf(stderr, "iv: removed %d file(s)\n", removed);
@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Field engine for -F: reads the input in blocks, finds every delimiter
+ * and newline of a block in one vectorized scan (SSE2 compare + movemask,
+ * scalar elsewhere) and then replaces or selects fields line by line from
+ * the recorded positions, without copying lines out of the block.
+ *
+ * With --csv (RFC 4180) the scan works on 64-byte chunks: the prefix XOR
+ * of the quote bitmask (carry-less multiply with PCLMUL, shift-xor
+ * otherwise) is set exactly inside quoted fields, and masks out the
+ * delimiters and newlines there. The inside state carries from chunk to
+ * chunk, so a record may span lines and blocks. */
+
+#include "iv.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+#define FIELD_BLOCK (1 << 16)
+
+/* ── Field list ─────────────────────────────────────────────────────────── */
+
+int field_spec_init(IvFieldSpec *spec, char delim, const char *list,
+                    const char *where)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->delim = delim;
+    if (!delim || !list || !*list)
+        return -1;
+
+    /* Two passes: find the highest field number, then mark the wanted ones */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        const char *p = list;
+        while (*p)
+        {
+            char *e;
+            long a = strtol(p, &e, 10), b = a;
+            if (e == p || a < 1)
+                goto bad;
+            p = e;
+            if (*p == '-')
+            {
+                p++;
+                if (*p == ',' || !*p)
+                {
+                    if (!spec->open_from || a < spec->open_from)
+                        spec->open_from = (int)a;
+                    b = 0;
+                }
+                else
+                {
+                    b = strtol(p, &e, 10);
+                    if (e == p || b < a)
+                        goto bad;
+                    p = e;
+                }
+            }
+            if (*p == ',')
+                p++;
+            else if (*p)
+                goto bad;
+            if (b > 100000)
+                goto bad;
+            if (pass == 0 && b > spec->max_field)
+                spec->max_field = (int)b;
+            for (long i = a; pass == 1 && i <= b; i++)
+                spec->want[i] = 1;
+        }
+        if (pass == 0)
+        {
+            spec->want = calloc((size_t)spec->max_field + 1, 1);
+            if (!spec->want)
+                return -1;
+        }
+    }
+
+    if (where)
+    {
+        char *e;
+        long n = strtol(where, &e, 10);
+        if (e == where || n < 1 || n > INT_MAX || *e != '=')
+            goto bad;
+        spec->where_field = (int)n;
+        spec->where_value = e + 1;
+    }
+    return 0;
+
+bad:
+    field_spec_free(spec);
+    return -1;
+}
+
+void field_spec_free(IvFieldSpec *spec)
+{
+    free(spec->want);
+    spec->want = NULL;
+}
+
+static int wanted(const IvFieldSpec *spec, size_t field)
+{
+    if (field <= (size_t)spec->max_field)
+        return spec->want[field];
+    return spec->open_from && field >= (size_t)spec->open_from;
+}
+
+/* ── Delimiter scan ─────────────────────────────────────────────────────── */
+
+size_t field_marks(const char *buf, size_t from, size_t to, char delim,
+                   size_t *pos)
+{
+    size_t i = from, k = 0;
+#ifdef __SSE2__
+    const __m128i vd = _mm_set1_epi8(delim);
+    const __m128i vn = _mm_set1_epi8('\n');
+    for (; i + 16 <= to; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, vd), _mm_cmpeq_epi8(v, vn)));
+        while (m)
+        {
+            pos[k++] = i + (size_t)__builtin_ctz(m);
+            m &= m - 1;
+        }
+    }
+#endif
+    for (; i < to; i++)
+        if (buf[i] == delim || buf[i] == '\n')
+            pos[k++] = i;
+    return k;
+}
+
+/* ── CSV quote mask ─────────────────────────────────────────────────────── */
+
+/* Bit i set where p[i] == c, for n <= 64 bytes. */
+static uint64_t byte_mask(const char *p, size_t n, char c)
+{
+    uint64_t m = 0;
+#ifdef __SSE2__
+    if (n == 64)
+    {
+        const __m128i vc = _mm_set1_epi8(c);
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            m |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc))
+                 << (16 * k);
+        }
+        return m;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        m |= (uint64_t)(p[i] == c) << i;
+    return m;
+}
+
+/* Bit i becomes the XOR of bits 0..i. */
+static uint64_t prefix_xor(uint64_t x)
+{
+#ifdef __PCLMUL__
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)x),
+                                     _mm_set1_epi8((char)0xFF), 0);
+    return (uint64_t)_mm_cvtsi128_si64(r);
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+size_t field_marks_csv(const char *buf, size_t from, size_t to, char delim,
+                       size_t *pos, unsigned long long *inside)
+{
+    size_t k = 0;
+    for (size_t i = from; i < to; i += 64)
+    {
+        size_t n = to - i < 64 ? to - i : 64;
+        const char *p = buf + i;
+        uint64_t in = prefix_xor(byte_mask(p, n, '"')) ^ *inside;
+        uint64_t m = (byte_mask(p, n, delim) | byte_mask(p, n, '\n')) & ~in;
+        *inside = (uint64_t)0 - ((in >> (n - 1)) & 1);
+        while (m)
+        {
+            pos[k++] = i + (size_t)__builtin_ctzll(m);
+            m &= m - 1;
+        }
+    }
+    return k;
+}
+
+/* Whether the raw CSV field f[0..len) holds value once unquoted. */
+static int csv_field_equals(const char *f, size_t len, const char *value)
+{
+    if (len < 2 || f[0] != '"' || f[len - 1] != '"')
+        return strlen(value) == len && memcmp(f, value, len) == 0;
+    size_t j = 0;
+    for (size_t i = 1; i + 1 < len; i++, j++)
+    {
+        if (value[j] != f[i])
+            return 0;
+        if (f[i] == '"' && i + 2 < len && f[i + 1] == '"')
+            i++;
+    }
+    return value[j] == '\0';
+}
+
+/* value as a CSV field: quoted, inner quotes doubled, when it contains
+ * the delimiter, a quote or a line break. NULL if it needs no quoting. */
+static char *csv_quote(const char *value, char delim)
+{
+    if (!strchr(value, delim) && !strpbrk(value, "\"\r\n"))
+        return NULL;
+    char *q = malloc(strlen(value) * 2 + 3);
+    IV_STAT(allocs, 1);
+    if (!q)
+        return NULL;
+    char *w = q;
+    *w++ = '"';
+    for (const char *p = value; *p; p++)
+    {
+        if (*p == '"')
+            *w++ = '"';
+        *w++ = *p;
+    }
+    *w++ = '"';
+    *w = '\0';
+    return q;
+}
+
+/* ── Per line ───────────────────────────────────────────────────────────── */
+
+typedef struct
+{
+    const IvFieldSpec *spec;
+    FILE *out;
+    const char *value; /* spec->value, quoted for --csv if needed */
+    long long lineno;
+    long long result;  /* fields changed, or rows printed */
+} FieldRun;
+
+/* line[0..len) without the newline; d[0..nd) are its delimiter offsets.
+ * With --csv a line is a whole record and may contain quoted newlines. */
+static void field_line(FieldRun *run, const char *line, size_t len,
+                       const size_t *d, size_t nd, int has_nl)
+{
+    const IvFieldSpec *spec = run->spec;
+    FILE *out = run->out;
+    size_t nf = nd + 1;
+    size_t term = has_nl ? 1 : 0; /* bytes of the line terminator */
+    run->lineno++;
+    if (spec->csv && has_nl && len > 0 && line[len - 1] == '\r')
+    {
+        len--; /* CRLF: the CR belongs to the terminator, not the field */
+        term++;
+    }
+
+    int selected = 1;
+    if (spec->filter && !matcher_match(spec->filter, line, len))
+        selected = 0;
+    if (selected && spec->where_field)
+    {
+        size_t w = (size_t)spec->where_field;
+        size_t fs = w == 1 ? 0 : (w <= nf ? d[w - 2] + 1 : 0);
+        size_t fe = w <= nd ? d[w - 1] : len;
+        if (w > nf)
+            selected = 0;
+        else if (spec->csv)
+            selected = csv_field_equals(line + fs, fe - fs, spec->where_value);
+        else
+            selected = fe - fs == strlen(spec->where_value) &&
+                       memcmp(line + fs, spec->where_value, fe - fs) == 0;
+    }
+
+    if (spec->value)
+    {
+        /* -s: unselected rows and fields are copied through */
+        size_t vlen = strlen(run->value), from = 0;
+        for (size_t f = 1; selected && f <= nf; f++)
+        {
+            if (!wanted(spec, f))
+                continue;
+            size_t fs = f == 1 ? 0 : d[f - 2] + 1;
+            size_t fe = f <= nd ? d[f - 1] : len;
+            if (out)
+            {
+                fwrite(line + from, 1, fs - from, out);
+                fwrite(run->value, 1, vlen, out);
+            }
+            from = fe;
+            if (fe - fs != vlen || memcmp(line + fs, run->value, vlen) != 0)
+                run->result++;
+        }
+        if (out)
+            fwrite(line + from, 1, len - from + term, out);
+        return;
+    }
+
+    /* -v: selected fields of selected rows, joined by the delimiter */
+    if (!selected)
+        return;
+    run->result++;
+    if (!out)
+        return;
+    if (!spec->no_numbers)
+        fprintf(out, "%4lld | ", run->lineno);
+    int first = 1;
+    for (size_t f = 1; f <= nf; f++)
+    {
+        if (!wanted(spec, f))
+            continue;
+        size_t fs = f == 1 ? 0 : d[f - 2] + 1;
+        size_t fe = f <= nd ? d[f - 1] : len;
+        if (!first)
+            fputc(spec->delim, out);
+        fwrite(line + fs, 1, fe - fs, out);
+        first = 0;
+    }
+    fwrite(line + len, 1, term, out);
+}
+
+/* ── Stream ─────────────────────────────────────────────────────────────── */
+
+long long field_stream(int fd, FILE *out, const IvFieldSpec *spec)
+{
+    size_t cap = FIELD_BLOCK;
+    char *buf = malloc(cap);
+    size_t *marks = malloc(cap * sizeof(size_t));
+    if (!buf || !marks)
+    {
+        free(buf);
+        free(marks);
+        return -1;
+    }
+    IV_STAT(allocs, 2);
+
+    char *quoted = spec->csv && spec->value ? csv_quote(spec->value, spec->delim) : NULL;
+    FieldRun run = {spec, out, quoted ? quoted : spec->value, 0, 0};
+    unsigned long long inside = 0;
+    size_t have = 0, nmarks = 0;
+    int eof = 0;
+    while (!eof)
+    {
+        if (have == cap)
+        {
+            /* One line longer than the buffer: grow both arrays */
+            size_t ncap = cap * 2;
+            char *nb = realloc(buf, ncap);
+            size_t *nm = nb ? realloc(marks, ncap * sizeof(size_t)) : NULL;
+            IV_STAT(allocs, 2);
+            if (!nm)
+            {
+                free(nb ? nb : buf);
+                free(marks);
+                free(quoted);
+                return -1;
+            }
+            buf = nb;
+            marks = nm;
+            cap = ncap;
+        }
+        ssize_t n = read(fd, buf + have, cap - have);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            free(marks);
+            free(quoted);
+            return -1;
+        }
+        IV_STAT(bytes_read, n);
+        if (n == 0)
+            eof = 1;
+        if (spec->csv)
+            nmarks += field_marks_csv(buf, have, have + (size_t)n, spec->delim,
+                                      marks + nmarks, &inside);
+        else
+            nmarks += field_marks(buf, have, have + (size_t)n, spec->delim,
+                                  marks + nmarks);
+        have += (size_t)n;
+
+        /* Every newline mark closes a line; delimiter marks before it are
+         * that line's fields */
+        size_t ls = 0, first = 0;
+        for (size_t i = 0; i < nmarks; i++)
+        {
+            if (buf[marks[i]] != '\n')
+                continue;
+            for (size_t j = first; j < i; j++)
+                marks[j] -= ls;
+            field_line(&run, buf + ls, marks[i] - ls, marks + first, i - first, 1);
+            ls = marks[i] + 1;
+            first = i + 1;
+        }
+        if (eof && ls < have)
+        {
+            for (size_t j = first; j < nmarks; j++)
+                marks[j] -= ls;
+            field_line(&run, buf + ls, have - ls, marks + first, nmarks - first, 0);
+            ls = have;
+            first = nmarks;
+        }
+
+        /* Keep the unterminated tail (and its marks) at the front */
+        memmove(buf, buf + ls, have - ls);
+        have -= ls;
+        for (size_t j = first; j < nmarks; j++)
+            marks[j - first] = marks[j] - ls;
+        nmarks -= first;
+    }
+    free(buf);
+    free(marks);
+    free(quoted);
+    return run.result;
+}
@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* --follow for -nv and -va: keep the file open and only look at bytes
+ * appended since the last read, like tail -f. Line numbers keep counting
+ * from the start of the file; after truncation or rotation the new file is
+ * numbered from 1 again, as -n would report it. */
+
+#include "iv.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define FOLLOW_BLOCK (1 << 16)
+#define FOLLOW_POLL_MS 1000
+
+typedef struct
+{
+    const char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;    /* bytes consumed */
+    long long line;  /* complete lines consumed */
+    char *partial;   /* bytes of the unterminated last line */
+    size_t plen, pcap;
+    const IvMatcher *match; /* -nv: print matching lines */
+    long long from;      /* -va: print lines numbered >= from */
+    int no_numbers;
+} Follow;
+
+static void emit_line(Follow *fw, const char *line, size_t len)
+{
+    if (fw->match ? !matcher_match(fw->match, line, len) : fw->line < fw->from)
+        return;
+    if (fw->no_numbers)
+        printf("%s", line);
+    else
+        printf("%4lld | %s", fw->line, line);
+}
+
+/* Feed new bytes: complete lines are emitted, the tail is kept. */
+static int feed(Follow *fw, const char *buf, size_t n)
+{
+    while (n)
+    {
+        const char *nl = memchr(buf, '\n', n);
+        size_t seg = nl ? (size_t)(nl - buf) + 1 : n;
+        if (fw->plen + seg + 1 > fw->pcap)
+        {
+            size_t cap = fw->pcap ? fw->pcap : 256;
+            while (cap < fw->plen + seg + 1)
+                cap *= 2;
+            char *tmp = realloc(fw->partial, cap);
+            if (!tmp)
+                return -1;
+            fw->partial = tmp;
+            fw->pcap = cap;
+        }
+        memcpy(fw->partial + fw->plen, buf, seg);
+        fw->plen += seg;
+        fw->partial[fw->plen] = '\0';
+        if (nl)
+        {
+            fw->line++;
+            emit_line(fw, fw->partial, fw->plen);
+            fw->plen = 0;
+        }
+        buf += seg;
+        n -= seg;
+    }
+    return 0;
+}
+
+/* Read everything between the saved offset and the current end of file. */
+static int drain(Follow *fw)
+{
+    char *buf = malloc(FOLLOW_BLOCK);
+    if (!buf)
+        return -1;
+    ssize_t n;
+    while ((n = pread(fw->fd, buf, FOLLOW_BLOCK, fw->offset)) > 0)
+    {
+        fw->offset += n;
+        if (feed(fw, buf, (size_t)n) != 0)
+            break;
+    }
+    free(buf);
+    fflush(stdout);
+    return n < 0 ? -1 : 0;
+}
+
+static int reopen(Follow *fw)
+{
+    int fd = open(fw->path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (fw->fd >= 0)
+        close(fw->fd);
+    fw->fd = fd;
+    fw->dev = st.st_dev;
+    fw->ino = st.st_ino;
+    fw->offset = 0;
+    fw->line = 0;
+    fw->plen = 0;
+    return 0;
+}
+
+/* Catch up after an event or timeout: rotation, truncation, growth. */
+static void check(Follow *fw)
+{
+    struct stat st;
+    if (stat(fw->path, &st) == 0 &&
+        (st.st_dev != fw->dev || st.st_ino != fw->ino))
+    {
+        drain(fw); /* whatever was written to the old file before the move */
+        if (reopen(fw) != 0)
+            return;
+        fw->from = 1;
+    }
+    if (fstat(fw->fd, &st) != 0)
+        return;
+    if (st.st_size < fw->offset)
+    {
+        fw->offset = 0;
+        fw->line = 0;
+        fw->plen = 0;
+        fw->from = 1;
+    }
+    if (st.st_size > fw->offset)
+        drain(fw);
+}
+
+static int follow_loop(Follow *fw)
+{
+    int ifd = -1, wd = -1;
+#ifdef __linux__
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0)
+        wd = inotify_add_watch(ifd, fw->path, IN_MODIFY | IN_ATTRIB |
+                                                  IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+    int rc = 0;
+    for (;;)
+    {
+        /* Nobody left to read the lines, or a server shutting down */
+        if (ferror(stdout))
+        {
+            rc = -1;
+            break;
+        }
+        if (serve_stopping())
+            break;
+        struct pollfd pfd = {ifd, POLLIN, 0};
+        int r = poll(&pfd, ifd >= 0 ? 1 : 0, FOLLOW_POLL_MS);
+        if (r < 0 && errno != EINTR)
+            break;
+#ifdef __linux__
+        if (r > 0)
+        {
+            char ev[4096];
+            while (read(ifd, ev, sizeof(ev)) > 0)
+                ;
+        }
+#endif
+        ino_t ino = fw->ino;
+        check(fw);
+#ifdef __linux__
+        /* Rotated: the old watch points at the moved file */
+        if (ifd >= 0 && ino != fw->ino)
+        {
+            if (wd >= 0)
+                inotify_rm_watch(ifd, wd);
+            wd = inotify_add_watch(ifd, fw->path, IN_MODIFY | IN_ATTRIB |
+                                                      IN_MOVE_SELF | IN_DELETE_SELF);
+        }
+#else
+        (void)ino;
+        (void)wd;
+#endif
+    }
+    if (ifd >= 0)
+        close(ifd);
+    return rc;
+}
+
+static int follow_open(Follow *fw, const char *path)
+{
+    memset(fw, 0, sizeof(*fw));
+    fw->path = path;
+    fw->fd = -1;
+    if (reopen(fw) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int follow_matching_lines(const char *path, const IvMatcher *m, int no_numbers)
+{
+    Follow fw;
+    if (follow_open(&fw, path) != 0)
+        return -1;
+    fw.match = m;
+    fw.no_numbers = no_numbers;
+    drain(&fw);
+    int r = follow_loop(&fw);
+    close(fw.fd);
+    free(fw.partial);
+    return r;
+}
+
+int follow_range(const char *path, const char *spec, int no_numbers)
+{
+    long long count = 0, start, end;
+    if (scan_text_file(path, &count) < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if (parse_range(spec, count, &start, &end) < 0)
+    {
+        fprintf(stderr, "Invalid range\n");
+        return -1;
+    }
+    Follow fw;
+    if (follow_open(&fw, path) != 0)
+        return -1;
+    fw.no_numbers = no_numbers;
+    fw.from = start;
+
+    /* Initial range, then only if it reaches the end of the file does
+     * growth matter */
+    char *buf = malloc(FOLLOW_BLOCK);
+    ssize_t n = 0;
+    while (buf && fw.line < end && (n = pread(fw.fd, buf, FOLLOW_BLOCK, fw.offset)) > 0)
+    {
+        size_t take = (size_t)n;
+        /* Stop exactly after line `end` so later lines wait for the loop */
+        for (long long i = 0, seen = fw.line; i < n; i++)
+            if (buf[i] == '\n' && ++seen == end)
+            {
+                take = (size_t)i + 1;
+                break;
+            }
+        fw.offset += (off_t)take;
+        feed(&fw, buf, take);
+    }
+    free(buf);
+    fflush(stdout);
+    int r = 0;
+    if (end >= count)
+        r = follow_loop(&fw);
+    close(fw.fd);
+    free(fw.partial);
+    return r;
+}
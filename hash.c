@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* XXH64 content hash for backup slots (seed 0).
+ *
+ * Written from the xxHash specification (Yann Collet, BSD-2-Clause); the
+ * output is bit-identical to XXH64(), so `xxhsum -H64` agrees with the
+ * hashes in the .meta files. Input is consumed in 32-byte stripes by four
+ * independent lanes; hash_update() buffers the tail of each call so a file
+ * can be hashed block by block while it is copied. */
+
+#include "iv.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little-endian loads, whatever the host */
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+static void stripes(IvHash *h, const unsigned char *p, size_t n)
+{
+    for (; n >= 32; p += 32, n -= 32)
+    {
+        h->v[0] = round64(h->v[0], read64(p));
+        h->v[1] = round64(h->v[1], read64(p + 8));
+        h->v[2] = round64(h->v[2], read64(p + 16));
+        h->v[3] = round64(h->v[3], read64(p + 24));
+    }
+}
+
+void hash_init(IvHash *h)
+{
+    h->v[0] = P1 + P2;
+    h->v[1] = P2;
+    h->v[2] = 0;
+    h->v[3] = 0 - P1;
+    h->total = 0;
+    h->nbuf = 0;
+}
+
+void hash_update(IvHash *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    h->total += len;
+    if (h->nbuf + len < 32)
+    {
+        memcpy(h->buf + h->nbuf, p, len);
+        h->nbuf += len;
+        return;
+    }
+    if (h->nbuf)
+    {
+        size_t fill = 32 - h->nbuf;
+        memcpy(h->buf + h->nbuf, p, fill);
+        stripes(h, h->buf, 32);
+        p += fill;
+        len -= fill;
+        h->nbuf = 0;
+    }
+    size_t whole = len & ~(size_t)31;
+    stripes(h, p, whole);
+    memcpy(h->buf, p + whole, len - whole);
+    h->nbuf = len - whole;
+}
+
+uint64_t hash_digest(const IvHash *h)
+{
+    uint64_t acc;
+    if (h->total >= 32)
+    {
+        acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = merge_round(acc, h->v[i]);
+    }
+    else
+        acc = P5;
+    acc += h->total;
+
+    const unsigned char *p = h->buf, *e = h->buf + h->nbuf;
+    for (; p + 8 <= e; p += 8)
+        acc = rotl(acc ^ round64(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= e)
+    {
+        acc = rotl(acc ^ (uint64_t)read32(p) * P1, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < e; p++)
+        acc = rotl(acc ^ *p * P5, 11) * P1;
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t hash64(const void *data, size_t len)
+{
+    IvHash h;
+    hash_init(&h);
+    hash_update(&h, data, len);
+    return hash_digest(&h);
+}
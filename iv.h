@@ -7,10 +7,19 @@
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit systems too */
+#endif
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700 /* realpath() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <regex.h>
+#include <limits.h>
+#include <stdint.h>
 
 #define INITIAL_LINES 256
 
@@ -33,15 +42,25 @@ typedef struct {
     int json;               /* --json: structured output for -n */
     int persist;            /* --persist: move repo from /tmp to ~/.local/share/iv/ */
     int unpersist;          /* --unpersist: move repo from ~/.local/share/iv/ to /tmp */
+    int follow;             /* --follow: keep reading appended lines (-nv, -va) */
     const char *multimatch; /* -m: apply only to lines that contain this pattern */
     char field_delim;       /* -F: field delimiter */
-    int field_num;          /* -F: field number (1-based) */
+    const char *field_list; /* -F: fields, 1-based ("2", "2,5", "2-4", "3-") */
+    const char *where;      /* --where N=value: -F rows whose field N is value */
+    int csv;                /* --csv: -F fields follow RFC 4180 quoting */
+    int ignore_case;        /* -I: -s, -n, -nv and -m ignore case */
+    long long max_matches;  /* --max N / --first: -n, -nv stop after N; 0 = all */
+    int count_only;         /* --count: -n, -nv print only how many match */
+    int before, after;      /* -B N / -A N (-C N both): -nv context lines */
 } IvOpts;
 
 
+/* Line numbers, counts and byte offsets are 64-bit throughout. */
+#define IV_LINES_MAX (LLONG_MAX / 4) /* "any line": ranges parsed before a file */
+
 /* Parse range specification ("1-5", "-3--1", "-5-", "5") into start,end
  * 1-based. count = total lines. Returns 0 on success, -1 on error. */
-int parse_range(const char *spec, int count, int *start, int *end);
+int parse_range(const char *spec, long long count, long long *start, long long *end);
 
 
 /* Backup root directory depending on persistence:
@@ -58,10 +77,15 @@ void get_backup_subdir(const char *filename, char *buf, size_t size);
 
 /* Full path to the backup directory for filename.
  * If persisted=1 uses ~/.local/share/iv/, otherwise uses /tmp/iv_<user>/
- * Creates the directory if it does not exist. */
+ * Creates the directory if it does not exist. Memoized per filename;
+ * the repo root lookup is memoized per directory. */
 void get_backup_dir_for_file(const char *filename, int persisted,
                              char *buf, size_t size);
 
+/* Forget backup directories resolved so far (they are memoized per
+ * filename for the rest of the run). */
+void backup_cache_reset(void);
+
 /* Full path to backup slot N for filename. */
 void get_backup_path_n(const char *filename, int persisted, int n,
                        char *buf, size_t size);
@@ -71,10 +95,54 @@ void get_backup_meta_path(const char *filename, int persisted, int n,
                           char *buf, size_t size);
 
 
+/* XXH64 (hash.c), seed 0: the content hash kept in each backup .meta.
+ * hash_update() may be fed any split of the input. */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    size_t nbuf;
+} IvHash;
+
+void hash_init(IvHash *h);
+void hash_update(IvHash *h, const void *data, size_t len);
+uint64_t hash_digest(const IvHash *h);
+uint64_t hash64(const void *data, size_t len);
+
+
 /* Create a rotating backup for the file (slot 1, shift older ones).
  * If persisted=1 save in ~/.local/share/iv/, otherwise in /tmp. */
 void backup_file(const char *filename, int persisted);
 
+/* The same backup in two steps, so that the copy of a large file overlaps
+ * the edit: backup_start() when the file is opened, then backup_finish()
+ * right before it is replaced, or backup_abandon() if it is not. Both
+ * accept NULL (no backup). */
+typedef struct IvBackupJob IvBackupJob;
+IvBackupJob *backup_start(const char *filename, int persisted);
+void backup_finish(IvBackupJob *j);
+void backup_abandon(IvBackupJob *j);
+
+/* Record an append-undo entry in slot 1 (rotating older slots) instead of
+ * a full copy: undoing it truncates the file back to old_size.
+ * new_size is the size right after the append; tail, if not NULL, hashes
+ * the end of the file as the append leaves it (see edit.c), which undoing
+ * checks first. Returns 0 on success. */
+int backup_append_undo(const char *filename, int persisted,
+                       long long old_size, long long new_size, const IvHash *tail);
+
+/* Restore filename from slot N (full copy or append undo).
+ * Returns 0 on success, -1 on error. */
+int restore_backup_slot(const char *filename, int persisted, int n);
+
+/* Path of a readable copy of slot N. Returns 0 if buf is the slot itself,
+ * 1 if a temporary file was created (caller unlinks it), -1 if none, -2
+ * if it is an append undo whose content the file no longer holds. */
+int backup_slot_path(const char *filename, int persisted, int n,
+                     char *buf, size_t size);
+/* Slot N as -lsbak names it (N.bak or pack:N), for labels. */
+void backup_slot_name(const char *filename, int persisted, int n, char *buf, size_t size);
+
 /* Move a file's backup directory from /tmp to
  * ~/.local/share/iv/ (persist=1) or the other way around (persist=0).
  * Returns 0 on success, -1 on error. */
@@ -83,44 +151,442 @@ int transfer_backup_repo(const char *filename, int to_persist);
 
 void write_with_escapes(FILE *f, const char *text);
 
-int apply_patch(const char *filename, char *lines[], int count,
-                int start, int end, const char *new_text, int mode,
+int apply_patch(const char *filename, char *lines[], long long count,
+                long long start, long long end, const char *new_text, int mode,
                 const IvOpts *opts);
 
 
-int search_replace(char *lines[], int count, const char *pattern,
-                   const char *replacement, int global);
+/* Append new_text (with escapes) through O_APPEND without reading the file;
+ * the backup is an append-undo entry. Returns 0 on success, 1 if the fast
+ * path does not apply (dry run, --stdout, stdin, not a regular file),
+ * 2 if the file looks binary, -1 on error. */
+int append_in_place(const char *filename, const char *new_text,
+                    const IvOpts *opts);
+
+
+/* UTF-8 and Unicode simple case folding (fold.c) for -I */
+#define IV_RUNE_INVALID 0x110000 /* + byte: a byte that is not valid UTF-8 */
 
-int search_replace_regex(char *lines[], int count, const char *pattern,
+unsigned fold_rune(unsigned c);
+/* Code point at s[0..len), len >= 1, into *c; returns the bytes it takes
+ * (1 for an invalid byte, decoded as IV_RUNE_INVALID + byte). */
+size_t utf8_decode(const char *s, size_t len, unsigned *c);
+/* Encode c (as utf8_decode() returns it) into out[0..4); returns length. */
+size_t utf8_encode(unsigned c, char *out);
+
+
+/* Line matcher (match.c) for -n, -nv, -m and --follow, compiled once per
+ * command: literal patterns use memmem(), EREs are prefiltered by literal
+ * runs every match contains and tested with regexec() without submatches. */
+#define IV_MATCH_REGEX 1 /* -E: pattern is an ERE */
+#define IV_MATCH_ICASE 2 /* -I: ignore case (Unicode simple case folding) */
+
+#define IV_MATCH_NEEDS 4
+
+typedef struct {
+    int regex;           /* re is compiled; otherwise need[0] is the pattern */
+    int icase;           /* -I: needs are case folded */
+    int fold_utf8;       /* some folded need is not ASCII */
+    int fold_ks;         /* some has 'k' or 's' (U+212A, U+017F fold to them) */
+    char *need[IV_MATCH_NEEDS]; /* runs every match contains, rarest first */
+    size_t need_len[IV_MATCH_NEEDS];
+    int nneed;
+    regex_t re;
+} IvMatcher;
+
+/* Returns 0 on success, -1 if the ERE does not compile. */
+int matcher_compile(IvMatcher *m, const char *pattern, int flags);
+void matcher_free(IvMatcher *m);
+/* 1 if line[0..len) matches; a trailing '\n' is not part of the line. */
+int matcher_match(const IvMatcher *m, const char *line, size_t len);
+/* Literal matchers: first match in line[0..len), its length in *mlen
+ * (with -I it can differ from the pattern's). NULL if none. */
+const char *matcher_find(const IvMatcher *m, const char *line, size_t len,
+                         size_t *mlen);
+/* 0 if line[0..len) cannot match (a required run is missing). */
+int matcher_prefilter(const IvMatcher *m, const char *line, size_t len);
+
+
+/* Selections (range.c): comma-separated items, each a parse_range() range
+ * or a sed-like address, /re/ (every matching line) or /re1/,/re2/ (from a
+ * line matching re1 through the next one matching re2, or the end). The
+ * regexes are EREs. Resolved into sorted, merged intervals. */
+typedef struct { long long start, end; } IvInterval;
+
+typedef struct IvRangeItem IvRangeItem;
+
+typedef struct {
+    IvRangeItem *items;
+    size_t nitems;
+    int has_regex;       /* lines must be fed through range_set_line() */
+    IvInterval *iv;      /* after range_set_finish(): sorted, disjoint */
+    size_t n, cap;
+} IvRangeSet;
+
+/* match_flags: IV_MATCH_ICASE for -I. Returns -1 on a bad spec or regex. */
+int range_set_parse(IvRangeSet *rs, const char *spec, int match_flags);
+void range_set_free(IvRangeSet *rs);
+/* One contiguous numeric range: callers keep parse_range() semantics */
+int range_set_simple(const IvRangeSet *rs);
+/* Resolving rs needs the line count first: /re/ addresses or ranges
+ * counted from the end ("-500-"). Otherwise any count past the end will do. */
+int range_set_needs_count(const IvRangeSet *rs);
+/* Feed every line in order (only needed if has_regex), then finish with
+ * the line count; range_set_lines() does both over a line array. */
+int range_set_line(IvRangeSet *rs, long long lineno, const char *line, size_t len);
+int range_set_finish(IvRangeSet *rs, long long count);
+int range_set_lines(IvRangeSet *rs, char *lines[], long long count);
+/* apply_patch() on every line of a finished selection (modes 1-3) */
+int apply_patch_set(const char *filename, char *lines[], long long count,
+                    const IvRangeSet *sel, const char *new_text, int mode,
+                    const IvOpts *opts);
+
+
+/* Replacements that leave a line as it was are not counted, so 0 means
+ * nothing changed. */
+long long search_replace(char *lines[], long long count, const char *pattern,
                          const char *replacement, int global);
 
-int search_replace_filtered(char *lines[], int count, const char *pattern,
-                            const char *replacement, int global,
-                            const char *filter);
+long long search_replace_regex(char *lines[], long long count, const char *pattern,
+                               const char *replacement, int global);
+
+/* Same, only on lines filter matches (-m); icase: -I */
+long long search_replace_filtered(char *lines[], long long count, const char *pattern,
+                                  const char *replacement, int global, int icase,
+                                  const IvMatcher *filter);
+
+long long search_replace_regex_filtered(char *lines[], long long count, const char *pattern,
+                                        const char *replacement, int global, int icase,
+                                        const IvMatcher *filter);
+
+
+/* Field engine (field.c): -s -F and -v -F in one streaming pass. */
+typedef struct {
+    char delim;
+    unsigned char *want;     /* want[f] for f <= max_field */
+    int max_field;
+    int open_from;           /* "N-": every field from N on; 0 = none */
+    const char *value;       /* -s: replacement; NULL = select fields (-v) */
+    const IvMatcher *filter; /* -m: only rows it matches; NULL = all */
+    int where_field;         /* --where: only rows whose field where_field */
+    const char *where_value; /*          equals where_value; 0 = all rows */
+    int no_numbers;          /* -v: omit the "%4d | " prefix */
+    int csv;                 /* --csv: RFC 4180 quoting, records may span lines */
+} IvFieldSpec;
+
+/* Parse list ("2,5", "1-3,7", "4-") and where ("N=value", or NULL).
+ * Returns 0 on success, -1 if either is invalid. */
+int field_spec_init(IvFieldSpec *spec, char delim, const char *list,
+                    const char *where);
+void field_spec_free(IvFieldSpec *spec);
+
+/* Offsets of every delim and '\n' in buf[from..to), ascending, into pos
+ * (room for to - from entries). Returns how many were found. */
+size_t field_marks(const char *buf, size_t from, size_t to, char delim,
+                   size_t *pos);
+
+/* Same for --csv: delimiters and newlines inside quoted fields are skipped.
+ * *inside (0 at the start of input) carries the quote state between calls. */
+size_t field_marks_csv(const char *buf, size_t from, size_t to, char delim,
+                       size_t *pos, unsigned long long *inside);
+
+/* Read fd to the end applying spec line by line and write the result to
+ * out (NULL = only count). Returns fields changed (value set; a field that
+ * already holds the value does not count) or rows selected, -1 on read
+ * error. */
+long long field_stream(int fd, FILE *out, const IvFieldSpec *spec);
+
+/* Per-line kernels (replace.c). Each returns a new malloc'd line (NULL on
+ * allocation failure); *n is the number of replacements made. */
+char *replace_in_string(const char *line, const char *pat,
+                        const char *repl, int global, int *n);
+
+/* Literal replace of every match of a literal matcher (-s -I) */
+char *replace_matcher_in_string(const char *line, const IvMatcher *m,
+                                const char *repl, int global, int *n);
+
+/* -E replacement compiled once into literal spans and group references:
+ * \0..\9 and & (whole match); \& and \\ are literal. */
+typedef struct {
+    int group;       /* -1: literal bytes lit[off..off+len) */
+    size_t off, len;
+} IvSubstOp;
+
+typedef struct {
+    IvSubstOp *ops;
+    int nops;
+    char *lit;
+    size_t lit_len;
+    int max_group;   /* highest group used; submatches past it are skipped */
+} IvSubst;
+
+int subst_compile(IvSubst *prog, const char *repl);
+void subst_free(IvSubst *prog);
+/* Regex replace running prog per match. The pattern sees the line without
+ * its trailing '\n', so $ matches before it; empty matches advance one
+ * character, and ^ only matches at the start of the line. */
+char *replace_subst_in_string(const char *line, const regex_t *re,
+                              const IvSubst *prog, int global, int *n);
+/* The line with field field_num (1-based) set to value; unchanged copy if
+ * the line has fewer fields. */
+char *replace_field_in_line(const char *line, char delim,
+                            int field_num, const char *value);
+
+/* One -s pattern/replacement pair compiled once for every line (edit.c).
+ * regex: -E; icase: -I. An empty pattern compiles to a pair that never
+ * replaces. replacer_compile() returns -1 on an invalid regex or a back
+ * reference past its groups; replacer_line() needs line NUL-terminated at
+ * len and returns NULL when it made no replacement. */
+typedef struct {
+    const char *pattern, *replacement;  /* NULL pattern: no-op */
+    int regex, icase;
+    IvMatcher m;       /* -E: literal prefilter; -I: the folded pattern */
+    regex_t re;
+    IvSubst prog;
+} IvReplacer;
+
+int replacer_compile(IvReplacer *r, const char *pattern, const char *replacement,
+                     int regex, int icase);
+char *replacer_line(const IvReplacer *r, const char *line, size_t len, int global,
+                    int *n);
+void replacer_free(IvReplacer *r);
+
+/* line[0..len) (NUL-terminated there) through every pair in order, each
+ * one on lines filter matches as the earlier pairs left them. Returns the
+ * new line, with *n the replacements made, or NULL (*n = 0) if the result
+ * has the same bytes as line. */
+char *substitute_line(const IvReplacer *pairs, int npairs, int global,
+                      const IvMatcher *filter, const char *line, size_t len,
+                      long long *n);
+/* substitute_line() on every line; returns the replacements made */
+long long substitute_lines(char *lines[], long long count, const IvReplacer *pairs,
+                           int npairs, int global, const IvMatcher *filter);
+
+
+/* Streaming edits (stream.c): one forward pass with a fixed-size buffer,
+ * never holding the file in memory. */
+
+/* Count lines (as load_lines() would) in one pass. Returns 0 for text,
+ * 1 if the file contains a null byte, -1 on error. */
+int scan_text_file(const char *path, long long *count);
+/* Same pass, also resolving sel (range_set_finish() included). */
+int scan_selection(const char *path, long long *count, IvRangeSet *sel);
+
+/* Create a temporary file next to filename (or in TMPDIR if that directory
+ * is not writable). Writes its path to tmp and returns the fd, -1 on error. */
+int open_temp_beside(const char *filename, char *tmp, size_t size);
+
+/* Replace filename with the finished temporary file tmp, keeping the mode
+ * and owner. Hard-linked targets, and ones whose mode or owner tmp cannot
+ * take, are rewritten in place; if that fails, tmp is kept (and named on
+ * stderr). Returns 0 on success. */
+int replace_file_with(const char *filename, const char *tmp);
+
+/* Same contract as apply_patch(), but reading filename block by block;
+ * count is the line count from scan_text_file(). Returns -2 if the result
+ * could not be written over filename. */
+int stream_patch(const char *filename, long long count, long long start,
+                 long long end, const char *new_text, int mode,
+                 const IvOpts *opts);
+/* stream_patch() on every line of a finished selection (modes 1-3) */
+int stream_patch_set(const char *filename, const IvRangeSet *sel,
+                     const char *new_text, int mode, const IvOpts *opts);
+/* -s on a selection: read fd to the end and write it to out (NULL = only
+ * count) with the lines of the finished selection sel run through every
+ * pair in order (on lines filter matches, if any). Lines outside sel are
+ * copied in runs, and past its end in whole blocks. Returns replacements
+ * made, -1 on read error, -2 if the input has a null byte. */
+long long substitute_stream(int fd, FILE *out, const IvRangeSet *sel,
+                            const IvReplacer *pairs, int npairs, int global,
+                            const IvMatcher *filter);
+
+
+/* Piece table (piece.c): the file read once, edits recorded as pieces of
+ * it and of an append-only add buffer, in a treap keyed by byte offset
+ * that also counts newlines. Edits and line lookups are O(log pieces);
+ * writing walks the pieces. */
+typedef struct IvPiece IvPiece;
 
-int search_replace_regex_filtered(char *lines[], int count, const char *pattern,
-                                  const char *replacement, int global,
-                                  const char *filter);
+typedef struct {
+    char *text;
+    size_t len, cap;
+    uint32_t *nl32;     /* offsets of the '\n' bytes in text, ascending, */
+    uint64_t *nl64;     /* 32-bit until one is past 4 GiB */
+    size_t nnl, nl_cap;
+} IvDocBuf;
 
-int replace_field(char *lines[], int count, char delim, int field_num,
-                  const char *value);
+typedef struct {
+    IvDocBuf b[2];      /* 0: the file as read, 1: inserted text */
+    IvPiece *root;
+    size_t npieces;
+    unsigned seed;
+} IvDoc;
+
+/* Read fd to the end. Returns 0, or -1 with d empty. */
+int doc_load(IvDoc *d, int fd);
+void doc_free(IvDoc *d);
+size_t doc_length(const IvDoc *d);
+long long doc_lines(const IvDoc *d);
+/* Byte offset where line (1-based) starts; doc_length() past the end. */
+size_t doc_line_offset(const IvDoc *d, long long line);
+/* Both return 0, or -1 (document unchanged) if out of memory. */
+int doc_insert(IvDoc *d, size_t pos, const char *text, size_t len);
+int doc_delete(IvDoc *d, size_t pos, size_t len);
+int doc_write(const IvDoc *d, FILE *f);
+
+
+/* Backup pack (pack.c), the backend chosen by IV_BACKUP_PACK=1: all the
+ * slots of one file in <backup dir>/pack, contents appended, followed by
+ * an index of fixed-size entries (oldest slot first) and a footer that
+ * locates it. Every change appends a new index; dead bytes are reclaimed
+ * by rewriting the pack once they outweigh the live ones. */
+#define IV_PACK_NAME "pack"
 
+typedef struct {
+    uint64_t off, len;              /* content; len 0 for an append undo */
+    int64_t epoch;
+    int64_t trunc_size, trunc_from; /* append undo, else -1 */
+    uint64_t hash;                  /* XXH64 of the content, if has_hash */
+    uint32_t has_hash;
+    char user[36];
+} IvPackEntry;
 
-void write_lines_to_file(const char *filename, char *lines[], int count);
-void write_lines_to_stream(FILE *f, char *lines[], int count);
+typedef struct {
+    int fd;
+    int writable;
+    const IvPackEntry *e;   /* the index, mapped */
+    size_t n;
+    void *map;
+    size_t map_len;
+    uint64_t end;           /* through the last footer */
+    uint64_t tail;          /* through content not yet indexed */
+    uint64_t live;          /* content bytes of the entries */
+    char path[PATH_MAX];
+} IvPack;
+
+/* 0; -1 if there is no pack (with write: it cannot be created or locked),
+ * errno set; -2 if the footer or the index is damaged. With write, waits for
+ * any other writer and holds the pack until pack_close(). */
+int pack_open(IvPack *p, const char *path, int write);
+/* Drops content copied in but never added. */
+void pack_close(IvPack *p);
+/* Slot n (1 = newest), NULL if there is none. */
+const IvPackEntry *pack_slot(const IvPack *p, int n);
+/* Append the rest of src after the pack, setting e's off, len and hash;
+ * it becomes a slot only through pack_add(). */
+int pack_copy_in(IvPack *p, FILE *src, IvPackEntry *e);
+/* Make e slot 1; the others move one up. */
+int pack_add(IvPack *p, const IvPackEntry *e);
+/* Keep only the newest keep slots. */
+int pack_keep(IvPack *p, size_t keep);
+
+
+void write_lines_to_file(const char *filename, char *lines[], long long count);
+void write_lines_to_stream(FILE *f, char *lines[], long long count);
 
 char *read_stdin(void);
 char *read_file_content(const char *path);
 int   is_binary_file(const char *path);
 
 
-void show_file(char *lines[], int count, int no_numbers);
-void show_range(char *lines[], int count, int start, int end, int no_numbers);
-int  wc_lines(char *lines[], int count);
-void find_line_numbers(char *lines[], int count, const char *pattern, int json);
-void find_matching_lines(char *lines[], int count, const char *pattern, int no_numbers);
+void show_file(char *lines[], long long count, int no_numbers);
+void show_range(char *lines[], long long count, long long start, long long end,
+                int no_numbers);
+long long wc_lines(char *lines[], long long count);
+/* -n prints the numbers of matching lines, -nv the lines themselves */
+typedef struct {
+    int print_lines;    /* -nv */
+    int no_numbers;     /* -nv --no-numbers */
+    int json;           /* {"lines":[...]} or, with count, {"count":N} */
+    int count;          /* --count: only how many lines match */
+    long long max;      /* --max N, --first: stop after N matches; 0 = all */
+    int before, after;  /* -nv context lines, "%4lld - "; groups split by "--" */
+    const IvRangeSet *scope; /* finished selection to search; NULL = all */
+} IvFind;
+
+/* Both return the matches found (at most f->max). find_stream() reads fd
+ * block by block and stops reading as soon as the answer is known, which
+ * includes the end of f->scope; -1 on read error. */
+long long find_lines(char *lines[], long long count, const IvMatcher *m, const IvFind *f);
+long long find_stream(int fd, const IvMatcher *m, const IvFind *f);
 int  stream_file_with_numbers(const char *path);
 
+/* --follow (follow.c): print the initial result, then keep the file open
+ * and process only appended bytes, surviving truncation and rotation.
+ * Return only on error. */
+int follow_matching_lines(const char *path, const IvMatcher *m, int no_numbers);
+int follow_range(const char *path, const char *spec, int no_numbers);
+
+
+/* --stats / IV_STATS (stats.c): per-phase timing and counters reported on
+ * stderr at the end of each command. Hooks cost one test when disabled. */
+typedef enum {
+    IV_PHASE_SCAN,   /* binary check / line count */
+    IV_PHASE_LOAD,
+    IV_PHASE_BACKUP,
+    IV_PHASE_EDIT,   /* search/replace, field replace */
+    IV_PHASE_WRITE,
+    IV_PHASE_VIEW,
+    IV_PHASE_COUNT
+} IvPhase;
+
+typedef struct {
+    int mode;                /* 0 off, 1 text, 2 JSON */
+    long long bytes_read;    /* from files and stdin */
+    long long bytes_written; /* to files, backups included */
+    long long lines;         /* lines loaded */
+    long long allocs;        /* allocations at iv's own call sites */
+    double wall_ms[IV_PHASE_COUNT];
+    double cpu_ms[IV_PHASE_COUNT];
+} IvStats;
+
+extern IvStats iv_stats;
+
+/* n is not evaluated when stats are off */
+#define IV_STAT(field, n) \
+    do { if (iv_stats.mode) iv_stats.field += (n); } while (0)
+
+/* Reset counters; enable from argv (--stats, --stats=json) or IV_STATS
+ * (1/text or json). */
+void stats_init(int argc, char *argv[]);
+void stats_phase_begin(IvPhase p);
+void stats_phase_end(IvPhase p);
+/* Add the size of a file just written through f (not stdout). */
+void stats_count_written(FILE *f);
+void stats_report(const char *command);
+
+
+/* Entry point for one command line; main() and --serve both call it. */
+int iv_run(int argc, char *argv[]);
+
+char **load_lines(FILE *f, long long *out_count);
+void free_lines(char **lines, long long count);
+
+
+/* Resident mode (serve.c). */
+
+/* Listen on sock_path (NULL = $XDG_RUNTIME_DIR/iv.sock, or the ephemeral
+ * backup root + ".sock") and run each client's command in-process.
+ * Returns the exit status for main(). */
+int serve_main(const char *sock_path);
+
+/* Send argv, cwd, the environment the command reads and the standard fds
+ * to a running server. Returns 0 with *status set if the command ran
+ * there, -1 if no server answered or it must run here (--follow). */
+int serve_forward(const char *sock_path, int argc, char *argv[], int *status);
+
+/* Nonzero once a server was asked to stop (SIGINT, SIGTERM). */
+int serve_stopping(void);
+
+/* Default socket path used by --serve without an argument. */
+const char *serve_default_socket(void);
+
+/* Line array for filename from the server cache, revalidated with stat();
+ * NULL when not serving. Arrays the cache owns must not be freed; check
+ * with serve_owns_lines(). */
+char **serve_cached_lines(const char *filename, long long *count);
+int serve_owns_lines(char **lines);
+
 
 /* List backups in the given root. filter=NULL: all; filter="file": only that one. */
 void list_backups(const char *filter, int persisted);
@@ -131,5 +597,12 @@ int show_backup_slot(const char *filename, int persisted, int n);
 
 /* Remove backups. filter=NULL: all; filter="file": only those for that file. */
 void clean_backups(const char *filter, int persisted);
+/* Rewrite the root's catalog (<root>/.catalog, which the listings read)
+ * from its slot directories. Returns the number of slots, -1 if the root
+ * cannot be read. */
+int rebuild_backup_catalog(int persisted);
+/* Evict slots past the IV_BACKUP_MAX_SLOTS / _BYTES / _AGE limits, oldest
+ * first, and report on stderr. Returns 0, -1 if the root cannot be read. */
+int gc_backups(int persisted);
 
 #endif
\ No newline at end of file
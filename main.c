@@ -3,6 +3,8 @@
 
 #include "iv.h"
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 static void usage(const char *prog)
 {
@@ -10,10 +12,11 @@ static void usage(const char *prog)
     fprintf(stderr, "  %s -h|--help\n", prog);
     fprintf(stderr, "  %s -V|--version\n", prog);
     fprintf(stderr, "  %s -v [--no-numbers] file\n", prog);
-    fprintf(stderr, "  %s -va [--no-numbers] start-end file\n", prog);
+    fprintf(stderr, "  %s -v -F delim fields file [--where N=value]\n", prog);
+    fprintf(stderr, "  %s -va [--no-numbers] start-end file [--follow]\n", prog);
     fprintf(stderr, "  %s -wc file\n", prog);
-    fprintf(stderr, "  %s -n file \"pattern\" [--json]\n", prog);
-    fprintf(stderr, "  %s -nv file \"pattern\" [--no-numbers]\n", prog);
+    fprintf(stderr, "  %s -n file [range] \"pattern\" [--json] [--max N|--first] [--count]\n", prog);
+    fprintf(stderr, "  %s -nv file [range] \"pattern\" [--no-numbers] [--follow] [-A N] [-B N] [-C N] [--max N|--first] [--count]\n", prog);
     fprintf(stderr, "  %s -u file [N]\n", prog);
     fprintf(stderr, "  %s -diff [-u] [N] file\n", prog);
     fprintf(stderr, "  %s -i|-insert file [start-end] \"text\" [-q] [--dry-run] [--no-backup]\n", prog);
@@ -22,14 +25,20 @@ static void usage(const char *prog)
     fprintf(stderr, "  %s -pi file [file...] line content [-q]\n", prog);
     fprintf(stderr, "  %s -d|-delete file [start-end] [-m pattern] [--dry-run] [--no-backup]\n", prog);
     fprintf(stderr, "  %s -r|-replace file [start-end] \"text\" [-m pattern] [-q] [--dry-run] [--no-backup]\n", prog);
-    fprintf(stderr, "  %s -s file pattern replacement [-e pat repl] [-m pattern] [-F delim N val] [-E] [-g]\n", prog);
+    fprintf(stderr, "  %s -s file [range] pattern replacement [-e pat repl] [-m pattern] [-E] [-g]\n", prog);
+    fprintf(stderr, "  %s -s file -F delim fields value [--where N=value]  (fields: 2 | 2,5 | 1-3 | 4-)\n", prog);
     fprintf(stderr, "  %s -l [file] [--persist]          (list backups)\n", prog);
     fprintf(stderr, "  %s -lsbak [file] [N] [--persist]  (list with date/user)\n", prog);
     fprintf(stderr, "  %s -rmbak|-z [file] [--persist]   (remove backups)\n", prog);
+    fprintf(stderr, "  %s -rebuildbak [--persist]        (rebuild the backup catalog)\n", prog);
+    fprintf(stderr, "  %s --gc [--persist]                (evict backups past IV_BACKUP_MAX_*)\n", prog);
     fprintf(stderr, "  %s --persist file                  (move repo from /tmp to ~/.local/share/iv/)\n", prog);
     fprintf(stderr, "  %s --unpersist file                (move repo from ~/.local/share/iv/ to /tmp)\n", prog);
+    fprintf(stderr, "  %s --serve [socket]                (resident mode; clients set IV_SOCKET)\n", prog);
     fprintf(stderr, "\nGlobal options: --dry-run --no-backup --no-numbers -g -E -q --stdout --json\n");
-    fprintf(stderr, "-m pattern  -F delim N  --persist for backup ops uses the persisted repo.\n");
+    fprintf(stderr, "--stats[=json]  per-phase timing and counters on stderr (or IV_STATS=1|json).\n");
+    fprintf(stderr, "-m pattern  -F delim fields [--csv]  --persist for backup ops uses the persisted repo.\n");
+    fprintf(stderr, "-E: -s, -n, -nv and -m patterns are extended regexes; -I|--ignore-case ignores case.\n");
     fprintf(stderr, "Text: \"-\" = stdin, existing path = file content, anything else = literal.\n");
     fprintf(stderr, "Ranges: 1-5, -3--1, -5-, 2-. Ephemeral backups in /tmp/iv_<user>/.\n");
 }
@@ -50,12 +59,19 @@ static void parse_opts(int argc, char *argv[], IvOpts *opts)
         else if (strcmp(argv[i], "-E") == 0 ||
                  strcmp(argv[i], "--regex") == 0)
             opts->use_regex = 1;
+        else if (strcmp(argv[i], "-I") == 0 ||
+                 strcmp(argv[i], "--ignore-case") == 0)
+            opts->ignore_case = 1;
         else if (strcmp(argv[i], "-q") == 0)
             opts->quiet = 1;
         else if (strcmp(argv[i], "--stdout") == 0)
             opts->to_stdout = 1;
         else if (strcmp(argv[i], "--json") == 0)
             opts->json = 1;
+        else if (strcmp(argv[i], "--follow") == 0)
+            opts->follow = 1;
+        else if (strcmp(argv[i], "--csv") == 0)
+            opts->csv = 1;
         else if (strcmp(argv[i], "--persist") == 0 ||
                  strcmp(argv[i], "-persistence") == 0)
             opts->persist = 1;
@@ -67,9 +83,35 @@ static void parse_opts(int argc, char *argv[], IvOpts *opts)
         else if (strcmp(argv[i], "-F") == 0 && i + 2 < argc)
         {
             opts->field_delim = argv[i + 1][0];
-            opts->field_num = atoi(argv[i + 2]);
+            opts->field_list = argv[i + 2];
             i += 2;
         }
+        else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc)
+            opts->where = argv[++i];
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc)
+        {
+            char *end;
+            opts->max_matches = strtoll(argv[++i], &end, 10);
+            if (*end || opts->max_matches < 1)
+                opts->max_matches = -1;
+        }
+        else if ((strcmp(argv[i], "-A") == 0 || strcmp(argv[i], "-B") == 0 ||
+                  strcmp(argv[i], "-C") == 0) && i + 1 < argc)
+        {
+            char *end;
+            char c = argv[i][1];
+            long n = strtol(argv[++i], &end, 10);
+            if (*end || n < 0 || n > 1000000)
+                n = -1;
+            if (c != 'B')
+                opts->after = (int)n;
+            if (c != 'A')
+                opts->before = (int)n;
+        }
+        else if (strcmp(argv[i], "--first") == 0)
+            opts->max_matches = 1;
+        else if (strcmp(argv[i], "--count") == 0)
+            opts->count_only = 1;
     }
 }
 
@@ -82,9 +124,17 @@ static int is_flag(const char *s)
            strcmp(s, "-g") == 0 ||
            strcmp(s, "-E") == 0 ||
            strcmp(s, "--regex") == 0 ||
+           strcmp(s, "-I") == 0 ||
+           strcmp(s, "--ignore-case") == 0 ||
            strcmp(s, "-q") == 0 ||
            strcmp(s, "--stdout") == 0 ||
            strcmp(s, "--json") == 0 ||
+           strcmp(s, "--follow") == 0 ||
+           strcmp(s, "--csv") == 0 ||
+           strcmp(s, "--first") == 0 ||
+           strcmp(s, "--count") == 0 ||
+           strcmp(s, "--stats") == 0 ||
+           strcmp(s, "--stats=json") == 0 ||
            strcmp(s, "--persist") == 0 ||
            strcmp(s, "-persistence") == 0 ||
            strcmp(s, "--unpersist") == 0 ||
@@ -97,12 +147,23 @@ static int is_flag(const char *s)
            strcmp(s, "-F") == 0;
 }
 
+/* --max, -A, -B and -C are followed by a number */
+static int takes_count(const char *s)
+{
+    return strcmp(s, "--max") == 0 || strcmp(s, "-A") == 0 ||
+           strcmp(s, "-B") == 0 || strcmp(s, "-C") == 0;
+}
+
 /* Index of the next positional argument starting at i (inclusive). */
 static int next_arg(int argc, char *argv[], int i)
 {
     for (; i < argc; i++)
-        if (!is_flag(argv[i]))
+    {
+        if (takes_count(argv[i]))
+            i++; /* and its count */
+        else if (!is_flag(argv[i]))
             return i;
+    }
     return -1;
 }
 
@@ -116,8 +177,9 @@ static int *collect_args(int argc, char *argv[], int start, int *n)
         return NULL;
     for (int i = start; i < argc; i++)
     {
-        /* -m and -F consume the following token(s); skip them */
-        if (strcmp(argv[i], "-m") == 0)
+        /* -m, --where, --max, -A/-B/-C and -F consume the following token(s) */
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--where") == 0 ||
+            takes_count(argv[i]))
         {
             i++;
             continue;
@@ -180,17 +242,18 @@ int is_binary_file(const char *path)
     FILE *f = fopen(path, "rb");
     if (!f)
         return 0;
+    stats_phase_begin(IV_PHASE_SCAN);
     unsigned char buf[4096];
     size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
-        for (size_t i = 0; i < n; i++)
-            if (buf[i] == 0)
-            {
-                fclose(f);
-                return 1;
-            }
+    int binary = 0;
+    while (!binary && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        IV_STAT(bytes_read, (long long)n);
+        binary = memchr(buf, 0, n) != NULL;
+    }
     fclose(f);
-    return 0;
+    stats_phase_end(IV_PHASE_SCAN);
+    return binary;
 }
 
 char *read_file_content(const char *path)
@@ -225,43 +288,53 @@ char *read_file_content(const char *path)
     return buf;
 }
 
-static char **load_lines(FILE *f, int *out_count)
+char **load_lines(FILE *f, long long *out_count)
 {
     size_t cap = INITIAL_LINES;
     char **lines = malloc(cap * sizeof(char *));
     if (!lines)
         return NULL;
-    int count = 0;
+    stats_phase_begin(IV_PHASE_LOAD);
+    IV_STAT(allocs, 1);
+    long long count = 0;
     char *line = NULL;
     size_t linecap = 0;
-    while (getline(&line, &linecap, f) != -1)
+    ssize_t len;
+    while ((len = getline(&line, &linecap, f)) != -1)
     {
         if ((size_t)count >= cap)
         {
             cap *= 2;
             char **tmp = realloc(lines, cap * sizeof(char *));
+            IV_STAT(allocs, 1);
             if (!tmp)
             {
-                for (int i = 0; i < count; i++)
+                for (long long i = 0; i < count; i++)
                     free(lines[i]);
                 free(lines);
                 free(line);
+                stats_phase_end(IV_PHASE_LOAD);
                 return NULL;
             }
             lines = tmp;
         }
         lines[count] = strdup(line);
+        IV_STAT(allocs, 1);
+        IV_STAT(bytes_read, len);
         if (!lines[count])
         {
-            for (int i = 0; i < count; i++)
+            for (long long i = 0; i < count; i++)
                 free(lines[i]);
             free(lines);
             free(line);
+            stats_phase_end(IV_PHASE_LOAD);
             return NULL;
         }
         count++;
     }
     free(line);
+    IV_STAT(lines, count);
+    stats_phase_end(IV_PHASE_LOAD);
     *out_count = count;
     return lines;
 }
@@ -278,16 +351,517 @@ static char *resolve_text(const char *arg)
     return strdup(arg);
 }
 
-static void free_lines(char **lines, int count)
+void free_lines(char **lines, long long count)
 {
     if (!lines)
         return;
-    for (int i = 0; i < count; i++)
+    for (long long i = 0; i < count; i++)
         free(lines[i]);
     free(lines);
 }
 
-int main(int argc, char *argv[])
+/* Open fname for reading, creating it empty if it does not exist. */
+static FILE *open_or_create(const char *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    if (!fp)
+    {
+        fp = fopen(fname, "w");
+        if (fp)
+            fclose(fp);
+        fp = fopen(fname, "r");
+    }
+    return fp;
+}
+
+/* Append through load + apply_patch(), for the cases append_in_place()
+ * does not handle. Same return convention as append_in_place(). */
+static int append_loaded(const char *fname, const char *new_text,
+                         const IvOpts *opts)
+{
+    if (is_binary_file(fname))
+        return 2;
+    FILE *fp = strcmp(fname, "-") == 0 ? stdin : open_or_create(fname);
+    if (!fp)
+    {
+        perror(fname);
+        return -1;
+    }
+    long long fcount = 0;
+    char **flines = load_lines(fp, &fcount);
+    if (fp != stdin)
+        fclose(fp);
+    if (!flines)
+    {
+        perror(fname);
+        return -1;
+    }
+    int r = apply_patch(fname, flines, fcount, fcount + 1, fcount + 1,
+                        new_text, 1, opts);
+    free_lines(flines, fcount);
+    return r;
+}
+
+/* Compile a -n/-nv/-m pattern; -E makes it an ERE, -I ignores case.
+ * Reports a bad one. */
+static int compile_matcher(IvMatcher *m, const char *pattern, const IvOpts *opts)
+{
+    int flags = (opts->use_regex ? IV_MATCH_REGEX : 0) |
+                (opts->ignore_case ? IV_MATCH_ICASE : 0);
+    if (matcher_compile(m, pattern, flags) == 0)
+        return 0;
+    fprintf(stderr, "iv: invalid regex pattern: %s\n", pattern);
+    return -1;
+}
+
+/* -d -m and -r -m on the piece table: each line the filter matches is
+ * deleted, or replaced by repl when it is not NULL. Lines are found in the
+ * text as read and edited at their offset moved by the earlier edits.
+ * Returns the lines changed (a line that already is repl is left alone),
+ * -1 on allocation failure. */
+static long long edit_matching_lines(IvDoc *d, const IvMatcher *filter,
+                                     const char *repl, size_t repl_len)
+{
+    const char *text = d->b[0].text;
+    size_t len = d->b[0].len;
+    long long shift = 0, changed = 0;
+    for (size_t off = 0; off < len;)
+    {
+        const char *nl = memchr(text + off, '\n', len - off);
+        size_t end = nl ? (size_t)(nl - text) + 1 : len;
+        if (matcher_match(filter, text + off, end - off) &&
+            !(repl && end - off == repl_len && memcmp(text + off, repl, repl_len) == 0))
+        {
+            size_t pos = (size_t)((long long)off + shift);
+            if (doc_delete(d, pos, end - off) != 0 ||
+                (repl && doc_insert(d, pos, repl, repl_len) != 0))
+                return -1;
+            shift += (long long)(repl ? repl_len : 0) - (long long)(end - off);
+            changed++;
+        }
+        off = end;
+    }
+    return changed;
+}
+
+/* Write the edited document over filename (after the backup started when
+ * it was loaded, which *backup is then cleared of) or to stdout, as
+ * write_lines_to_file() does for a line array. With no line changed the
+ * file, and its mtime, are left alone. */
+static void write_doc(const char *filename, const IvDoc *d, long long changed,
+                      IvBackupJob **backup, const IvOpts *opts)
+{
+    if (opts->dry_run || (!changed && !opts->to_stdout))
+        return;
+    if (opts->to_stdout)
+    {
+        doc_write(d, stdout);
+        return;
+    }
+    backup_finish(*backup);
+    *backup = NULL;
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        perror("Could not write file");
+        return;
+    }
+    doc_write(d, f);
+    stats_count_written(f);
+    fclose(f);
+}
+
+/* The range argument of -va, -d and -r when it is a selection (several
+ * ranges or /re/ addresses) rather than one parse_range() range. */
+static const char *selection_arg(const char *flag, int argc, char *argv[],
+                                 const IvOpts *opts)
+{
+    int a = -1;
+    if (strcmp(flag, "-va") == 0)
+    {
+        a = next_arg(argc, argv, 2);
+        if (a >= 0 && next_arg(argc, argv, a + 1) < 0)
+            a = -1; /* only the file */
+    }
+    else if (!opts->multimatch &&
+             (strcmp(flag, "-d") == 0 || strcmp(flag, "-delete") == 0))
+        a = next_arg(argc, argv, 3);
+    else if (!opts->multimatch &&
+             (strcmp(flag, "-r") == 0 || strcmp(flag, "-replace") == 0))
+    {
+        a = next_arg(argc, argv, 3);
+        if (a >= 0 && next_arg(argc, argv, a + 1) < 0)
+            a = -1; /* only the text */
+    }
+    if (a < 0 || (argv[a][0] != '/' && !strchr(argv[a], ',')))
+        return NULL;
+    return argv[a];
+}
+
+/* -s file -F delim LIST value and -v -F delim LIST file, streamed through
+ * field.c. Edits go to a temporary file that replaces the original only if
+ * some field changed. */
+static int run_field_mode(const char *flag, int argc, char *argv[],
+                          const IvOpts *opts)
+{
+    int edit = strcmp(flag, "-s") == 0;
+    int vi = -1, na = 0;
+    for (int i = 2; i < argc; i++)
+        if (strcmp(argv[i], "-F") == 0)
+        {
+            vi = i + 3 < argc ? i + 3 : -1;
+            break;
+        }
+    int *args = collect_args(argc, argv, 2, &na);
+    const char *filename = args && na > 0 ? argv[args[0]] : NULL;
+    free(args);
+    if (!filename || (edit && vi < 0))
+    {
+        fprintf(stderr, edit ? "Usage: -s file -F delim LIST value [--where N=value]\n"
+                             : "Usage: -v -F delim LIST file [--where N=value]\n");
+        return 1;
+    }
+
+    IvFieldSpec spec;
+    IvMatcher filter;
+    if (field_spec_init(&spec, opts->field_delim, opts->field_list, opts->where) != 0)
+    {
+        fprintf(stderr, "iv: invalid field list or --where\n");
+        return 1;
+    }
+    if (opts->multimatch && compile_matcher(&filter, opts->multimatch, opts) != 0)
+    {
+        field_spec_free(&spec);
+        return 1;
+    }
+    spec.filter = opts->multimatch ? &filter : NULL;
+    spec.no_numbers = opts->no_numbers;
+    spec.csv = opts->csv;
+    char *val = NULL;
+    if (edit)
+    {
+        val = resolve_text(argv[vi]);
+        spec.value = val ? val : "";
+    }
+
+    int from_stdin = strcmp(filename, "-") == 0;
+    int fd = -1;
+    if (edit && !from_stdin && is_binary_file(filename))
+        fprintf(stderr, "iv: refusing to edit binary file\n");
+    else if ((fd = from_stdin ? 0 : open(filename, O_RDONLY)) < 0)
+        perror(filename);
+    if (fd < 0)
+    {
+        if (spec.filter)
+            matcher_free(&filter);
+        field_spec_free(&spec);
+        free(val);
+        return 1;
+    }
+
+    long long n;
+    stats_phase_begin(edit ? IV_PHASE_EDIT : IV_PHASE_VIEW);
+    if (!edit || from_stdin || opts->to_stdout || opts->dry_run)
+        n = field_stream(fd, edit && opts->dry_run ? NULL : stdout, &spec);
+    else
+    {
+        char tmp[PATH_MAX];
+        int tfd = open_temp_beside(filename, tmp, sizeof(tmp));
+        FILE *out = tfd >= 0 ? fdopen(tfd, "w") : NULL;
+        if (!out)
+        {
+            perror("Could not write file");
+            if (tfd >= 0)
+            {
+                close(tfd);
+                unlink(tmp);
+            }
+            n = -1;
+        }
+        else
+        {
+            IvBackupJob *backup = opts->no_backup ? NULL : backup_start(filename, opts->persist);
+            n = field_stream(fd, out, &spec);
+            stats_count_written(out);
+            if (fclose(out) != 0)
+                n = -1;
+            if (n > 0)
+            {
+                backup_finish(backup);
+                if (replace_file_with(filename, tmp) != 0)
+                    n = -1;
+            }
+            else
+            {
+                backup_abandon(backup);
+                unlink(tmp);
+            }
+        }
+    }
+    stats_phase_end(edit ? IV_PHASE_EDIT : IV_PHASE_VIEW);
+    if (!from_stdin)
+        close(fd);
+    if (n < 0)
+        perror(filename);
+    else if (edit && n > 0)
+        fprintf(stderr, "Replaced %lld occurrence(s)\n", n);
+    if (spec.filter)
+        matcher_free(&filter);
+    field_spec_free(&spec);
+    free(val);
+    return n < 0 ? 1 : 0;
+}
+
+static void free_pairs(IvReplacer *pairs, int n)
+{
+    for (int p = 0; p < n; p++)
+        replacer_free(&pairs[p]);
+    free(pairs);
+}
+
+static int add_pair(IvReplacer *pairs, int *n, const char *pattern,
+                    const char *replacement, const IvOpts *opts)
+{
+    if (replacer_compile(&pairs[*n], pattern, replacement, opts->use_regex,
+                         opts->ignore_case) != 0)
+        return -1;
+    (*n)++;
+    return 0;
+}
+
+/* -s: the pattern/replacement pair at argv[a], argv[b] followed by every
+ * -e pair, compiled. Returns a heap array (free with free_pairs()) and
+ * writes its length to *n; NULL after saying why. */
+static IvReplacer *compile_pairs(int argc, char *argv[], int a, int b,
+                                 const IvOpts *opts, int *n)
+{
+    int want = 1;
+    for (int i = 2; i < argc - 2; i++)
+        if (strcmp(argv[i], "-e") == 0)
+            want++;
+    IvReplacer *pairs = calloc((size_t)want, sizeof(*pairs));
+    if (!pairs)
+    {
+        perror("iv");
+        return NULL;
+    }
+    *n = 0;
+    if (add_pair(pairs, n, argv[a], argv[b], opts) != 0)
+        goto bad;
+    for (int i = 2; i < argc - 2; i++)
+        if (strcmp(argv[i], "-e") == 0 &&
+            add_pair(pairs, n, argv[i + 1], argv[i + 2], opts) != 0)
+            goto bad;
+    return pairs;
+bad:
+    fprintf(stderr, "iv: invalid regex pattern or back reference\n");
+    free_pairs(pairs, *n);
+    return NULL;
+}
+
+/* -s file range pattern replacement [-e ...]: streamed, only the lines of
+ * the range go through the pairs and past its end the file is copied in
+ * blocks. /re/ addresses and ranges counted from the end take a scan of the
+ * file first. Like -F, stdin and --stdout print the whole result. */
+static int run_scoped_substitute(int argc, char *argv[], const char *filename,
+                                 const char *spec, int a, int b, const IvOpts *opts)
+{
+    IvRangeSet sel;
+    if (range_set_parse(&sel, spec, opts->ignore_case ? IV_MATCH_ICASE : 0) != 0)
+    {
+        fprintf(stderr, "Invalid range\n");
+        return 1;
+    }
+    int from_stdin = strcmp(filename, "-") == 0;
+    int npairs = 0, has_filter = 0, fd = -1;
+    IvReplacer *pairs = compile_pairs(argc, argv, a, b, opts, &npairs);
+    IvMatcher filter;
+    long long n = -1, count;
+    if (!pairs)
+        goto out;
+    if (opts->multimatch)
+    {
+        if (compile_matcher(&filter, opts->multimatch, opts) != 0)
+            goto out;
+        has_filter = 1;
+    }
+
+    int scan = 0;
+    if (!range_set_needs_count(&sel))
+        scan = range_set_finish(&sel, IV_LINES_MAX);
+    else if (from_stdin)
+    {
+        fprintf(stderr, "iv: /re/ addresses and ranges from the end need a file\n");
+        goto out;
+    }
+    else
+        scan = scan_selection(filename, &count, &sel);
+    if (scan == 1)
+        fprintf(stderr, "iv: refusing to edit binary file\n");
+    else if (scan < 0 || (fd = from_stdin ? 0 : open(filename, O_RDONLY)) < 0)
+        perror(filename);
+    if (fd < 0)
+        goto out;
+
+    const IvMatcher *only = has_filter ? &filter : NULL;
+    stats_phase_begin(IV_PHASE_EDIT);
+    if (from_stdin || opts->to_stdout || opts->dry_run)
+        n = substitute_stream(fd, opts->dry_run ? NULL : stdout, &sel, pairs, npairs,
+                              opts->global_replace, only);
+    else
+    {
+        char tmp[PATH_MAX];
+        int tfd = open_temp_beside(filename, tmp, sizeof(tmp));
+        FILE *f = tfd >= 0 ? fdopen(tfd, "w") : NULL;
+        if (!f)
+        {
+            perror("Could not write file");
+            if (tfd >= 0)
+            {
+                close(tfd);
+                unlink(tmp);
+            }
+        }
+        else
+        {
+            IvBackupJob *backup = opts->no_backup ? NULL : backup_start(filename, opts->persist);
+            n = substitute_stream(fd, f, &sel, pairs, npairs, opts->global_replace, only);
+            stats_count_written(f);
+            if (fclose(f) != 0 && n >= 0)
+            {
+                perror("Could not write file");
+                n = -3;
+            }
+            if (n > 0)
+            {
+                backup_finish(backup);
+                if (replace_file_with(filename, tmp) != 0)
+                    n = -3;
+            }
+            else
+            {
+                backup_abandon(backup);
+                unlink(tmp);
+            }
+        }
+    }
+    stats_phase_end(IV_PHASE_EDIT);
+    if (n == -2)
+        fprintf(stderr, "iv: refusing to edit binary file\n");
+    else if (n == -1)
+        perror(filename);
+    else if (n > 0)
+        fprintf(stderr, "Replaced %lld occurrence(s)\n", n);
+    if (!from_stdin)
+        close(fd);
+
+out:
+    if (has_filter)
+        matcher_free(&filter);
+    if (pairs)
+        free_pairs(pairs, npairs);
+    range_set_free(&sel);
+    return n < 0 ? 1 : 0;
+}
+
+/* -n / -nv: from the --serve cache when it holds the file, otherwise read
+ * block by block, so --max, --first, --count and the end of a range stop
+ * reading as soon as the answer is known. */
+static int run_find(const char *flag, int argc, char *argv[],
+                    const char *filename, const IvOpts *opts)
+{
+    int nv = strcmp(flag, "-nv") == 0;
+    int a = next_arg(argc, argv, 3);
+    if (a < 0)
+    {
+        fprintf(stderr, nv ? "Usage: -nv file [range] pattern [--no-numbers] [-A N] [-B N] [-C N] [--max N|--first] [--count]\n"
+                           : "Usage: -n file [range] pattern [--json] [--max N|--first] [--count]\n");
+        return 1;
+    }
+    /* file range pattern: only the lines of the range are searched */
+    const char *spec = NULL;
+    int b = next_arg(argc, argv, a + 1);
+    if (b >= 0)
+    {
+        spec = argv[a];
+        a = b;
+    }
+    if (opts->max_matches < 0)
+    {
+        fprintf(stderr, "iv: --max needs a positive number\n");
+        return 1;
+    }
+    if (opts->before < 0 || opts->after < 0)
+    {
+        fprintf(stderr, "iv: -A, -B and -C need a number of lines\n");
+        return 1;
+    }
+    IvMatcher m;
+    IvRangeSet scope;
+    if (!*argv[a])
+        return 0;
+    if (spec && range_set_parse(&scope, spec, opts->ignore_case ? IV_MATCH_ICASE : 0) != 0)
+    {
+        fprintf(stderr, "Invalid range\n");
+        return 1;
+    }
+    if (compile_matcher(&m, argv[a], opts) != 0)
+    {
+        if (spec)
+            range_set_free(&scope);
+        return 1;
+    }
+
+    IvFind f = {nv, opts->no_numbers, opts->json, opts->count_only, opts->max_matches,
+                opts->before, opts->after, spec ? &scope : NULL};
+    long long count = 0;
+    int ret = 0;
+    char **lines = serve_cached_lines(filename, &count);
+    /* A range needing the line count costs a scan of the file first */
+    int scan = 0;
+    if (spec && lines)
+        scan = range_set_lines(&scope, lines, count);
+    else if (spec && !range_set_needs_count(&scope))
+        scan = range_set_finish(&scope, IV_LINES_MAX);
+    else if (spec && strcmp(filename, "-") == 0)
+    {
+        fprintf(stderr, "iv: /re/ addresses and ranges from the end need a file\n");
+        ret = 1;
+    }
+    else if (spec)
+        scan = scan_selection(filename, &count, &scope);
+    if (scan != 0)
+    {
+        if (scan == 1)
+            fprintf(stderr, "iv: %s: binary file\n", filename);
+        else
+            perror(filename);
+        ret = 1;
+    }
+    stats_phase_begin(IV_PHASE_VIEW);
+    if (ret == 0 && lines)
+        find_lines(lines, count, &m, &f);
+    else if (ret == 0)
+    {
+        int fd = strcmp(filename, "-") == 0 ? 0 : open(filename, O_RDONLY);
+        if (fd < 0 || find_stream(fd, &m, &f) < 0)
+        {
+            perror(filename);
+            ret = 1;
+        }
+        if (fd > 0)
+            close(fd);
+    }
+    stats_phase_end(IV_PHASE_VIEW);
+    if (lines && !serve_owns_lines(lines))
+        free_lines(lines, count);
+    matcher_free(&m);
+    if (spec)
+        range_set_free(&scope);
+    return ret;
+}
+
+static int run_command(int argc, char *argv[])
 {
     if (argc < 2)
     {
@@ -366,6 +940,35 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    /* ── -rebuildbak: rebuild the backup catalogs from the directories ── */
+    if (strcmp(flag, "-rebuildbak") == 0)
+    {
+        int rc = 0;
+        for (int p = persisted; p <= 1; p++)
+        {
+            int n = rebuild_backup_catalog(p);
+            if (n < 0)
+            {
+                perror(get_backup_root(p));
+                rc = 1;
+            }
+            else
+                fprintf(stderr, "iv: catalog of %s: %d slot(s)\n", get_backup_root(p), n);
+        }
+        return rc;
+    }
+
+    /* ── --gc: enforce the backup limits now ── */
+    if (strcmp(flag, "--gc") == 0)
+    {
+        if (gc_backups(persisted) != 0)
+        {
+            perror(get_backup_root(persisted));
+            return 1;
+        }
+        return 0;
+    }
+
     /* ── -lsbak ── */
     if (strcmp(flag, "-lsbak") == 0)
     {
@@ -459,19 +1062,26 @@ int main(int argc, char *argv[])
             fprintf(stderr, "iv: -diff needs a file\n");
             return 1;
         }
-        char bakname[PATH_MAX];
-        get_backup_path_n(filename, persisted, diff_slot, bakname, sizeof(bakname));
-        FILE *bak = fopen(bakname, "r");
-        if (!bak)
+        char bakname[PATH_MAX], label[PATH_MAX];
+        int tmp_slot = backup_slot_path(filename, persisted, diff_slot,
+                                        bakname, sizeof(bakname));
+        backup_slot_name(filename, persisted, diff_slot, label, sizeof(label));
+        if (tmp_slot == -2)
+        {
+            fprintf(stderr, "iv: backup %d is an append undo and %s no longer "
+                            "contains that content\n", diff_slot, filename);
+            return 1;
+        }
+        if (tmp_slot < 0)
         {
             fprintf(stderr, "iv: no backup %d found for %s\n", diff_slot, filename);
             return 0;
         }
-        fclose(bak);
         if (unified)
         {
-            char cmd[PATH_MAX * 2 + 32];
-            snprintf(cmd, sizeof(cmd), "diff -u \"%s\" \"%s\"", bakname, filename);
+            char cmd[PATH_MAX * 3 + 64];
+            snprintf(cmd, sizeof(cmd), "diff -u -L \"%s (backup %d)\" \"%s\" \"%s\"",
+                     label, diff_slot, bakname, filename);
             FILE *p = popen(cmd, "r");
             if (p)
             {
@@ -483,11 +1093,13 @@ int main(int argc, char *argv[])
         }
         else
         {
-            fprintf(stdout, "--- %s (backup %d)\n", bakname, diff_slot);
+            fprintf(stdout, "--- %s (backup %d)\n", label, diff_slot);
             stream_file_with_numbers(bakname);
             fprintf(stdout, "\n--- %s (current)\n", filename);
             stream_file_with_numbers(filename);
         }
+        if (tmp_slot == 1)
+            unlink(bakname);
         return 0;
     }
 
@@ -501,228 +1113,64 @@ int main(int argc, char *argv[])
             if (n >= 1)
                 slot = n;
         }
-        char bakname[PATH_MAX];
-        get_backup_path_n(filename, persisted, slot, bakname, sizeof(bakname));
-        FILE *src = fopen(bakname, "r");
-        if (!src)
+        return restore_backup_slot(filename, persisted, slot) == 0 ? 0 : 1;
+    }
+
+    /* ── -a append: in place, without loading the file ── */
+    if (strcmp(flag, "-a") == 0)
+    {
+        int a = next_arg(argc, argv, 3);
+        char *new_text = (a >= 0) ? resolve_text(argv[a]) : strdup("");
+        if (!new_text)
+            new_text = strdup("");
+        int r = append_in_place(filename, new_text, &opts);
+        if (r == 1)
+            r = append_loaded(filename, new_text, &opts);
+        if (r == 2)
         {
-            fprintf(stderr, "iv: no backup %d found (%s)\n", slot, bakname);
+            fprintf(stderr, "iv: refusing to edit binary file\n");
+            free(new_text);
             return 1;
         }
-        FILE *dst = fopen(filename, "w");
-        if (!dst)
+        if (r == 0 && !opts.dry_run && !opts.quiet)
         {
-            fclose(src);
-            perror(filename);
-            return 1;
+            printf("%s", new_text);
+            if (new_text[strlen(new_text) - 1] != '\n')
+                putchar('\n');
         }
-        char buf[8192];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
-            fwrite(buf, 1, n, dst);
-        fclose(src);
-        fclose(dst);
-        return 0;
+        free(new_text);
+        return r < 0 ? 1 : 0;
     }
 
-    /* ── Load file into memory ── */
-    FILE *f;
-    if (strcmp(filename, "-") == 0)
-    {
-        f = stdin;
-    }
-    else
+    /* ── -p patch: one or more files, [range], content ── */
+    if (strcmp(flag, "-p") == 0)
     {
-        f = fopen(filename, "r");
-        if (!f)
+        int nargs = 0;
+        int *args = collect_args(argc, argv, 2, &nargs);
+        if (!args || nargs == 0)
+        {
+            free(args);
+            fprintf(stderr, "iv: -p needs at least file and content\n");
+            return 1;
+        }
+        char *content_arg = argv[args[nargs - 1]];
+        char *new_text = strcmp(content_arg, "-") == 0
+                             ? read_stdin()
+                             : resolve_text(content_arg);
+        if (!new_text)
+            new_text = strdup("");
+
+        long long start = 0, end = 0;
+        int has_range = 0, nfiles = nargs - 1;
+        if (nargs >= 2)
         {
-            if (strcmp(flag, "-i") == 0 || strcmp(flag, "-insert") == 0 ||
-                strcmp(flag, "-a") == 0 || strcmp(flag, "-p") == 0 ||
-                strcmp(flag, "-pi") == 0)
+            long long s, e;
+            if (parse_range(argv[args[nargs - 2]], IV_LINES_MAX, &s, &e) == 0)
             {
-                f = fopen(filename, "w");
-                if (f)
-                    fclose(f);
-                f = fopen(filename, "r");
-            }
-        }
-    }
-    if (!f)
-    {
-        perror(filename);
-        return 1;
-    }
-
-    int count = 0;
-    char **lines = load_lines(f, &count);
-    if (f != stdin)
-        fclose(f);
-    if (!lines)
-    {
-        perror("load_lines");
-        return 1;
-    }
-
-    int ret = 0;
-
-    /* ── -v ── */
-    if (strcmp(flag, "-v") == 0)
-    {
-        show_file(lines, count, opts.no_numbers);
-        goto done;
-    }
-
-    /* ── -va ── */
-    if (strcmp(flag, "-va") == 0)
-    {
-        int ri = next_arg(argc, argv, 2);
-        if (ri < 0)
-        {
-            fprintf(stderr, "Missing range\n");
-            ret = 1;
-            goto done;
-        }
-        int start, end;
-        if (parse_range(argv[ri], count, &start, &end) < 0)
-        {
-            fprintf(stderr, "Invalid range\n");
-            ret = 1;
-            goto done;
-        }
-        show_range(lines, count, start, end, opts.no_numbers);
-        goto done;
-    }
-
-    /* ── -wc ── */
-    if (strcmp(flag, "-wc") == 0)
-    {
-        printf("%d\n", wc_lines(lines, count));
-        goto done;
-    }
-
-    /* ── -n ── */
-    if (strcmp(flag, "-n") == 0)
-    {
-        int a = next_arg(argc, argv, 3);
-        if (a < 0)
-        {
-            fprintf(stderr, "Usage: -n file pattern [--json]\n");
-            ret = 1;
-            goto done;
-        }
-        find_line_numbers(lines, count, argv[a], opts.json);
-        goto done;
-    }
-
-    /* ── -nv ── */
-    if (strcmp(flag, "-nv") == 0)
-    {
-        int a = next_arg(argc, argv, 3);
-        if (a < 0)
-        {
-            fprintf(stderr, "Usage: -nv file pattern [--no-numbers]\n");
-            ret = 1;
-            goto done;
-        }
-        find_matching_lines(lines, count, argv[a], opts.no_numbers);
-        goto done;
-    }
-
-    /* ── -i / -insert ── */
-    if (strcmp(flag, "-i") == 0 || strcmp(flag, "-insert") == 0)
-    {
-        if (is_binary_file(filename))
-        {
-            fprintf(stderr, "iv: refusing to edit binary file\n");
-            ret = 1;
-            goto done;
-        }
-        int start = count + 1, end = count + 1;
-        char *new_text = NULL;
-        int a = next_arg(argc, argv, 3);
-        int b = (a >= 0) ? next_arg(argc, argv, a + 1) : -1;
-        if (a < 0)
-        {
-            new_text = strdup("");
-        }
-        else if (b < 0)
-        {
-            new_text = resolve_text(argv[a]);
-        }
-        else
-        {
-            if (parse_range(argv[a], count, &start, &end) < 0)
-            {
-                fprintf(stderr, "Invalid range\n");
-                ret = 1;
-                goto done;
-            }
-            new_text = resolve_text(argv[b]);
-        }
-        if (!new_text)
-            new_text = strdup("");
-        if (apply_patch(filename, lines, count, start, end, new_text, 1, &opts) == 0 && !opts.dry_run && !opts.quiet)
-        {
-            printf("%s", new_text);
-            if (new_text[strlen(new_text) - 1] != '\n')
-                putchar('\n');
-        }
-        free(new_text);
-        goto done;
-    }
-
-    /* ── -a append ── */
-    if (strcmp(flag, "-a") == 0)
-    {
-        if (is_binary_file(filename))
-        {
-            fprintf(stderr, "iv: refusing to edit binary file\n");
-            ret = 1;
-            goto done;
-        }
-        int a = next_arg(argc, argv, 3);
-        char *new_text = (a >= 0) ? resolve_text(argv[a]) : strdup("");
-        if (!new_text)
-            new_text = strdup("");
-        if (apply_patch(filename, lines, count, count + 1, count + 1, new_text, 1, &opts) == 0 && !opts.dry_run && !opts.quiet)
-        {
-            printf("%s", new_text);
-            if (new_text[strlen(new_text) - 1] != '\n')
-                putchar('\n');
-        }
-        free(new_text);
-        goto done;
-    }
-
-    /* ── -p patch: one or more files, [range], content ── */
-    if (strcmp(flag, "-p") == 0)
-    {
-        int nargs = 0;
-        int *args = collect_args(argc, argv, 2, &nargs);
-        if (!args || nargs == 0)
-        {
-            free(args);
-            fprintf(stderr, "iv: -p needs at least file and content\n");
-            ret = 1;
-            goto done;
-        }
-        char *content_arg = argv[args[nargs - 1]];
-        char *new_text = strcmp(content_arg, "-") == 0
-                             ? read_stdin()
-                             : resolve_text(content_arg);
-        if (!new_text)
-            new_text = strdup("");
-
-        int start = 0, end = 0, has_range = 0, nfiles = nargs - 1;
-        if (nargs >= 2)
-        {
-            int s, e;
-            if (parse_range(argv[args[nargs - 2]], 10000, &s, &e) == 0)
-            {
-                start = s;
-                end = e;
-                has_range = 1;
-                nfiles = nargs - 2;
+                start = s;
+                end = e;
+                has_range = 1;
+                nfiles = nargs - 2;
             }
         }
         if (nfiles == 0)
@@ -730,70 +1178,71 @@ int main(int argc, char *argv[])
             fprintf(stderr, "iv: -p needs at least one file\n");
             free(new_text);
             free(args);
-            ret = 1;
-            goto done;
+            return 1;
         }
         int mode = (has_range && start != end) ? 3 : 1;
+        int ret = 0;
 
         for (int fi = 0; fi < nfiles; fi++)
         {
             const char *fname = argv[args[fi]];
-            if (is_binary_file(fname))
-            {
-                fprintf(stderr, "iv: refusing to edit binary file %s\n", fname);
-                ret = 1;
-                continue;
-            }
-            FILE *fp = fopen(fname, "r");
-            if (!fp)
-            {
-                fp = fopen(fname, "w");
-                if (fp)
-                    fclose(fp);
-                fp = fopen(fname, "r");
-            }
-            if (!fp)
-            {
-                perror(fname);
-                continue;
-            }
-            int fcount = 0;
-            char **flines = load_lines(fp, &fcount);
-            fclose(fp);
-            if (!flines)
-            {
-                perror(fname);
-                continue;
-            }
-
-            int fstart, fend;
+            int r;
             if (!has_range)
             {
-                fstart = fcount + 1;
-                fend = fcount + 1;
+                r = append_in_place(fname, new_text, &opts);
+                if (r == 1)
+                    r = append_loaded(fname, new_text, &opts);
+                if (r == 2)
+                {
+                    fprintf(stderr, "iv: refusing to edit binary file %s\n", fname);
+                    ret = 1;
+                    continue;
+                }
             }
             else
             {
-                fstart = start;
-                fend = end;
+                FILE *fp = open_or_create(fname);
+                if (!fp)
+                {
+                    perror(fname);
+                    continue;
+                }
+                fclose(fp);
+                long long fcount = 0;
+                int scan = scan_text_file(fname, &fcount);
+                if (scan == 1)
+                {
+                    fprintf(stderr, "iv: refusing to edit binary file %s\n", fname);
+                    ret = 1;
+                    continue;
+                }
+                if (scan < 0)
+                {
+                    perror(fname);
+                    continue;
+                }
+
+                long long fstart = start, fend = end;
                 if (fstart > fcount && !mode)
                     fstart = fcount + 1;
                 if (fend > fcount)
                     fend = mode == 3 ? fcount : fcount + 1;
                 if (fstart < 1)
                     fstart = 1;
+                r = stream_patch(fname, fcount, fstart, fend, new_text, mode, &opts);
+                if (r == -2)
+                    ret = 1;
             }
-            if (apply_patch(fname, flines, fcount, fstart, fend, new_text, mode, &opts) == 0 && !opts.dry_run && !opts.quiet)
+            if (r == 0 && !opts.dry_run && !opts.quiet)
             {
                 printf("%s", new_text);
                 if (new_text[0] && new_text[strlen(new_text) - 1] != '\n')
                     putchar('\n');
             }
-            free_lines(flines, fcount);
         }
         free(new_text);
         free(args);
-        goto done;
+        return ret;
     }
 
     /* ── -pi patch insert ── */
@@ -805,8 +1254,7 @@ int main(int argc, char *argv[])
         {
             free(args);
             fprintf(stderr, "iv: -pi needs at least file and content\n");
-            ret = 1;
-            goto done;
+            return 1;
         }
         char *content_arg = argv[args[nargs - 1]];
         char *new_text = strcmp(content_arg, "-") == 0
@@ -815,11 +1263,12 @@ int main(int argc, char *argv[])
         if (!new_text)
             new_text = strdup("");
 
-        int insert_line = 0, nfiles = nargs - 1;
+        long long insert_line = 0;
+        int nfiles = nargs - 1;
         if (nargs >= 2)
         {
-            int s, e;
-            if (parse_range(argv[args[nargs - 2]], 10000, &s, &e) == 0)
+            long long s, e;
+            if (parse_range(argv[args[nargs - 2]], IV_LINES_MAX, &s, &e) == 0)
             {
                 insert_line = s;
                 nfiles = nargs - 2;
@@ -830,97 +1279,354 @@ int main(int argc, char *argv[])
             fprintf(stderr, "iv: -pi needs at least one file\n");
             free(new_text);
             free(args);
-            ret = 1;
-            goto done;
+            return 1;
         }
+        int ret = 0;
 
         for (int fi = 0; fi < nfiles; fi++)
         {
             const char *fname = argv[args[fi]];
-            if (is_binary_file(fname))
-            {
-                fprintf(stderr, "iv: refusing to edit binary file %s\n", fname);
-                ret = 1;
-                continue;
-            }
-            FILE *fp = fopen(fname, "r");
-            if (!fp)
-            {
-                fp = fopen(fname, "w");
-                if (fp)
-                    fclose(fp);
-                fp = fopen(fname, "r");
-            }
+            FILE *fp = open_or_create(fname);
             if (!fp)
             {
                 perror(fname);
                 continue;
             }
-            int fcount = 0;
-            char **flines = load_lines(fp, &fcount);
             fclose(fp);
-            if (!flines)
+            long long fcount = 0;
+            int scan = scan_text_file(fname, &fcount);
+            if (scan == 1)
+            {
+                fprintf(stderr, "iv: refusing to edit binary file %s\n", fname);
+                ret = 1;
+                continue;
+            }
+            if (scan < 0)
             {
                 perror(fname);
                 continue;
             }
 
-            int fstart = insert_line > 0 ? insert_line : fcount + 1;
+            long long fstart = insert_line > 0 ? insert_line : fcount + 1;
             if (fstart < 1)
                 fstart = 1;
-            if (apply_patch(fname, flines, fcount, fstart, fstart, new_text, 4, &opts) == 0 && !opts.dry_run && !opts.quiet)
+            int r = stream_patch(fname, fcount, fstart, fstart, new_text, 4, &opts);
+            if (r == -2)
+                ret = 1;
+            if (r == 0 && !opts.dry_run && !opts.quiet)
             {
                 printf("%s", new_text);
                 if (new_text[0] && new_text[strlen(new_text) - 1] != '\n')
                     putchar('\n');
             }
-            free_lines(flines, fcount);
         }
         free(new_text);
         free(args);
+        return ret;
+    }
+
+    /* ── --follow: -nv / -va on a growing file ── */
+    if (opts.follow && (strcmp(flag, "-nv") == 0 || strcmp(flag, "-va") == 0))
+    {
+        if (strcmp(filename, "-") == 0)
+        {
+            fprintf(stderr, "iv: --follow needs a file, not stdin\n");
+            return 1;
+        }
+        int a = next_arg(argc, argv, strcmp(flag, "-nv") == 0 ? 3 : 2);
+        if (a < 0)
+        {
+            fprintf(stderr, strcmp(flag, "-nv") == 0 ? "Usage: -nv file pattern [--no-numbers]\n"
+                                                      : "Missing range\n");
+            return 1;
+        }
+        if (strcmp(flag, "-va") == 0 && (argv[a][0] == '/' || strchr(argv[a], ',')))
+        {
+            fprintf(stderr, "iv: --follow takes a single range\n");
+            return 1;
+        }
+        if (strcmp(flag, "-nv") == 0 && next_arg(argc, argv, a + 1) >= 0)
+        {
+            fprintf(stderr, "iv: --follow takes no range with -nv\n");
+            return 1;
+        }
+        if (strcmp(flag, "-va") == 0)
+            return follow_range(filename, argv[a], opts.no_numbers) == 0 ? 0 : 1;
+        IvMatcher m;
+        if (!*argv[a])
+            return 0;
+        if (compile_matcher(&m, argv[a], &opts) != 0)
+            return 1;
+        int r = follow_matching_lines(filename, &m, opts.no_numbers);
+        matcher_free(&m);
+        return r == 0 ? 0 : 1;
+    }
+
+    /* ── -n / -nv ── */
+    if (strcmp(flag, "-n") == 0 || strcmp(flag, "-nv") == 0)
+        return run_find(flag, argc, argv, filename, &opts);
+
+    /* ── -F field mode: -v selects, -s replaces; streamed ── */
+    if (opts.field_delim && (strcmp(flag, "-v") == 0 || strcmp(flag, "-s") == 0))
+        return run_field_mode(flag, argc, argv, &opts);
+
+    /* ── -s file range pattern replacement: streamed ── */
+    if (strcmp(flag, "-s") == 0)
+    {
+        int na = 0;
+        int *args = collect_args(argc, argv, 3, &na);
+        int r = -1;
+        if (args && na >= 3)
+            r = run_scoped_substitute(argc, argv, filename, argv[args[0]], args[1],
+                                      args[2], &opts);
+        free(args);
+        if (r >= 0)
+            return r;
+    }
+
+    /* ── Load file into memory ──
+     * Range edits on a regular file stream through it instead: only the
+     * line count is needed up front. */
+    int is_insert = strcmp(flag, "-i") == 0 || strcmp(flag, "-insert") == 0;
+    int stream_edit = strcmp(filename, "-") != 0 && !opts.multimatch &&
+                      (is_insert ||
+                       strcmp(flag, "-d") == 0 || strcmp(flag, "-delete") == 0 ||
+                       strcmp(flag, "-r") == 0 || strcmp(flag, "-replace") == 0);
+    /* Read-only commands may reuse the line array cached by --serve */
+    int is_view = strcmp(flag, "-v") == 0 || strcmp(flag, "-va") == 0 ||
+                  strcmp(flag, "-wc") == 0;
+    /* -d -m and -r -m edit a piece table instead of a line array */
+    int doc_edit = opts.multimatch &&
+                   (strcmp(flag, "-d") == 0 || strcmp(flag, "-delete") == 0 ||
+                    strcmp(flag, "-r") == 0 || strcmp(flag, "-replace") == 0);
+    /* Several ranges or /re/ addresses: resolved while the file is scanned
+     * or loaded, into intervals the -va, -d and -r paths walk in order */
+    IvRangeSet sel;
+    const char *sel_spec = selection_arg(flag, argc, argv, &opts);
+    if (sel_spec && range_set_parse(&sel, sel_spec,
+                                    opts.ignore_case ? IV_MATCH_ICASE : 0) != 0)
+    {
+        fprintf(stderr, "Invalid range\n");
+        return 1;
+    }
+    long long count = 0;
+    char **lines = NULL;
+    IvDoc doc;
+    IvBackupJob *backup = NULL; /* -d -m, -r -m: copied while the edit runs */
+    if (stream_edit)
+    {
+        if (is_insert)
+        {
+            FILE *fp = open_or_create(filename);
+            if (fp)
+                fclose(fp);
+        }
+        int scan = sel_spec ? scan_selection(filename, &count, &sel)
+                            : scan_text_file(filename, &count);
+        if (scan < 0)
+        {
+            perror(filename);
+            if (sel_spec)
+                range_set_free(&sel);
+            return 1;
+        }
+        if (scan == 1)
+        {
+            fprintf(stderr, "iv: refusing to edit binary file\n");
+            if (sel_spec)
+                range_set_free(&sel);
+            return 1;
+        }
+    }
+    else if (doc_edit)
+    {
+        int fd = strcmp(filename, "-") == 0 ? 0 : open(filename, O_RDONLY);
+        if (fd > 0 && !opts.dry_run && !opts.to_stdout && !opts.no_backup)
+            backup = backup_start(filename, persisted);
+        if (fd < 0 || doc_load(&doc, fd) != 0)
+        {
+            perror(filename);
+            backup_abandon(backup);
+            if (fd > 0)
+                close(fd);
+            return 1;
+        }
+        if (fd > 0)
+            close(fd);
+        count = doc_lines(&doc);
+    }
+    else if (!(lines = is_view ? serve_cached_lines(filename, &count) : NULL))
+    {
+        FILE *f;
+        if (strcmp(filename, "-") == 0)
+            f = stdin;
+        else if (is_insert)
+            f = open_or_create(filename);
+        else
+            f = fopen(filename, "r");
+        if (!f)
+        {
+            perror(filename);
+            if (sel_spec)
+                range_set_free(&sel);
+            return 1;
+        }
+
+        lines = load_lines(f, &count);
+        if (f != stdin)
+            fclose(f);
+        if (!lines)
+        {
+            perror("load_lines");
+            if (sel_spec)
+                range_set_free(&sel);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    if (is_view)
+        stats_phase_begin(IV_PHASE_VIEW);
+
+    /* -m for -d, -r and -s: compiled once for every line */
+    IvMatcher filter;
+    int has_filter = opts.multimatch != NULL;
+    if (has_filter && compile_matcher(&filter, opts.multimatch, &opts) != 0)
+    {
+        has_filter = 0;
+        ret = 1;
+        goto done;
+    }
+    if (sel_spec && !stream_edit && range_set_lines(&sel, lines, count) != 0)
+    {
+        perror("iv");
+        ret = 1;
+        goto done;
+    }
+
+    /* ── -v ── */
+    if (strcmp(flag, "-v") == 0)
+    {
+        show_file(lines, count, opts.no_numbers);
+        goto done;
+    }
+
+    /* ── -va ── */
+    if (strcmp(flag, "-va") == 0)
+    {
+        int ri = next_arg(argc, argv, 2);
+        if (ri < 0)
+        {
+            fprintf(stderr, "Missing range\n");
+            ret = 1;
+            goto done;
+        }
+        if (sel_spec)
+        {
+            for (size_t k = 0; k < sel.n; k++)
+                show_range(lines, count, sel.iv[k].start, sel.iv[k].end, opts.no_numbers);
+            goto done;
+        }
+        long long start, end;
+        if (parse_range(argv[ri], count, &start, &end) < 0)
+        {
+            fprintf(stderr, "Invalid range\n");
+            ret = 1;
+            goto done;
+        }
+        show_range(lines, count, start, end, opts.no_numbers);
+        goto done;
+    }
+
+    /* ── -wc ── */
+    if (strcmp(flag, "-wc") == 0)
+    {
+        printf("%lld\n", wc_lines(lines, count));
+        goto done;
+    }
+
+    /* ── -i / -insert ── */
+    if (is_insert)
+    {
+        if (!stream_edit && is_binary_file(filename))
+        {
+            fprintf(stderr, "iv: refusing to edit binary file\n");
+            ret = 1;
+            goto done;
+        }
+        long long start = count + 1, end = count + 1;
+        char *new_text = NULL;
+        int a = next_arg(argc, argv, 3);
+        int b = (a >= 0) ? next_arg(argc, argv, a + 1) : -1;
+        if (a < 0)
+        {
+            new_text = strdup("");
+        }
+        else if (b < 0)
+        {
+            new_text = resolve_text(argv[a]);
+        }
+        else
+        {
+            if (parse_range(argv[a], count, &start, &end) < 0)
+            {
+                fprintf(stderr, "Invalid range\n");
+                ret = 1;
+                goto done;
+            }
+            new_text = resolve_text(argv[b]);
+        }
+        if (!new_text)
+            new_text = strdup("");
+        int r = stream_edit
+                    ? stream_patch(filename, count, start, end, new_text, 1, &opts)
+                    : apply_patch(filename, lines, count, start, end, new_text, 1, &opts);
+        if (r == -2)
+            ret = 1;
+        if (r == 0 && !opts.dry_run && !opts.quiet)
+        {
+            printf("%s", new_text);
+            if (new_text[strlen(new_text) - 1] != '\n')
+                putchar('\n');
+        }
+        free(new_text);
         goto done;
     }
 
     /* ── -d / -delete ── */
     if (strcmp(flag, "-d") == 0 || strcmp(flag, "-delete") == 0)
     {
-        if (is_binary_file(filename))
+        if (!stream_edit && is_binary_file(filename))
         {
             fprintf(stderr, "iv: refusing to edit binary file\n");
             ret = 1;
             goto done;
         }
-        int start = 1, end = count;
+        long long start = 1, end = count;
         int a = next_arg(argc, argv, 3);
         if (a >= 0 && !opts.multimatch)
             parse_range(argv[a], count, &start, &end);
         if (opts.multimatch)
         {
-            int new_count = 0;
-            for (int i = 0; i < count; i++)
-            {
-                if (!strstr(lines[i], opts.multimatch))
-                {
-                    if (new_count != i)
-                        lines[new_count] = lines[i];
-                    new_count++;
-                }
-                else
-                {
-                    free(lines[i]);
-                }
-            }
-            count = new_count;
-            if (!opts.dry_run && !opts.to_stdout)
-            {
-                if (!opts.no_backup)
-                    backup_file(filename, persisted);
-                write_lines_to_file(filename, lines, count);
-            }
-            else if (opts.to_stdout)
+            long long changed = edit_matching_lines(&doc, &filter, NULL, 0);
+            if (changed < 0)
             {
-                write_lines_to_stream(stdout, lines, count);
+                perror(filename);
+                ret = 1;
+                goto done;
             }
+            write_doc(filename, &doc, changed, &backup, &opts);
+        }
+        else if (sel_spec)
+        {
+            if (stream_edit)
+                ret = stream_patch_set(filename, &sel, "", 2, &opts) == -2;
+            else
+                apply_patch_set(filename, lines, count, &sel, "", 2, &opts);
+        }
+        else if (stream_edit)
+        {
+            ret = stream_patch(filename, count, start, end, "", 2, &opts) == -2;
         }
         else
         {
@@ -932,13 +1638,13 @@ int main(int argc, char *argv[])
     /* ── -r / -replace ── */
     if (strcmp(flag, "-r") == 0 || strcmp(flag, "-replace") == 0)
     {
-        if (is_binary_file(filename))
+        if (!stream_edit && is_binary_file(filename))
         {
             fprintf(stderr, "iv: refusing to edit binary file\n");
             ret = 1;
             goto done;
         }
-        int start = 1, end = 1;
+        long long start = 1, end = 1;
         char *new_text = NULL;
         int a = next_arg(argc, argv, 3);
         int b = (a >= 0) ? next_arg(argc, argv, a + 1) : -1;
@@ -952,7 +1658,8 @@ int main(int argc, char *argv[])
         }
         else
         {
-            if (!opts.multimatch && parse_range(argv[a], count, &start, &end) < 0)
+            if (!opts.multimatch && !sel_spec &&
+                parse_range(argv[a], count, &start, &end) < 0)
             {
                 fprintf(stderr, "Invalid range\n");
                 ret = 1;
@@ -965,34 +1672,28 @@ int main(int argc, char *argv[])
 
         if (opts.multimatch)
         {
-            for (int i = 0; i < count; i++)
-            {
-                if (!strstr(lines[i], opts.multimatch))
-                    continue;
-                free(lines[i]);
-                size_t n = strlen(new_text);
-                lines[i] = malloc(n + 2);
-                if (lines[i])
-                {
-                    strcpy(lines[i], new_text);
-                    if (!n || new_text[n - 1] != '\n')
-                        strcat(lines[i], "\n");
-                }
-                else
-                {
-                    lines[i] = strdup("\n");
-                }
-            }
-            if (!opts.dry_run && !opts.to_stdout)
+            /* every matching line becomes new_text, ended by a newline */
+            size_t n = strlen(new_text);
+            char *repl = malloc(n + 2);
+            if (!repl)
             {
-                if (!opts.no_backup)
-                    backup_file(filename, persisted);
-                write_lines_to_file(filename, lines, count);
+                free(new_text);
+                ret = 1;
+                goto done;
             }
-            else if (opts.to_stdout)
+            memcpy(repl, new_text, n);
+            if (!n || new_text[n - 1] != '\n')
+                repl[n++] = '\n';
+            long long changed = edit_matching_lines(&doc, &filter, repl, n);
+            free(repl);
+            if (changed < 0)
             {
-                write_lines_to_stream(stdout, lines, count);
+                perror(filename);
+                free(new_text);
+                ret = 1;
+                goto done;
             }
+            write_doc(filename, &doc, changed, &backup, &opts);
             if (!opts.quiet)
             {
                 printf("%s", new_text);
@@ -1000,11 +1701,23 @@ int main(int argc, char *argv[])
                     putchar('\n');
             }
         }
-        else if (apply_patch(filename, lines, count, start, end, new_text, 3, &opts) == 0 && !opts.dry_run && !opts.quiet)
+        else
         {
-            printf("%s", new_text);
-            if (new_text[strlen(new_text) - 1] != '\n')
-                putchar('\n');
+            int r = sel_spec
+                        ? (stream_edit
+                               ? stream_patch_set(filename, &sel, new_text, 3, &opts)
+                               : apply_patch_set(filename, lines, count, &sel, new_text, 3, &opts))
+                        : (stream_edit
+                               ? stream_patch(filename, count, start, end, new_text, 3, &opts)
+                               : apply_patch(filename, lines, count, start, end, new_text, 3, &opts));
+            if (r == -2)
+                ret = 1;
+            if (r == 0 && !opts.dry_run && !opts.quiet)
+            {
+                printf("%s", new_text);
+                if (new_text[strlen(new_text) - 1] != '\n')
+                    putchar('\n');
+            }
         }
         free(new_text);
         goto done;
@@ -1019,105 +1732,25 @@ int main(int argc, char *argv[])
             ret = 1;
             goto done;
         }
-        int total = 0;
-
-        if (opts.field_delim && opts.field_num > 0)
+        long long total = 0;
+        int a = next_arg(argc, argv, 3);
+        int b = (a >= 0) ? next_arg(argc, argv, a + 1) : -1;
+        if (a < 0 || b < 0)
         {
-            /* Field mode: -s file -F delim N value */
-            int vi = -1;
-            for (int i = 2; i < argc - 1; i++)
-                if (strcmp(argv[i], "-F") == 0 && i + 3 < argc)
-                {
-                    vi = i + 3;
-                    break;
-                }
-            if (vi < 0)
-            {
-                fprintf(stderr, "Usage: -s file -F delim N value\n");
-                ret = 1;
-                goto done;
-            }
-            char *val = resolve_text(argv[vi]);
-            if (!val)
-                val = strdup("");
-            replace_field(lines, count, opts.field_delim, opts.field_num, val);
-            total = count;
-            free(val);
+            fprintf(stderr, "Usage: -s file [range] pattern replacement [-e ...]\n");
+            ret = 1;
+            goto done;
         }
-        else
+        int npairs;
+        IvReplacer *pairs = compile_pairs(argc, argv, a, b, &opts, &npairs);
+        if (!pairs)
         {
-            int a = next_arg(argc, argv, 3);
-            int b = (a >= 0) ? next_arg(argc, argv, a + 1) : -1;
-            if (a < 0 || b < 0)
-            {
-                fprintf(stderr, "Usage: -s file pattern replacement [-e ...]\n");
-                ret = 1;
-                goto done;
-            }
-            /* Base pair + all -e pairs */
-            int npairs = 0, pcap = 4;
-            int (*pairs)[2] = malloc(pcap * sizeof(*pairs));
-            if (!pairs)
-            {
-                ret = 1;
-                goto done;
-            }
-            pairs[npairs][0] = a;
-            pairs[npairs][1] = b;
-            npairs++;
-
-            for (int i = 2; i < argc - 2; i++)
-            {
-                if (strcmp(argv[i], "-e") == 0 && i + 2 < argc)
-                {
-                    if (npairs >= pcap)
-                    {
-                        pcap *= 2;
-                        void *tmp = realloc(pairs, pcap * sizeof(*pairs));
-                        if (!tmp)
-                        {
-                            free(pairs);
-                            ret = 1;
-                            goto done;
-                        }
-                        pairs = tmp;
-                    }
-                    pairs[npairs][0] = i + 1;
-                    pairs[npairs][1] = i + 2;
-                    npairs++;
-                }
-            }
-
-            for (int p = 0; p < npairs; p++)
-            {
-                const char *pat = argv[pairs[p][0]];
-                const char *repl = argv[pairs[p][1]];
-                int n;
-                if (opts.use_regex)
-                {
-                    n = opts.multimatch
-                            ? search_replace_regex_filtered(lines, count, pat, repl,
-                                                            opts.global_replace, opts.multimatch)
-                            : search_replace_regex(lines, count, pat, repl, opts.global_replace);
-                }
-                else
-                {
-                    n = opts.multimatch
-                            ? search_replace_filtered(lines, count, pat, repl,
-                                                      opts.global_replace, opts.multimatch)
-                            : search_replace(lines, count, pat, repl, opts.global_replace);
-                }
-                if (n < 0)
-                {
-                    fprintf(stderr, "iv: invalid regex pattern\n");
-                    free(pairs);
-                    ret = 1;
-                    goto done;
-                }
-                total += n;
-            }
-            free(pairs);
+            ret = 1;
+            goto done;
         }
+        total = substitute_lines(lines, count, pairs, npairs, opts.global_replace,
+                                 has_filter ? &filter : NULL);
+        free_pairs(pairs, npairs);
 
         if (!opts.dry_run && total > 0)
         {
@@ -1133,7 +1766,7 @@ int main(int argc, char *argv[])
             }
         }
         if (total > 0)
-            fprintf(stderr, "Replaced %d occurrence(s)\n", total);
+            fprintf(stderr, "Replaced %lld occurrence(s)\n", total);
         goto done;
     }
 
@@ -1142,6 +1775,35 @@ int main(int argc, char *argv[])
     ret = 1;
 
 done:
-    free_lines(lines, count);
+    backup_abandon(backup);
+    if (has_filter)
+        matcher_free(&filter);
+    if (doc_edit)
+        doc_free(&doc);
+    if (sel_spec)
+        range_set_free(&sel);
+    if (!serve_owns_lines(lines))
+        free_lines(lines, count);
     return ret;
+}
+
+int iv_run(int argc, char *argv[])
+{
+    stats_init(argc, argv);
+    int ret = run_command(argc, argv);
+    stats_report(argc >= 2 ? argv[1] : "");
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0)
+        return serve_main(argc >= 3 ? argv[2] : NULL);
+
+    /* Thin client: hand the command to a running `iv --serve` */
+    const char *sock = getenv("IV_SOCKET");
+    int status;
+    if (sock && *sock && serve_forward(sock, argc, argv, &status) == 0)
+        return status;
+    return iv_run(argc, argv);
 }
\ No newline at end of file
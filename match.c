@@ -0,0 +1,441 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Line matcher shared by -n, -nv, -m and --follow: a pattern is compiled
+ * once per command into the cheapest test that decides it.
+ *
+ *   literal        memmem() over the line
+ *   ERE            memmem() for the runs of bytes every match must contain
+ *                  (rarest first), then regexec() without submatches on
+ *                  the lines that have them all
+ *
+ * An ERE without metacharacters is a literal and never reaches regcomp().
+ * The line's trailing newline is not part of what a regex sees, so $ matches
+ * at the end of the line as in grep.
+ *
+ * -I folds the needles once (fold.c, Unicode simple case folding) and
+ * searches the line in place, never copying it to lowercase: an ASCII
+ * needle is located by comparing the first and last bytes in both cases
+ * 16 positions at a time (SSE2), then verified; a needle with non-ASCII
+ * text is compared code point by code point, folding the line as it goes.
+ * 'k' and 's' also match U+212A KELVIN SIGN and U+017F LONG S, so for
+ * those the UTF-8 path takes over on lines with non-ASCII bytes. */
+
+#define _GNU_SOURCE /* memmem(), REG_STARTEND */
+#include "iv.h"
+#include <ctype.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* ── Required literal ───────────────────────────────────────────────────── */
+
+/* Byte at p if it is an ordinary ERE character (or escaped punctuation);
+ * its length in *step. -1 for anything else. */
+static int ere_literal(const char *p, int *step)
+{
+    *step = 1;
+    if (*p == '\\')
+    {
+        *step = p[1] ? 2 : 1;
+        /* \< \> \` \' are GNU anchors, not the punctuation itself */
+        if (!p[1] || !ispunct((unsigned char)p[1]) || strchr("<>`'", p[1]))
+            return -1;
+        return (unsigned char)p[1];
+    }
+    if (strchr(".[]()*+?{}|^$", *p))
+        return -1;
+    return (unsigned char)*p;
+}
+
+/* Skip the bracket expression starting at p ('['); ']' right after the
+ * opening (or after '^') is a member, as are [:class:], [.x.] and [=x=]. */
+static const char *skip_bracket(const char *p)
+{
+    p++;
+    if (*p == '^')
+        p++;
+    if (*p == ']')
+        p++;
+    while (*p && *p != ']')
+    {
+        if (p[0] == '[' && p[1] && strchr(":.=", p[1]))
+        {
+            const char *e = p + 2;
+            while (*e && !(e[0] == p[1] && e[1] == ']'))
+                e++;
+            p = *e ? e + 2 : p + 1;
+        }
+        else
+            p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+/* How unlikely a run is to appear in text: letters and spaces are common,
+ * digits and capitals less so, punctuation rarely. */
+static int rarity(const char *run)
+{
+    int score = 0;
+    for (const unsigned char *p = (const unsigned char *)run; *p; p++)
+        score += islower(*p) || *p == ' ' ? 1 : isalnum(*p) ? 2 : 3;
+    return score;
+}
+
+/* Keep cur[0..*len) among the IV_MATCH_NEEDS rarest runs; resets *len. */
+static void keep_run(IvMatcher *m, const char *cur, size_t *len)
+{
+    char *run = *len ? strndup(cur, *len) : NULL;
+    *len = 0;
+    if (!run)
+        return;
+    int slot = m->nneed;
+    if (slot == IV_MATCH_NEEDS)
+    {
+        /* full: replace the most common one if this is rarer */
+        slot = 0;
+        for (int i = 1; i < m->nneed; i++)
+            if (rarity(m->need[i]) < rarity(m->need[slot]))
+                slot = i;
+        if (rarity(run) <= rarity(m->need[slot]))
+        {
+            free(run);
+            return;
+        }
+        free(m->need[slot]);
+    }
+    else
+        m->nneed++;
+    m->need[slot] = run;
+}
+
+/* Runs of literal bytes outside groups that every match of the ERE
+ * contains, rarest first, into m->need. Alternation anywhere gives up: no
+ * run is then required. */
+static void required_runs(IvMatcher *m, const char *pat)
+{
+    size_t run = 0;
+    int depth = 0;
+    char *cur = malloc(strlen(pat) + 1);
+    if (!cur || strchr(pat, '|'))
+    {
+        free(cur);
+        return;
+    }
+    for (const char *p = pat; *p;)
+    {
+        int step, c = depth == 0 ? ere_literal(p, &step) : -1;
+        if (c < 0)
+        {
+            if (*p == '[')
+                p = skip_bracket(p);
+            else if (*p == '\\')
+                p += p[1] ? 2 : 1;
+            else if (*p == '{')
+            {
+                /* interval after a non-literal atom: its digits are no run */
+                while (*p && *p != '}')
+                    p++;
+                if (*p)
+                    p++;
+            }
+            else
+            {
+                if (*p == '(')
+                    depth++;
+                else if (*p == ')' && depth > 0)
+                    depth--;
+                p++;
+            }
+            keep_run(m, cur, &run);
+            continue;
+        }
+        p += step;
+        /* c? c* c{..} may leave c out (also stacked, as in c+?); c+ keeps
+         * it but ends the run */
+        int optional = 0, repeated = 0;
+        for (; *p && strchr("?*+{", *p); p++)
+        {
+            if (*p == '+')
+                repeated = 1;
+            else
+                optional = 1;
+            if (*p == '{')
+                while (*p && *p != '}')
+                    p++;
+            if (!*p)
+                break;
+        }
+        if (optional)
+        {
+            keep_run(m, cur, &run);
+            continue;
+        }
+        cur[run++] = (char)c;
+        if (repeated)
+            keep_run(m, cur, &run);
+    }
+    keep_run(m, cur, &run);
+    free(cur);
+
+    for (int i = 1; i < m->nneed; i++)
+        for (int j = i; j > 0 && rarity(m->need[j]) > rarity(m->need[j - 1]); j--)
+        {
+            char *t = m->need[j];
+            m->need[j] = m->need[j - 1];
+            m->need[j - 1] = t;
+        }
+}
+
+/* 1 if the ERE has no metacharacters; the unescaped text goes to out. */
+static int ere_is_literal(const char *pat, char *out)
+{
+    size_t n = 0;
+    for (const char *p = pat; *p;)
+    {
+        int step, c = ere_literal(p, &step);
+        if (c < 0)
+            return 0;
+        out[n++] = (char)c;
+        p += step;
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+/* ── Search ─────────────────────────────────────────────────────────────── */
+
+static int ascii_upper(int c)
+{
+    return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+/* p[0..n) equals the folded ASCII needle nd[0..n) ignoring ASCII case */
+static int ascii_eq_fold(const char *p, const char *nd, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+    {
+        unsigned char c = (unsigned char)p[k];
+        if ((c >= 'A' && c <= 'Z' ? c + 32 : c) != (unsigned char)nd[k])
+            return 0;
+    }
+    return 1;
+}
+
+/* First occurrence of the folded ASCII needle nd (n >= 1) in hay. */
+static const char *ascii_find_fold(const char *hay, size_t len, const char *nd,
+                                   size_t n)
+{
+    if (n > len)
+        return NULL;
+    unsigned char f = (unsigned char)nd[0], l = (unsigned char)nd[n - 1];
+    unsigned char F = (unsigned char)ascii_upper(f), L = (unsigned char)ascii_upper(l);
+    size_t mid = n > 2 ? n - 2 : 0, i = 0;
+#ifdef __SSE2__
+    const __m128i vf = _mm_set1_epi8((char)f), vF = _mm_set1_epi8((char)F);
+    const __m128i vl = _mm_set1_epi8((char)l), vL = _mm_set1_epi8((char)L);
+    for (; i + n - 1 + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + n - 1));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(a, vF)),
+            _mm_or_si128(_mm_cmpeq_epi8(b, vl), _mm_cmpeq_epi8(b, vL))));
+        while (m)
+        {
+            size_t k = i + (size_t)__builtin_ctz(m);
+            if (ascii_eq_fold(hay + k + 1, nd + 1, mid))
+                return hay + k;
+            m &= m - 1;
+        }
+    }
+#endif
+    for (; i + n <= len; i++)
+    {
+        unsigned char a = (unsigned char)hay[i], b = (unsigned char)hay[i + n - 1];
+        if ((a == f || a == F) && (b == l || b == L) &&
+            ascii_eq_fold(hay + i + 1, nd + 1, mid))
+            return hay + i;
+    }
+    return NULL;
+}
+
+/* First occurrence of the folded UTF-8 needle nd in hay, comparing code
+ * points after folding hay; the match length (which may differ from n)
+ * goes to *mlen. */
+static const char *utf8_find_fold(const char *hay, size_t len, const char *nd,
+                                  size_t n, size_t *mlen)
+{
+    unsigned first;
+    size_t flen = utf8_decode(nd, n, &first);
+    for (size_t i = 0, step; i < len; i += step)
+    {
+        unsigned c;
+        step = utf8_decode(hay + i, len - i, &c);
+        if (fold_rune(c) != first)
+            continue;
+        size_t j = i + step, k = flen;
+        while (k < n && j < len)
+        {
+            unsigned hc, nc;
+            size_t nl = utf8_decode(nd + k, n - k, &nc);
+            size_t hl = utf8_decode(hay + j, len - j, &hc);
+            if (fold_rune(hc) != nc)
+                break;
+            j += hl;
+            k += nl;
+        }
+        if (k == n)
+        {
+            *mlen = j - i;
+            return hay + i;
+        }
+    }
+    return NULL;
+}
+
+static int has_high_byte(const char *s, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & 0x8080808080808080ULL)
+            return 1;
+    }
+    for (; i < len; i++)
+        if ((unsigned char)s[i] & 0x80)
+            return 1;
+    return 0;
+}
+
+/* Needle i of m in line[0..len); match length in *mlen. */
+static const char *find_need(const IvMatcher *m, int i, const char *line,
+                             size_t len, size_t *mlen)
+{
+    const char *nd = m->need[i];
+    size_t n = m->need_len[i];
+    *mlen = n;
+    if (n == 0)
+        return line;
+    if (!m->icase)
+        return memmem(line, len, nd, n);
+    if (m->fold_utf8 || (m->fold_ks && has_high_byte(line, len)))
+        return utf8_find_fold(line, len, nd, n, mlen);
+    return ascii_find_fold(line, len, nd, n);
+}
+
+/* Every required run is in line[0..len) */
+static int contains(const IvMatcher *m, const char *line, size_t len)
+{
+    size_t mlen;
+    for (int i = 0; i < m->nneed; i++)
+        if (!find_need(m, i, line, len, &mlen))
+            return 0;
+    return 1;
+}
+
+/* needle with every code point folded, as a new string */
+static char *fold_string(const char *s)
+{
+    size_t len = strlen(s);
+    char *out = malloc(4 * len + 1), *o = out;
+    if (!out)
+        return NULL;
+    for (size_t i = 0; i < len;)
+    {
+        unsigned c;
+        i += utf8_decode(s + i, len - i, &c);
+        o += utf8_encode(fold_rune(c), o);
+    }
+    *o = '\0';
+    return out;
+}
+
+/* ── API ────────────────────────────────────────────────────────────────── */
+
+int matcher_compile(IvMatcher *m, const char *pattern, int flags)
+{
+    memset(m, 0, sizeof(*m));
+    m->icase = (flags & IV_MATCH_ICASE) != 0;
+    char *lit = malloc(strlen(pattern) + 1);
+    if (!lit)
+        return -1;
+    if (!(flags & IV_MATCH_REGEX))
+        strcpy(lit, pattern);
+    else if (!ere_is_literal(pattern, lit))
+    {
+        free(lit);
+        lit = NULL;
+        int cflags = REG_EXTENDED | REG_NOSUB | (m->icase ? REG_ICASE : 0);
+        if (regcomp(&m->re, pattern, cflags) != 0)
+            return -1;
+        m->regex = 1;
+        required_runs(m, pattern);
+    }
+    if (lit)
+    {
+        m->need[0] = lit;
+        m->nneed = 1;
+    }
+    for (int i = 0; i < m->nneed; i++)
+    {
+        if (m->icase)
+        {
+            char *folded = fold_string(m->need[i]);
+            if (!folded)
+            {
+                matcher_free(m);
+                return -1;
+            }
+            free(m->need[i]);
+            m->need[i] = folded;
+            m->fold_utf8 |= has_high_byte(folded, strlen(folded));
+            m->fold_ks |= strpbrk(folded, "ks") != NULL;
+        }
+        m->need_len[i] = strlen(m->need[i]);
+    }
+    return 0;
+}
+
+void matcher_free(IvMatcher *m)
+{
+    if (m->regex)
+        regfree(&m->re);
+    for (int i = 0; i < m->nneed; i++)
+        free(m->need[i]);
+    m->nneed = 0;
+    m->regex = 0;
+}
+
+const char *matcher_find(const IvMatcher *m, const char *line, size_t len,
+                         size_t *mlen)
+{
+    return find_need(m, 0, line, len, mlen);
+}
+
+int matcher_prefilter(const IvMatcher *m, const char *line, size_t len)
+{
+    return contains(m, line, len);
+}
+
+int matcher_match(const IvMatcher *m, const char *line, size_t len)
+{
+    if (!contains(m, line, len))
+        return 0;
+    if (!m->regex)
+        return 1;
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+#ifdef REG_STARTEND
+    regmatch_t span = {0, (regoff_t)len};
+    return regexec(&m->re, line, 1, &span, REG_STARTEND) == 0;
+#else
+    char *copy = strndup(line, len);
+    int r = copy && regexec(&m->re, copy, 0, NULL, 0) == 0;
+    free(copy);
+    return r;
+#endif
+}
@@ -0,0 +1,305 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Backup pack: every slot of one file in a single file.
+ *
+ *   content | content | ... | index | footer | content | index | footer
+ *
+ * A backup appends its content, then a whole new index (fixed-size
+ * entries, oldest slot first, 8-byte aligned) and a 32-byte footer that
+ * points at it; nothing written earlier is touched. The last footer is the
+ * one that counts, so the index is found with one read at the end of the
+ * file and mapped as it is. Superseded indexes and the contents of evicted
+ * slots are dead bytes; once they outweigh the live content (and 64 KiB)
+ * the pack is rewritten with only the live entries and renamed over.
+ *
+ * The layout is the host's: a pack is read where it was written, in the
+ * backup repo of the same machine. */
+
+#include "iv.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACK_MAGIC "IVPACK1\n"
+#define PACK_COMPACT_MIN 65536
+
+typedef struct
+{
+    uint64_t index_off;
+    uint64_t n;
+    uint64_t live;
+    char magic[8];
+} PackFooter;
+
+static uint64_t align8(uint64_t x)
+{
+    return (x + 7) & ~(uint64_t)7;
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+    while (len)
+    {
+        ssize_t w = pwrite(fd, p, len, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        IV_STAT(bytes_written, w);
+        p += w;
+        len -= (size_t)w;
+        off += w;
+    }
+    return 0;
+}
+
+static void unmap_index(IvPack *p)
+{
+    if (p->map)
+        munmap(p->map, p->map_len);
+    p->map = NULL;
+    p->map_len = 0;
+    p->e = NULL;
+    p->n = 0;
+    p->live = 0;
+}
+
+/* Map the index the footer at the end of the file points at. */
+static int map_index(IvPack *p)
+{
+    struct stat st;
+    PackFooter f;
+    unmap_index(p);
+    if (fstat(p->fd, &st) != 0)
+        return -1;
+    if (st.st_size == 0)
+    {
+        p->end = p->tail = 0;
+        return 0;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    if (size < sizeof(f) ||
+        pread(p->fd, &f, sizeof(f), (off_t)(size - sizeof(f))) != (ssize_t)sizeof(f) ||
+        memcmp(f.magic, PACK_MAGIC, 8) != 0 || f.index_off % 8 ||
+        f.n > (size - sizeof(f)) / sizeof(IvPackEntry) ||
+        f.index_off + f.n * sizeof(IvPackEntry) + sizeof(f) != size)
+        return -2;
+    p->end = p->tail = size;
+    if (f.n == 0)
+        return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t base = f.index_off - f.index_off % (uint64_t)(page > 0 ? page : 4096);
+    p->map_len = (size_t)(size - base);
+    p->map = mmap(NULL, p->map_len, PROT_READ, MAP_SHARED, p->fd, (off_t)base);
+    if (p->map == MAP_FAILED)
+    {
+        p->map = NULL;
+        return -1;
+    }
+    p->e = (const IvPackEntry *)((const char *)p->map + (f.index_off - base));
+    p->n = (size_t)f.n;
+    p->live = f.live;
+    for (size_t i = 0; i < p->n; i++)
+        if (p->e[i].off + p->e[i].len > f.index_off)
+        {
+            unmap_index(p);
+            return -2;
+        }
+    return 0;
+}
+
+/* A writer holds an exclusive flock() on the pack until pack_close(), so
+ * two runs never interleave their indexes and footers. compact() renames a
+ * new file over the path: a writer that waited on the old one opens the
+ * path again. */
+static int lock_pack(IvPack *p)
+{
+    for (;;)
+    {
+        struct stat a, b;
+        while (flock(p->fd, LOCK_EX) != 0)
+            if (errno != EINTR)
+                return -1;
+        if (fstat(p->fd, &a) != 0)
+            return -1;
+        if (stat(p->path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+            return 0;
+        close(p->fd);
+        if ((p->fd = open(p->path, O_RDWR | O_CREAT, 0644)) < 0)
+            return -1;
+    }
+}
+
+int pack_open(IvPack *p, const char *path, int write)
+{
+    memset(p, 0, sizeof(*p));
+    snprintf(p->path, sizeof(p->path), "%s", path);
+    p->writable = write;
+    p->fd = open(path, write ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (p->fd < 0)
+        return -1;
+    if (write && lock_pack(p) != 0)
+    {
+        if (p->fd >= 0)
+            close(p->fd);
+        p->fd = -1;
+        return -1;
+    }
+    int rc = map_index(p);
+    if (rc != 0)
+    {
+        close(p->fd);
+        p->fd = -1;
+    }
+    return rc;
+}
+
+void pack_close(IvPack *p)
+{
+    unmap_index(p);
+    if (p->fd >= 0)
+    {
+        if (p->writable && p->tail > p->end && ftruncate(p->fd, (off_t)p->end) != 0)
+            perror(p->path);
+        close(p->fd);
+    }
+    p->fd = -1;
+}
+
+const IvPackEntry *pack_slot(const IvPack *p, int n)
+{
+    return n >= 1 && (size_t)n <= p->n ? &p->e[p->n - (size_t)n] : NULL;
+}
+
+int pack_copy_in(IvPack *p, FILE *src, IvPackEntry *e)
+{
+    char buf[65536];
+    size_t n;
+    IvHash h;
+    uint64_t off = align8(p->end);
+    e->off = off;
+    e->len = 0;
+    hash_init(&h);
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+    {
+        if (write_all(p->fd, buf, n, (off_t)(off + e->len)) != 0)
+            break;
+        hash_update(&h, buf, n);
+        IV_STAT(bytes_read, n);
+        e->len += n;
+    }
+    if (n > 0 || ferror(src))
+    {
+        /* A partial tail would hide the footer */
+        if (ftruncate(p->fd, (off_t)p->end) != 0)
+            perror(p->path);
+        return -1;
+    }
+    p->tail = off + e->len;
+    e->hash = hash_digest(&h);
+    e->has_hash = 1;
+    return 0;
+}
+
+/* Rewrite the pack with the entries in e only, then map it. */
+static int compact(IvPack *p, IvPackEntry *e, size_t n)
+{
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", p->path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) /* taken over from p->fd */
+        goto fail;
+    char buf[65536];
+    uint64_t off = 0, live = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t from = e[i].off, left = e[i].len;
+        e[i].off = off;
+        while (left)
+        {
+            size_t chunk = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+            ssize_t r = pread(p->fd, buf, chunk, (off_t)from);
+            if (r <= 0 || write_all(fd, buf, (size_t)r, (off_t)off) != 0)
+                goto fail;
+            from += (uint64_t)r;
+            off += (uint64_t)r;
+            left -= (uint64_t)r;
+        }
+        live += e[i].len;
+        off = align8(off);
+    }
+    PackFooter f = {off, n, live, PACK_MAGIC};
+    if (write_all(fd, e, n * sizeof(*e), (off_t)off) != 0 ||
+        write_all(fd, &f, sizeof(f), (off_t)(off + n * sizeof(*e))) != 0 ||
+        rename(tmp, p->path) != 0)
+        goto fail;
+    struct stat st;
+    if (fstat(p->fd, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    unmap_index(p);
+    close(p->fd);
+    p->fd = fd;
+    return map_index(p);
+fail:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/* Append index e[0..n) and its footer after everything written so far. */
+static int write_index(IvPack *p, IvPackEntry *e, size_t n)
+{
+    uint64_t live = 0;
+    for (size_t i = 0; i < n; i++)
+        live += e[i].len;
+    uint64_t off = align8(p->tail);
+    uint64_t end = off + n * sizeof(*e) + sizeof(PackFooter);
+    if (end - live > PACK_COMPACT_MIN && end - live > live)
+        return compact(p, e, n);
+    PackFooter f = {off, n, live, PACK_MAGIC};
+    if (write_all(p->fd, e, n * sizeof(*e), (off_t)off) != 0 ||
+        write_all(p->fd, &f, sizeof(f), (off_t)(off + n * sizeof(*e))) != 0)
+    {
+        if (ftruncate(p->fd, (off_t)p->end) != 0)
+            perror(p->path);
+        return -1;
+    }
+    return map_index(p);
+}
+
+int pack_add(IvPack *p, const IvPackEntry *e)
+{
+    IvPackEntry *all = malloc((p->n + 1) * sizeof(*all));
+    IV_STAT(allocs, 1);
+    if (!all)
+        return -1;
+    if (p->n)
+        memcpy(all, p->e, p->n * sizeof(*all));
+    all[p->n] = *e;
+    int rc = write_index(p, all, p->n + 1);
+    free(all);
+    return rc;
+}
+
+int pack_keep(IvPack *p, size_t keep)
+{
+    if (keep >= p->n)
+        return 0;
+    size_t n = keep;
+    IvPackEntry *all = malloc((n ? n : 1) * sizeof(*all));
+    IV_STAT(allocs, 1);
+    if (!all)
+        return -1;
+    memcpy(all, p->e + (p->n - n), n * sizeof(*all));
+    p->tail = p->end; /* nothing pending survives */
+    int rc = write_index(p, all, n);
+    free(all);
+    return rc;
+}
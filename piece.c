@@ -0,0 +1,389 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Piece table for the edit paths that need the whole file (-d -m, -r -m).
+ *
+ * The file is read once into the original buffer; inserted text goes to an
+ * append-only add buffer. The document is the in-order sequence of pieces
+ * (buffer, offset, length), kept in a treap whose nodes also carry the
+ * bytes and newlines of their subtree, so splitting at a byte offset,
+ * inserting, deleting and finding where line N starts are O(log pieces).
+ * Each buffer keeps the offsets of its newlines, which gives the newline
+ * count of any piece with two binary searches instead of a scan. The
+ * offsets take 4 bytes each until a buffer grows past 4 GiB, when they
+ * are widened to 8.
+ *
+ * Nothing points into the file itself: it is read, not mapped, because the
+ * result is written back over it. */
+
+#include "iv.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct IvPiece
+{
+    struct IvPiece *left, *right;
+    unsigned prio;
+    int buf;          /* 0: original, 1: add */
+    size_t off, len;  /* bytes of the piece in its buffer */
+    size_t nl;        /* newlines in the piece */
+    size_t sum_len;   /* bytes in the subtree */
+    size_t sum_nl;    /* newlines in the subtree */
+};
+
+/* ── Buffers ────────────────────────────────────────────────────────────── */
+
+static size_t nl_at(const IvDocBuf *b, size_t i)
+{
+    return b->nl64 ? (size_t)b->nl64[i] : b->nl32[i];
+}
+
+static int widen_newlines(IvDocBuf *b)
+{
+    uint64_t *wide = malloc((b->nl_cap ? b->nl_cap : 1) * sizeof(*wide));
+    IV_STAT(allocs, 1);
+    if (!wide)
+        return -1;
+    for (size_t i = 0; i < b->nnl; i++)
+        wide[i] = b->nl32[i];
+    free(b->nl32);
+    b->nl32 = NULL;
+    b->nl64 = wide;
+    return 0;
+}
+
+static int index_newlines(IvDocBuf *b, size_t from)
+{
+    for (const char *p = b->text + from, *e = b->text + b->len;
+         (p = memchr(p, '\n', (size_t)(e - p))) != NULL; p++)
+    {
+        size_t off = (size_t)(p - b->text);
+        if (!b->nl64 && off > UINT32_MAX && widen_newlines(b) != 0)
+            return -1;
+        if (b->nnl == b->nl_cap)
+        {
+            size_t cap = b->nl_cap ? b->nl_cap * 2 : 1024;
+            void *tmp = b->nl64 ? realloc(b->nl64, cap * sizeof(uint64_t))
+                                : realloc(b->nl32, cap * sizeof(uint32_t));
+            IV_STAT(allocs, 1);
+            if (!tmp)
+                return -1;
+            if (b->nl64)
+                b->nl64 = tmp;
+            else
+                b->nl32 = tmp;
+            b->nl_cap = cap;
+        }
+        if (b->nl64)
+            b->nl64[b->nnl++] = off;
+        else
+            b->nl32[b->nnl++] = (uint32_t)off;
+    }
+    return 0;
+}
+
+/* First newline at or after off */
+static size_t nl_lower(const IvDocBuf *b, size_t off)
+{
+    size_t lo = 0, hi = b->nnl;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (nl_at(b, mid) < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static size_t count_nl(const IvDocBuf *b, size_t off, size_t len)
+{
+    return nl_lower(b, off + len) - nl_lower(b, off);
+}
+
+/* ── Treap ──────────────────────────────────────────────────────────────── */
+
+static size_t tlen(const IvPiece *t) { return t ? t->sum_len : 0; }
+static size_t tnl(const IvPiece *t) { return t ? t->sum_nl : 0; }
+
+static void update(IvPiece *t)
+{
+    t->sum_len = tlen(t->left) + t->len + tlen(t->right);
+    t->sum_nl = tnl(t->left) + t->nl + tnl(t->right);
+}
+
+static IvPiece *new_piece(IvDoc *d, int buf, size_t off, size_t len)
+{
+    IvPiece *t = malloc(sizeof(*t));
+    IV_STAT(allocs, 1);
+    if (!t)
+        return NULL;
+    /* xorshift32: priorities only need to look random */
+    d->seed ^= d->seed << 13;
+    d->seed ^= d->seed >> 17;
+    d->seed ^= d->seed << 5;
+    t->left = t->right = NULL;
+    t->prio = d->seed;
+    t->buf = buf;
+    t->off = off;
+    t->len = len;
+    t->nl = count_nl(&d->b[buf], off, len);
+    update(t);
+    d->npieces++;
+    return t;
+}
+
+static IvPiece *merge(IvPiece *a, IvPiece *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio)
+    {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+/* Bytes [0, pos) to *l, the rest to *r; a piece straddling pos is cut in
+ * two. Returns -1 (tree unchanged but split) if the cut cannot allocate. */
+static int split(IvDoc *d, IvPiece *t, size_t pos, IvPiece **l, IvPiece **r)
+{
+    if (!t)
+    {
+        *l = *r = NULL;
+        return 0;
+    }
+    size_t left = tlen(t->left);
+    int rc = 0;
+    if (pos <= left)
+    {
+        rc = split(d, t->left, pos, l, &t->left);
+        update(t);
+        *r = t;
+    }
+    else if (pos >= left + t->len)
+    {
+        rc = split(d, t->right, pos - left - t->len, &t->right, r);
+        update(t);
+        *l = t;
+    }
+    else
+    {
+        size_t k = pos - left;
+        IvPiece *tail = new_piece(d, t->buf, t->off + k, t->len - k);
+        if (!tail)
+        {
+            *l = t->left;
+            t->left = NULL;
+            update(t);
+            *r = t;
+            return -1;
+        }
+        t->len = k;
+        t->nl -= tail->nl;
+        *r = merge(tail, t->right);
+        t->right = NULL;
+        update(t);
+        *l = t;
+    }
+    return rc;
+}
+
+static void free_tree(IvDoc *d, IvPiece *t)
+{
+    while (t)
+    {
+        IvPiece *right = t->right;
+        free_tree(d, t->left);
+        free(t);
+        d->npieces--;
+        t = right;
+    }
+}
+
+/* ── Document ───────────────────────────────────────────────────────────── */
+
+int doc_load(IvDoc *d, int fd)
+{
+    memset(d, 0, sizeof(*d));
+    d->seed = 2463534242u;
+    stats_phase_begin(IV_PHASE_LOAD);
+    IvDocBuf *b = &d->b[0];
+    struct stat st;
+    size_t cap = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (size_t)st.st_size + 1 : 65536;
+    b->text = malloc(cap);
+    IV_STAT(allocs, 1);
+    for (;;)
+    {
+        if (!b->text)
+            goto fail;
+        if (b->len == cap)
+        {
+            char *tmp = realloc(b->text, cap * 2);
+            IV_STAT(allocs, 1);
+            if (!tmp)
+                goto fail;
+            b->text = tmp;
+            cap *= 2;
+        }
+        ssize_t r = read(fd, b->text + b->len, cap - b->len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            goto fail;
+        if (r == 0)
+            break;
+        b->len += (size_t)r;
+        IV_STAT(bytes_read, r);
+    }
+    if (index_newlines(b, 0) != 0)
+        goto fail;
+    if (b->len && !(d->root = new_piece(d, 0, 0, b->len)))
+        goto fail;
+    IV_STAT(lines, doc_lines(d));
+    stats_phase_end(IV_PHASE_LOAD);
+    return 0;
+fail:
+    stats_phase_end(IV_PHASE_LOAD);
+    doc_free(d);
+    return -1;
+}
+
+void doc_free(IvDoc *d)
+{
+    free_tree(d, d->root);
+    for (int i = 0; i < 2; i++)
+    {
+        free(d->b[i].text);
+        free(d->b[i].nl32);
+        free(d->b[i].nl64);
+    }
+    memset(d, 0, sizeof(*d));
+}
+
+size_t doc_length(const IvDoc *d)
+{
+    return tlen(d->root);
+}
+
+/* As load_lines() counts them: a last line without '\n' counts too */
+long long doc_lines(const IvDoc *d)
+{
+    size_t len = tlen(d->root);
+    if (!len)
+        return 0;
+    const IvPiece *t = d->root;
+    while (t->right)
+        t = t->right; /* pieces are never empty */
+    int last_nl = d->b[t->buf].text[t->off + t->len - 1] == '\n';
+    return (long long)tnl(d->root) + !last_nl;
+}
+
+size_t doc_line_offset(const IvDoc *d, long long line)
+{
+    if (line <= 1)
+        return 0;
+    size_t k = (size_t)(line - 1); /* newlines before the line */
+    if (k > tnl(d->root))
+        return tlen(d->root);
+    const IvPiece *t = d->root;
+    size_t base = 0;
+    while (t)
+    {
+        if (k <= tnl(t->left))
+        {
+            t = t->left;
+            continue;
+        }
+        k -= tnl(t->left);
+        base += tlen(t->left);
+        if (k <= t->nl)
+        {
+            const IvDocBuf *b = &d->b[t->buf];
+            size_t nl = nl_at(b, nl_lower(b, t->off) + k - 1);
+            return base + (nl - t->off) + 1;
+        }
+        k -= t->nl;
+        base += t->len;
+        t = t->right;
+    }
+    return base;
+}
+
+int doc_insert(IvDoc *d, size_t pos, const char *text, size_t len)
+{
+    if (!len)
+        return 0;
+    IvDocBuf *b = &d->b[1];
+    if (b->len + len > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *tmp = realloc(b->text, cap);
+        IV_STAT(allocs, 1);
+        if (!tmp)
+            return -1;
+        b->text = tmp;
+        b->cap = cap;
+    }
+    size_t off = b->len;
+    memcpy(b->text + off, text, len);
+    b->len += len;
+    if (index_newlines(b, off) != 0)
+        return -1;
+    IvPiece *l, *r, *t = new_piece(d, 1, off, len);
+    if (!t)
+        return -1;
+    if (split(d, d->root, pos, &l, &r) != 0)
+    {
+        d->root = merge(l, r);
+        free_tree(d, t);
+        return -1;
+    }
+    d->root = merge(merge(l, t), r);
+    return 0;
+}
+
+int doc_delete(IvDoc *d, size_t pos, size_t len)
+{
+    if (!len)
+        return 0;
+    IvPiece *l, *m, *r;
+    int rc = split(d, d->root, pos, &l, &r);
+    rc |= split(d, r, len, &m, &r);
+    if (rc != 0)
+    {
+        d->root = merge(merge(l, m), r);
+        return -1;
+    }
+    free_tree(d, m);
+    d->root = merge(l, r);
+    return 0;
+}
+
+static void write_tree(const IvDoc *d, const IvPiece *t, FILE *f)
+{
+    while (t)
+    {
+        write_tree(d, t->left, f);
+        fwrite(d->b[t->buf].text + t->off, 1, t->len, f);
+        t = t->right;
+    }
+}
+
+int doc_write(const IvDoc *d, FILE *f)
+{
+    stats_phase_begin(IV_PHASE_WRITE);
+    write_tree(d, d->root, f);
+    stats_phase_end(IV_PHASE_WRITE);
+    return ferror(f) ? -1 : 0;
+}
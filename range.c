@@ -3,19 +3,28 @@
 
 #include "iv.h"
 #include <ctype.h>
+#include <limits.h>
+
+static const char *parse_number(const char *p, long long *n)
+{
+    for (; isdigit((unsigned char)*p); p++)
+        *n = *n > (LLONG_MAX - 9) / 10 ? LLONG_MAX / 2 : *n * 10 + (*p - '0');
+    return p;
+}
 
 /* Parse range: "1-5", "-3--1", "-5-", "5", "-2"
  * count = total lines. start,end are 1-based.
  * -1 means "from start", -2 means "2nd from end", etc.
- * Returns 0 on success, -1 on error.
+ * Returns 0 on success, -1 on error. Numbers too large for a line number
+ * saturate, so they land past the last line.
  */
-int parse_range(const char *spec, int count, int *start, int *end)
+int parse_range(const char *spec, long long count, long long *start, long long *end)
 {
     if (!spec || !*spec)
         return -1;
 
     const char *p = spec;
-    int s = 0, e = 0;
+    long long s = 0, e = 0;
     int s_neg = 0, e_neg = 0;
 
     /* Parse start */
@@ -26,11 +35,7 @@ int parse_range(const char *spec, int count, int *start, int *end)
         if (!*p)
             return -1;
     }
-    while (*p && isdigit(*p))
-    {
-        s = s * 10 + (*p - '0');
-        p++;
-    }
+    p = parse_number(p, &s);
 
     if (!*p)
     {
@@ -57,17 +62,17 @@ int parse_range(const char *spec, int count, int *start, int *end)
         return -1;
     p++;
 
+    /* Open end: "2-", "-5-" run to the last line */
+    if (!*p)
+        e_neg = 1;
+
     /* Parse end */
     if (*p == '-')
     {
         p++;
         e_neg = 1;
     }
-    while (*p && isdigit(*p))
-    {
-        e = e * 10 + (*p - '0');
-        p++;
-    }
+    p = parse_number(p, &e);
     if (*p)
         return -1;
 
@@ -87,9 +92,234 @@ int parse_range(const char *spec, int count, int *start, int *end)
         *end = count;
     if (*start > *end)
     {
-        int t = *start;
+        long long t = *start;
         *start = *end;
         *end = t;
     }
     return 0;
 }
+
+/* ── Selections ─────────────────────────────────────────────────────────── */
+
+/* One comma-separated item of a selection */
+struct IvRangeItem
+{
+    char *spec;          /* numeric range for parse_range(), or NULL */
+    IvMatcher from, to;  /* /from/ or /from/,/to/ */
+    int has_to;
+    int open;            /* /from/,/to/ block in progress */
+    long long open_at;   /* its first line */
+};
+
+static int add_interval(IvRangeSet *rs, long long start, long long end)
+{
+    if (rs->n == rs->cap)
+    {
+        size_t cap = rs->cap ? rs->cap * 2 : 8;
+        IvInterval *tmp = realloc(rs->iv, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        rs->iv = tmp;
+        rs->cap = cap;
+    }
+    rs->iv[rs->n++] = (IvInterval){start, end};
+    return 0;
+}
+
+/* "/re/" at *p: compile it and move *p past the closing slash. \/ is a
+ * slash; other escapes are left to the regex. */
+static int parse_address(const char **p, IvMatcher *m, int flags)
+{
+    const char *s = *p + 1;
+    char *re = malloc(strlen(s) + 1);
+    size_t n = 0;
+    if (!re)
+        return -1;
+    for (; *s && *s != '/'; s++)
+    {
+        if (*s == '\\' && s[1] == '/')
+            s++;
+        else if (*s == '\\' && s[1])
+            re[n++] = *s++;
+        re[n++] = *s;
+    }
+    re[n] = '\0';
+    int r = *s == '/' && n > 0 ? matcher_compile(m, re, flags | IV_MATCH_REGEX) : -1;
+    free(re);
+    *p = s + 1;
+    return r;
+}
+
+int range_set_parse(IvRangeSet *rs, const char *spec, int match_flags)
+{
+    memset(rs, 0, sizeof(*rs));
+    if (!spec || !*spec)
+        return -1;
+    for (const char *p = spec;;)
+    {
+        IvRangeItem *tmp = realloc(rs->items, (rs->nitems + 1) * sizeof(*tmp));
+        if (!tmp)
+            goto bad;
+        rs->items = tmp;
+        IvRangeItem *it = &rs->items[rs->nitems];
+        memset(it, 0, sizeof(*it));
+        if (*p == '/')
+        {
+            if (parse_address(&p, &it->from, match_flags) != 0)
+                goto bad;
+            rs->nitems++;
+            if (p[0] == ',' && p[1] == '/')
+            {
+                p++;
+                if (parse_address(&p, &it->to, match_flags) != 0)
+                    goto bad;
+                it->has_to = 1;
+            }
+            rs->has_regex = 1;
+        }
+        else
+        {
+            size_t len = strcspn(p, ",");
+            long long s, e;
+            it->spec = strndup(p, len);
+            rs->nitems++;
+            if (!it->spec || parse_range(it->spec, IV_LINES_MAX, &s, &e) != 0)
+                goto bad;
+            p += len;
+        }
+        if (!*p)
+            return 0;
+        if (*p++ != ',' || !*p)
+            goto bad;
+    }
+bad:
+    range_set_free(rs);
+    return -1;
+}
+
+void range_set_free(IvRangeSet *rs)
+{
+    for (size_t i = 0; i < rs->nitems; i++)
+    {
+        IvRangeItem *it = &rs->items[i];
+        free(it->spec);
+        if (!it->spec)
+        {
+            matcher_free(&it->from);
+            if (it->has_to)
+                matcher_free(&it->to);
+        }
+    }
+    free(rs->items);
+    free(rs->iv);
+    memset(rs, 0, sizeof(*rs));
+}
+
+int range_set_simple(const IvRangeSet *rs)
+{
+    return rs->nitems == 1 && rs->items[0].spec;
+}
+
+int range_set_needs_count(const IvRangeSet *rs)
+{
+    for (size_t i = 0; i < rs->nitems; i++)
+    {
+        const char *spec = rs->items[i].spec;
+        if (!spec || spec[0] == '-' || strstr(spec, "--"))
+            return 1;
+    }
+    return 0;
+}
+
+int range_set_line(IvRangeSet *rs, long long lineno, const char *line, size_t len)
+{
+    for (size_t i = 0; i < rs->nitems; i++)
+    {
+        IvRangeItem *it = &rs->items[i];
+        if (it->spec)
+            continue;
+        if (it->open)
+        {
+            /* sed: the end address is first tried on the line after the start */
+            if (matcher_match(&it->to, line, len))
+            {
+                it->open = 0;
+                if (add_interval(rs, it->open_at, lineno) != 0)
+                    return -1;
+            }
+        }
+        else if (matcher_match(&it->from, line, len))
+        {
+            if (!it->has_to)
+            {
+                if (add_interval(rs, lineno, lineno) != 0)
+                    return -1;
+            }
+            else
+            {
+                it->open = 1;
+                it->open_at = lineno;
+            }
+        }
+    }
+    return 0;
+}
+
+static int by_start(const void *a, const void *b)
+{
+    const IvInterval *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+int range_set_finish(IvRangeSet *rs, long long count)
+{
+    for (size_t i = 0; i < rs->nitems; i++)
+    {
+        IvRangeItem *it = &rs->items[i];
+        long long s, e;
+        if (it->spec)
+        {
+            parse_range(it->spec, count, &s, &e);
+            if (add_interval(rs, s, e) != 0)
+                return -1;
+        }
+        else if (it->open)
+        {
+            /* an unterminated block runs to the end of the file */
+            it->open = 0;
+            if (add_interval(rs, it->open_at, count) != 0)
+                return -1;
+        }
+    }
+
+    /* Sorted, clamped to the file and merged when overlapping or adjacent */
+    qsort(rs->iv, rs->n, sizeof(*rs->iv), by_start);
+    size_t out = 0;
+    for (size_t i = 0; i < rs->n; i++)
+    {
+        IvInterval v = rs->iv[i];
+        if (v.start < 1)
+            v.start = 1;
+        if (v.end > count)
+            v.end = count;
+        if (v.start > v.end)
+            continue;
+        if (out && v.start <= rs->iv[out - 1].end + 1)
+        {
+            if (v.end > rs->iv[out - 1].end)
+                rs->iv[out - 1].end = v.end;
+        }
+        else
+            rs->iv[out++] = v;
+    }
+    rs->n = out;
+    return 0;
+}
+
+int range_set_lines(IvRangeSet *rs, char *lines[], long long count)
+{
+    for (long long i = 0; rs->has_regex && i < count; i++)
+        if (range_set_line(rs, i + 1, lines[i], strlen(lines[i])) != 0)
+            return -1;
+    return range_set_finish(rs, count);
+}
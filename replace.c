@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Per-line replace kernels used by -s. They only depend on libc, match.c
+ * and stats.c, so bench/ links them on their own (libivkernels.a) for the
+ * microbenchmarks and the differential fuzzer against bench/replace_ref.c. */
+
+#define _GNU_SOURCE /* REG_STARTEND */
+#include "iv.h"
+
+/* ── Literal ────────────────────────────────────────────────────────────── */
+
+char *replace_in_string(const char *line, const char *pat,
+                        const char *repl, int global, int *n)
+{
+    size_t plen = strlen(pat);
+    size_t rlen = strlen(repl);
+    size_t cap = strlen(line) + 256;
+    char *out = malloc(cap);
+    IV_STAT(allocs, 1);
+    if (!out)
+        return NULL;
+    size_t len = 0;
+    const char *cur = line;
+    *n = 0;
+    while (*cur)
+    {
+        const char *p = strstr(cur, pat);
+        if (!p)
+        {
+            size_t rest = strlen(cur);
+            if (len + rest + 1 >= cap)
+            {
+                cap = len + rest + 1;
+                char *tmp = realloc(out, cap);
+                IV_STAT(allocs, 1);
+                if (!tmp)
+                {
+                    free(out);
+                    return NULL;
+                }
+                out = tmp;
+            }
+            memcpy(out + len, cur, rest);
+            len += rest;
+            break;
+        }
+        size_t before = (size_t)(p - cur);
+        if (len + before + rlen + 1 >= cap)
+        {
+            cap = len + before + rlen + 256;
+            char *tmp = realloc(out, cap);
+            IV_STAT(allocs, 1);
+            if (!tmp)
+            {
+                free(out);
+                return NULL;
+            }
+            out = tmp;
+        }
+        memcpy(out + len, cur, before);
+        len += before;
+        memcpy(out + len, repl, rlen);
+        len += rlen;
+        cur = p + plen;
+        (*n)++;
+        if (!global)
+        {
+            size_t rest = strlen(cur);
+            if (len + rest + 1 >= cap)
+            {
+                cap = len + rest + 256;
+                char *tmp = realloc(out, cap);
+                IV_STAT(allocs, 1);
+                if (!tmp)
+                {
+                    free(out);
+                    return NULL;
+                }
+                out = tmp;
+            }
+            memcpy(out + len, cur, rest);
+            len += rest;
+            break;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/* ── Regex ──────────────────────────────────────────────────────────────── */
+
+int subst_compile(IvSubst *prog, const char *repl)
+{
+    memset(prog, 0, sizeof(*prog));
+    prog->max_group = 0;
+    size_t rlen = strlen(repl);
+    /* At most one op per input byte, literal bytes never grow */
+    prog->ops = malloc((rlen + 1) * sizeof(*prog->ops));
+    prog->lit = malloc(rlen + 1);
+    IV_STAT(allocs, 2);
+    if (!prog->ops || !prog->lit)
+    {
+        subst_free(prog);
+        return -1;
+    }
+    for (const char *p = repl; *p; p++)
+    {
+        int group = -1;
+        char c = *p;
+        if (*p == '&')
+            group = 0;
+        else if (*p == '\\' && p[1] >= '0' && p[1] <= '9')
+            group = *++p - '0';
+        else if (*p == '\\' && (p[1] == '&' || p[1] == '\\'))
+            c = *++p;
+        if (group >= 0)
+        {
+            prog->ops[prog->nops].group = group;
+            prog->ops[prog->nops].len = 0;
+            prog->nops++;
+            if (group > prog->max_group)
+                prog->max_group = group;
+            continue;
+        }
+        /* Extend the previous literal span or start a new one */
+        if (prog->nops == 0 || prog->ops[prog->nops - 1].group >= 0)
+        {
+            prog->ops[prog->nops].group = -1;
+            prog->ops[prog->nops].off = prog->lit_len;
+            prog->ops[prog->nops].len = 0;
+            prog->nops++;
+        }
+        prog->lit[prog->lit_len++] = c;
+        prog->ops[prog->nops - 1].len++;
+    }
+    return 0;
+}
+
+void subst_free(IvSubst *prog)
+{
+    free(prog->ops);
+    free(prog->lit);
+    prog->ops = NULL;
+    prog->lit = NULL;
+}
+
+/* Grow out so that need more bytes (plus the terminator) fit. */
+static int reserve(char **out, size_t *cap, size_t len, size_t need)
+{
+    if (len + need < *cap)
+        return 0;
+    size_t ncap = *cap * 2;
+    while (len + need >= ncap)
+        ncap *= 2;
+    char *tmp = realloc(*out, ncap);
+    IV_STAT(allocs, 1);
+    if (!tmp)
+        return -1;
+    *out = tmp;
+    *cap = ncap;
+    return 0;
+}
+
+/* regexec() on cur[0..left), the rest of the line up to its '\n'. */
+static int subst_exec(const regex_t *re, const char *cur, size_t left, size_t nm,
+                      regmatch_t *m, int flags)
+{
+#ifdef REG_STARTEND
+    m[0].rm_so = 0;
+    m[0].rm_eo = (regoff_t)left;
+    return regexec(re, cur, nm, m, flags | REG_STARTEND);
+#else
+    char *copy = strndup(cur, left);
+    int r = copy ? regexec(re, copy, nm, m, flags) : REG_ESPACE;
+    free(copy);
+    return r;
+#endif
+}
+
+char *replace_subst_in_string(const char *line, const regex_t *re,
+                              const IvSubst *prog, int global, int *n)
+{
+    size_t total = strlen(line);
+    /* The pattern sees the line without its '\n', as the matcher does */
+    const char *end = line + total - (total && line[total - 1] == '\n');
+    size_t cap = total + 256;
+    char *out = malloc(cap);
+    IV_STAT(allocs, 1);
+    if (!out)
+        return NULL;
+    /* Submatches beyond the ones the program uses are not requested */
+    regmatch_t m[10];
+    size_t nm = (size_t)prog->max_group + 1;
+    size_t len = 0;
+    const char *cur = line;
+    int after_match = 0;
+    *n = 0;
+    while (subst_exec(re, cur, (size_t)(end - cur), nm, m, cur == line ? 0 : REG_NOTBOL) == 0)
+    {
+        size_t so = (size_t)m[0].rm_so, eo = (size_t)m[0].rm_eo;
+        /* No empty match right where the previous match ended (as sed) */
+        if (!(so == eo && so == 0 && after_match))
+        {
+            size_t need = so;
+            for (int i = 0; i < prog->nops; i++)
+            {
+                int g = prog->ops[i].group;
+                need += g < 0 ? prog->ops[i].len
+                              : (m[g].rm_so < 0 ? 0 : (size_t)(m[g].rm_eo - m[g].rm_so));
+            }
+            if (reserve(&out, &cap, len, need) != 0)
+            {
+                free(out);
+                return NULL;
+            }
+            memcpy(out + len, cur, so);
+            len += so;
+            for (int i = 0; i < prog->nops; i++)
+            {
+                int g = prog->ops[i].group;
+                if (g < 0)
+                {
+                    memcpy(out + len, prog->lit + prog->ops[i].off, prog->ops[i].len);
+                    len += prog->ops[i].len;
+                }
+                else if (m[g].rm_so >= 0)
+                {
+                    size_t gl = (size_t)(m[g].rm_eo - m[g].rm_so);
+                    memcpy(out + len, cur + m[g].rm_so, gl);
+                    len += gl;
+                }
+            }
+            (*n)++;
+            cur += eo;
+            after_match = so != eo;
+            if (!global)
+                break;
+            if (after_match)
+                continue;
+        }
+        /* Empty match: step over one character so the scan advances (not
+         * past the line's own newline) */
+        if (cur >= end)
+            break;
+        if (reserve(&out, &cap, len, 1) != 0)
+        {
+            free(out);
+            return NULL;
+        }
+        out[len++] = *cur++;
+        after_match = 0;
+    }
+    size_t rest = strlen(cur);
+    if (reserve(&out, &cap, len, rest) != 0)
+    {
+        free(out);
+        return NULL;
+    }
+    memcpy(out + len, cur, rest + 1);
+    return out;
+}
+
+/* ── Ignore case ────────────────────────────────────────────────────────── */
+
+char *replace_matcher_in_string(const char *line, const IvMatcher *m,
+                                const char *repl, int global, int *n)
+{
+    size_t rlen = strlen(repl), left = strlen(line);
+    size_t cap = left + 256, len = 0, mlen;
+    char *out = malloc(cap);
+    IV_STAT(allocs, 1);
+    if (!out)
+        return NULL;
+    const char *cur = line, *p;
+    *n = 0;
+    while ((p = matcher_find(m, cur, left, &mlen)) != NULL && mlen > 0)
+    {
+        size_t before = (size_t)(p - cur);
+        if (reserve(&out, &cap, len, before + rlen) != 0)
+        {
+            free(out);
+            return NULL;
+        }
+        memcpy(out + len, cur, before);
+        len += before;
+        memcpy(out + len, repl, rlen);
+        len += rlen;
+        cur = p + mlen;
+        left -= before + mlen;
+        (*n)++;
+        if (!global)
+            break;
+    }
+    if (reserve(&out, &cap, len, left) != 0)
+    {
+        free(out);
+        return NULL;
+    }
+    memcpy(out + len, cur, left);
+    out[len + left] = '\0';
+    return out;
+}
+
+/* ── Field ──────────────────────────────────────────────────────────────── */
+
+char *replace_field_in_line(const char *line, char delim,
+                            int field_num, const char *value)
+{
+    size_t vlen = strlen(value);
+    size_t linelen = strlen(line);
+    char *out = malloc(linelen + vlen + 64);
+    IV_STAT(allocs, 1);
+    if (!out)
+        return NULL;
+    const char *p = line, *field_start = line;
+    int f = 1;
+    while (f < field_num && *p)
+    {
+        if (*p == delim)
+        {
+            f++;
+            p++;
+            field_start = p;
+        }
+        else
+            p++;
+    }
+    if (f != field_num)
+    {
+        strcpy(out, line);
+        return out;
+    }
+    size_t len = (size_t)(field_start - line);
+    memcpy(out, line, len);
+    memcpy(out + len, value, vlen + 1);
+    len += vlen;
+    while (*p && *p != delim && *p != '\n')
+        p++;
+    strcpy(out + len, p);
+    return out;
+}
@@ -0,0 +1,484 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* Resident mode: `iv --serve [socket]` runs commands sent over a Unix
+ * socket in-process, keeping the line arrays of recently viewed files.
+ *
+ * Protocol (one request per connection):
+ *   client → server  u32 length (host order), then `length` bytes:
+ *                    "IV2\0" cwd "\0" env[0] "\0" ... env[N-1] "\0"
+ *                    argv[0] "\0" ... argv[argc-1] "\0"
+ *                    env[i] is "=" value for the i-th name of serve_env[],
+ *                    or empty if the client does not set it; the command
+ *                    runs with those. The first sendmsg() carries the
+ *                    client's stdin, stdout and stderr as SCM_RIGHTS, so
+ *                    output goes straight to the caller's terminal or pipes.
+ *   server → client  i32 exit status once the command has finished.
+ * Tools that keep a connection-per-call client of their own skip process
+ * startup entirely; `IV_SOCKET=path iv ...` is the thin client built in.
+ * --follow runs until it is interrupted, so it never runs in the server:
+ * the built-in client runs it itself. */
+
+#include "iv.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+
+#define CACHE_ENTRIES 64
+#define REQUEST_MAX (1 << 24)
+
+/* Client environment a command depends on: backup roots and limits,
+ * stats, the user name and the temporary directory. */
+static const char *const serve_env[] = {
+    "IV_BACKUP_DIR", "IV_BACKUP_PACK", "IV_BACKUP_MAX_SLOTS", "IV_BACKUP_MAX_BYTES",
+    "IV_BACKUP_MAX_AGE", "IV_STATS", "USER", "HOME", "XDG_DATA_HOME", "TMPDIR"};
+#define SERVE_ENV_COUNT (sizeof(serve_env) / sizeof(serve_env[0]))
+
+/* ── Line cache ─────────────────────────────────────────────────────────── */
+
+typedef struct
+{
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char **lines;
+    long long count;
+    unsigned long used; /* LRU stamp */
+} CacheEntry;
+
+static CacheEntry cache[CACHE_ENTRIES];
+static unsigned long cache_clock;
+static int serving;
+static char serve_cwd[PATH_MAX];
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+char **serve_cached_lines(const char *filename, long long *count)
+{
+    if (!serving || strcmp(filename, "-") == 0)
+        return NULL;
+
+    char path[PATH_MAX];
+    int w = filename[0] == '/'
+                ? snprintf(path, sizeof(path), "%s", filename)
+                : snprintf(path, sizeof(path), "%s/%s", serve_cwd, filename);
+    if (w < 0 || (size_t)w >= sizeof(path))
+        return NULL;
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    CacheEntry *slot = &cache[0];
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+    {
+        CacheEntry *e = &cache[i];
+        if (e->lines && strcmp(e->path, path) == 0)
+        {
+            if (e->dev == st.st_dev && e->ino == st.st_ino &&
+                e->size == st.st_size && same_time(&e->mtime, &st.st_mtim) &&
+                same_time(&e->ctime, &st.st_ctim))
+            {
+                e->used = ++cache_clock;
+                *count = e->count;
+                return e->lines;
+            }
+            slot = e;
+            break;
+        }
+        if (!e->lines)
+        {
+            if (slot->lines)
+                slot = e;
+        }
+        else if (slot->lines && e->used < slot->used)
+            slot = e;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    long long n = 0;
+    char **lines = load_lines(f, &n);
+    fclose(f);
+    if (!lines)
+        return NULL;
+
+    free_lines(slot->lines, slot->count);
+    slot->lines = NULL;
+
+    /* A file written within the timestamp granularity of this read may
+     * change again without a visible mtime change: serve it, don't keep it. */
+    if (time(NULL) - st.st_mtim.tv_sec < 2)
+    {
+        *count = n;
+        return lines;
+    }
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->size = st.st_size;
+    slot->mtime = st.st_mtim;
+    slot->ctime = st.st_ctim;
+    slot->lines = lines;
+    slot->count = n;
+    slot->used = ++cache_clock;
+    *count = n;
+    return lines;
+}
+
+int serve_owns_lines(char **lines)
+{
+    for (int i = 0; lines && i < CACHE_ENTRIES; i++)
+        if (cache[i].lines == lines)
+            return 1;
+    return 0;
+}
+
+/* ── Socket helpers ─────────────────────────────────────────────────────── */
+
+const char *serve_default_socket(void)
+{
+    static char buf[PATH_MAX];
+    const char *rt = getenv("XDG_RUNTIME_DIR");
+    if (rt && *rt)
+        snprintf(buf, sizeof(buf), "%s/iv.sock", rt);
+    else
+        snprintf(buf, sizeof(buf), "%s.sock", get_backup_root(0));
+    return buf;
+}
+
+static int make_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Commands that would hold the server until the client goes away. */
+static int runs_forever(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--follow") == 0)
+            return 1;
+    return 0;
+}
+
+/* ── Client ─────────────────────────────────────────────────────────────── */
+
+int serve_forward(const char *sock_path, int argc, char *argv[], int *status)
+{
+    if (runs_forever(argc, argv))
+        return -1;
+    struct sockaddr_un addr;
+    if (make_addr(sock_path, &addr) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t len = 4 + strlen(cwd) + 1;
+    for (size_t i = 0; i < SERVE_ENV_COUNT; i++)
+    {
+        const char *v = getenv(serve_env[i]);
+        len += (v ? 1 + strlen(v) : 0) + 1;
+    }
+    for (int i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (len > REQUEST_MAX)
+    {
+        close(fd);
+        return -1;
+    }
+    char *req = malloc(sizeof(uint32_t) + len);
+    if (!req)
+    {
+        close(fd);
+        return -1;
+    }
+    uint32_t hdr = (uint32_t)len;
+    memcpy(req, &hdr, sizeof(hdr));
+    char *p = req + sizeof(hdr);
+    memcpy(p, "IV2", 4);
+    p += 4;
+    p = stpcpy(p, cwd) + 1;
+    for (size_t i = 0; i < SERVE_ENV_COUNT; i++)
+    {
+        const char *v = getenv(serve_env[i]);
+        if (v)
+            *p++ = '=';
+        p = stpcpy(p, v ? v : "") + 1;
+    }
+    for (int i = 0; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+
+    /* Header and the three standard fds in one message, body after */
+    int fds[3] = {0, 1, 2};
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    memset(ctl, 0, sizeof(ctl));
+    struct iovec iov = {req, sizeof(hdr)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int32_t ret;
+    int ok = sendmsg(fd, &msg, 0) == (ssize_t)sizeof(hdr) &&
+             write_full(fd, req + sizeof(hdr), len) == 0 &&
+             read_full(fd, &ret, sizeof(ret)) == 0;
+    free(req);
+    close(fd);
+    if (!ok)
+    {
+        fprintf(stderr, "iv: lost connection to %s\n", sock_path);
+        *status = 1;
+        return 0;
+    }
+    *status = ret;
+    return 0;
+}
+
+/* ── Server ─────────────────────────────────────────────────────────────── */
+
+static volatile sig_atomic_t stop_serving;
+
+static void on_stop(int sig)
+{
+    (void)sig;
+    stop_serving = 1;
+}
+
+int serve_stopping(void)
+{
+    return stop_serving;
+}
+
+/* Set the client's values of serve_env[] from env, keeping the server's
+ * in old; with env NULL, put old back and free it. */
+static void swap_env(const char *env[], char *old[])
+{
+    for (size_t i = 0; i < SERVE_ENV_COUNT; i++)
+    {
+        if (env)
+        {
+            const char *v = getenv(serve_env[i]);
+            old[i] = v ? strdup(v) : NULL;
+        }
+        const char *v = env ? (env[i][0] ? env[i] + 1 : NULL) : old[i];
+        if (v)
+            setenv(serve_env[i], v, 1);
+        else
+            unsetenv(serve_env[i]);
+        if (!env)
+            free(old[i]);
+    }
+}
+
+/* Run one request on connection c. Returns 0 when served. */
+static int serve_request(int c, const int saved[3])
+{
+    uint32_t len;
+    int fds[3] = {-1, -1, -1};
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    if (recvmsg(c, &msg, MSG_WAITALL) != (ssize_t)sizeof(len))
+        return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    int ret = -1;
+    char *body = NULL;
+    char **argv = NULL;
+    if (len < 6 || len > REQUEST_MAX || !(body = malloc(len)) ||
+        read_full(c, body, len) != 0 || memcmp(body, "IV2", 4) != 0 ||
+        body[len - 1] != '\0')
+        goto out;
+
+    const char *cwd = body + 4;
+    const char *env[SERVE_ENV_COUNT];
+    char *p = body + 4 + strlen(cwd) + 1;
+    for (size_t k = 0; k < SERVE_ENV_COUNT; k++)
+    {
+        if (p >= body + len)
+            goto out;
+        env[k] = p;
+        p += strlen(p) + 1;
+    }
+    char *args = p;
+    int argc = 0;
+    for (; p < body + len; p += strlen(p) + 1)
+        argc++;
+    argv = malloc((argc + 1) * sizeof(char *));
+    if (!argv || chdir(cwd) != 0)
+        goto out;
+    snprintf(serve_cwd, sizeof(serve_cwd), "%s", cwd);
+    char *old_env[SERVE_ENV_COUNT];
+    swap_env(env, old_env);
+    backup_cache_reset(); /* keyed by relative names and the backup root */
+    int i = 0;
+    for (p = args; p < body + len; p += strlen(p) + 1)
+        argv[i++] = p;
+    argv[argc] = NULL;
+
+    for (int k = 0; k < 3; k++)
+        dup2(fds[k], k);
+    clearerr(stdin);
+    int32_t status = 1;
+    if (runs_forever(argc, argv))
+        fprintf(stderr, "iv: --follow does not run in the server\n");
+    else if (argc > 0)
+        status = iv_run(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    for (int k = 0; k < 3; k++)
+        dup2(saved[k], k);
+    swap_env(NULL, old_env);
+    ret = write_full(c, &status, sizeof(status));
+
+out:
+    free(argv);
+    free(body);
+    for (int k = 0; k < 3; k++)
+        if (fds[k] >= 0)
+            close(fds[k]);
+    return ret;
+}
+
+int serve_main(const char *sock_path)
+{
+    if (!sock_path)
+        sock_path = serve_default_socket();
+    struct sockaddr_un addr;
+    if (make_addr(sock_path, &addr) != 0)
+    {
+        fprintf(stderr, "iv: socket path too long: %s\n", sock_path);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "iv: already serving on %s\n", sock_path);
+        close(fd);
+        return 1;
+    }
+    unlink(sock_path); /* stale socket from a previous run */
+    mode_t old = umask(077);
+    int b = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (b != 0 || listen(fd, 64) != 0)
+    {
+        perror(sock_path);
+        close(fd);
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Client stdin arrives as a different fd per request: no read-ahead */
+    setvbuf(stdin, NULL, _IONBF, 0);
+    int saved[3] = {dup(0), dup(1), dup(2)};
+    serving = 1;
+    fprintf(stderr, "iv: serving on %s\n", sock_path);
+
+    while (!stop_serving)
+    {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+        serve_request(c, saved);
+        close(c);
+    }
+
+    close(fd);
+    unlink(sock_path);
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+        free_lines(cache[i].lines, cache[i].count);
+    return 0;
+}
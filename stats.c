@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+/* --stats / IV_STATS: per-phase wall and CPU time plus I/O, line and
+ * allocation counters, reported on stderr when the command finishes.
+ * Phases nest (a backup inside a write); time is charged to the innermost
+ * one, so the per-phase figures add up to the total. With stats off every
+ * hook is a single test of iv_stats.mode. */
+
+#include "iv.h"
+#include <time.h>
+#include <sys/resource.h>
+
+IvStats iv_stats;
+
+static const char *phase_names[IV_PHASE_COUNT] = {
+    "scan", "load", "backup", "edit", "write", "view"};
+
+#define PHASE_DEPTH 8
+
+static int stack[PHASE_DEPTH];
+static int depth;
+static struct timespec wall_mark, cpu_mark, wall_start, cpu_start;
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (double)(to->tv_sec - from->tv_sec) * 1e3 +
+           (double)(to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/* Charge the time since the last mark to the phase on top of the stack. */
+static void charge(void)
+{
+    struct timespec w, c;
+    clock_gettime(CLOCK_MONOTONIC, &w);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c);
+    if (depth > 0)
+    {
+        iv_stats.wall_ms[stack[depth - 1]] += elapsed_ms(&wall_mark, &w);
+        iv_stats.cpu_ms[stack[depth - 1]] += elapsed_ms(&cpu_mark, &c);
+    }
+    wall_mark = w;
+    cpu_mark = c;
+}
+
+void stats_init(int argc, char *argv[])
+{
+    memset(&iv_stats, 0, sizeof(iv_stats));
+    depth = 0;
+
+    const char *env = getenv("IV_STATS");
+    if (env && *env && strcmp(env, "0") != 0)
+        iv_stats.mode = strcmp(env, "json") == 0 ? 2 : 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stats") == 0)
+            iv_stats.mode = 1;
+        else if (strcmp(argv[i], "--stats=json") == 0)
+            iv_stats.mode = 2;
+    }
+    if (!iv_stats.mode)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    wall_mark = wall_start;
+    cpu_mark = cpu_start;
+}
+
+void stats_phase_begin(IvPhase p)
+{
+    if (!iv_stats.mode || depth >= PHASE_DEPTH)
+        return;
+    charge();
+    stack[depth++] = (int)p;
+}
+
+void stats_phase_end(IvPhase p)
+{
+    if (!iv_stats.mode || depth == 0 || stack[depth - 1] != (int)p)
+        return;
+    charge();
+    depth--;
+}
+
+void stats_count_written(FILE *f)
+{
+    if (!iv_stats.mode || !f || f == stdout)
+        return;
+    long pos = ftell(f);
+    if (pos > 0)
+        iv_stats.bytes_written += pos;
+}
+
+/* s as a JSON string: quotes, backslashes and control bytes escaped. */
+static void put_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\')
+            fprintf(f, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(f, "\\u%04x", ch);
+        else
+            fputc(ch, f);
+    }
+    fputc('"', f);
+}
+
+void stats_report(const char *command)
+{
+    if (!iv_stats.mode)
+        return;
+    charge();
+    depth = 0;
+    struct timespec w, c;
+    clock_gettime(CLOCK_MONOTONIC, &w);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c);
+    double wall = elapsed_ms(&wall_start, &w);
+    double cpu = elapsed_ms(&cpu_start, &c);
+    struct rusage ru;
+    long maxrss = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+
+    if (iv_stats.mode == 2)
+    {
+        fputs("{\"command\":", stderr);
+        put_json_string(stderr, command ? command : "");
+        fputs(",\"phases\":{", stderr);
+        for (int i = 0; i < IV_PHASE_COUNT; i++)
+            fprintf(stderr, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+                    i ? "," : "", phase_names[i], iv_stats.wall_ms[i],
+                    iv_stats.cpu_ms[i]);
+        fprintf(stderr, "},\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%lld,"
+                        "\"bytes_written\":%lld,\"lines\":%lld,\"allocations\":%lld,"
+                        "\"maxrss_kb\":%ld}\n",
+                wall, cpu, iv_stats.bytes_read, iv_stats.bytes_written,
+                iv_stats.lines, iv_stats.allocs, maxrss);
+        return;
+    }
+
+    fprintf(stderr, "iv stats (%s)\n", command ? command : "");
+    fprintf(stderr, "  %-8s %10s %10s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < IV_PHASE_COUNT; i++)
+        if (iv_stats.wall_ms[i] > 0 || iv_stats.cpu_ms[i] > 0)
+            fprintf(stderr, "  %-8s %10.3f %10.3f\n", phase_names[i],
+                    iv_stats.wall_ms[i], iv_stats.cpu_ms[i]);
+    fprintf(stderr, "  %-8s %10.3f %10.3f\n", "total", wall, cpu);
+    fprintf(stderr, "  bytes read %lld, written %lld, lines %lld, "
+                    "allocations %lld, peak RSS %ld KiB\n",
+            iv_stats.bytes_read, iv_stats.bytes_written, iv_stats.lines,
+            iv_stats.allocs, maxrss);
+}
@@ -0,0 +1,494 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2026 Iván Ezequiel Rodriguez */
+
+#include "iv.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Block size for the streaming paths: the only buffer whose size does not
+ * depend on the input. */
+#define STREAM_BLOCK (1 << 16)
+
+/* ── Scan ───────────────────────────────────────────────────────────────── */
+
+int scan_text_file(const char *path, long long *count)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    char *buf = malloc(STREAM_BLOCK);
+    if (!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    stats_phase_begin(IV_PHASE_SCAN);
+    long long lines = 0;
+    char last = '\n';
+    ssize_t n;
+    while ((n = read(fd, buf, STREAM_BLOCK)) > 0)
+    {
+        IV_STAT(bytes_read, n);
+        if (memchr(buf, 0, (size_t)n))
+        {
+            free(buf);
+            close(fd);
+            stats_phase_end(IV_PHASE_SCAN);
+            return 1;
+        }
+        for (const char *p = buf, *e = buf + n;
+             (p = memchr(p, '\n', (size_t)(e - p))); p++)
+            lines++;
+        last = buf[n - 1];
+    }
+    free(buf);
+    close(fd);
+    stats_phase_end(IV_PHASE_SCAN);
+    if (n < 0)
+        return -1;
+    if (last != '\n')
+        lines++;
+    *count = lines;
+    return 0;
+}
+
+int scan_selection(const char *path, long long *count, IvRangeSet *sel)
+{
+    if (!sel->has_regex)
+    {
+        int r = scan_text_file(path, count);
+        if (r == 0 && range_set_finish(sel, *count) != 0)
+            return -1;
+        return r;
+    }
+
+    /* Addresses need whole lines: the tail of each block is carried over */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    size_t cap = 2 * STREAM_BLOCK, len = 0, start = 0;
+    char *buf = malloc(cap);
+    if (!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    stats_phase_begin(IV_PHASE_SCAN);
+    long long lines = 0;
+    int r = 0, eof = 0;
+    while (!eof && r == 0)
+    {
+        if (cap - len < STREAM_BLOCK)
+        {
+            char *tmp = realloc(buf, cap * 2);
+            if (!tmp)
+            {
+                r = -1;
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, STREAM_BLOCK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            r = -1;
+            break;
+        }
+        IV_STAT(bytes_read, n);
+        if (memchr(buf + len, 0, (size_t)n))
+            r = 1;
+        eof = n == 0;
+        len += (size_t)n;
+        while (r == 0 && start < len)
+        {
+            const char *nl = memchr(buf + start, '\n', len - start);
+            if (!nl && !eof)
+                break;
+            size_t end = nl ? (size_t)(nl - buf) + 1 : len;
+            if (range_set_line(sel, ++lines, buf + start, end - start) != 0)
+                r = -1;
+            start = end;
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+        start = 0;
+    }
+    free(buf);
+    close(fd);
+    stats_phase_end(IV_PHASE_SCAN);
+    if (r == 0)
+    {
+        *count = lines;
+        if (range_set_finish(sel, lines) != 0)
+            r = -1;
+    }
+    return r;
+}
+
+/* ── Output file replacement ────────────────────────────────────────────── */
+
+int open_temp_beside(const char *filename, char *tmp, size_t size)
+{
+    char real[PATH_MAX];
+    const char *target = realpath(filename, real) ? real : filename;
+    const char *slash = strrchr(target, '/');
+    int w;
+    if (slash)
+        w = snprintf(tmp, size, "%.*s/.%s.ivXXXXXX",
+                     (int)(slash - target), target, slash + 1);
+    else
+        w = snprintf(tmp, size, ".%s.ivXXXXXX", target);
+    int fd = (w > 0 && (size_t)w < size) ? mkstemp(tmp) : -1;
+    if (fd < 0)
+    {
+        /* Directory not writable: build in TMPDIR and copy back later */
+        const char *dir = getenv("TMPDIR");
+        snprintf(tmp, size, "%s/iv.XXXXXX", dir && *dir ? dir : "/tmp");
+        fd = mkstemp(tmp);
+    }
+    return fd;
+}
+
+int replace_file_with(const char *filename, const char *tmp)
+{
+    char real[PATH_MAX];
+    const char *target = realpath(filename, real) ? real : filename;
+    struct stat st, tst;
+    int have_st = stat(target, &st) == 0;
+    int same_attrs = !have_st ||
+                     (chmod(tmp, st.st_mode & 07777) == 0 && stat(tmp, &tst) == 0 &&
+                      ((tst.st_uid == st.st_uid && tst.st_gid == st.st_gid) ||
+                       chown(tmp, st.st_uid, st.st_gid) == 0));
+
+    /* rename() would split hard links apart; only use it for plain files */
+    if (same_attrs && (!have_st || st.st_nlink == 1))
+    {
+        if (rename(tmp, target) == 0)
+            return 0;
+        if (errno != EXDEV)
+        {
+            perror("Could not write file");
+            unlink(tmp);
+            return -1;
+        }
+    }
+
+    FILE *src = fopen(tmp, "rb");
+    FILE *dst = src ? fopen(target, "wb") : NULL;
+    if (!dst)
+    {
+        perror("Could not write file");
+        if (src)
+            fclose(src);
+        unlink(tmp);
+        return -1;
+    }
+    char *buf = malloc(STREAM_BLOCK);
+    size_t n = 0;
+    int failed = !buf;
+    while (!failed && (n = fread(buf, 1, STREAM_BLOCK, src)) > 0)
+        failed = fwrite(buf, 1, n, dst) != n;
+    failed |= ferror(src);
+    free(buf);
+    fclose(src);
+    failed |= fclose(dst) != 0;
+    if (failed)
+    {
+        perror("Could not write file");
+        fprintf(stderr, "iv: %s may be damaged; the edited content is kept in %s\n",
+                target, tmp);
+        return -1;
+    }
+    unlink(tmp);
+    return 0;
+}
+
+/* ── Streaming patch ────────────────────────────────────────────────────── */
+
+/* Whether apply_patch() would emit new_text for this range and line count. */
+static int patch_writes_text(long long count, long long start, long long end,
+                             int mode)
+{
+    if (mode == 4)
+        return 1;
+    if (mode == 2)
+        return 0;
+    long long lo = start < 1 ? 1 : start;
+    long long hi = end > count ? count : end;
+    return lo <= hi || start > count || count == 0;
+}
+
+/* Lines in iv[0..niv) get new_text per mode; append: also after the last
+ * line. last: past this line the rest is copied in blocks. A replaced line
+ * is compared with the text as it is skipped, so an edit that changes no
+ * byte leaves the file alone, without a backup. */
+static int patch_stream(const char *filename, const IvInterval *iv, size_t niv,
+                        long long last, int append, int wrote_new,
+                        const char *new_text, int mode, const IvOpts *opts)
+{
+    if (opts->dry_run)
+        return wrote_new ? 0 : -1;
+
+    char *text = NULL;
+    size_t tlen = 0;
+    FILE *mem = open_memstream(&text, &tlen);
+    if (!mem)
+        return -1;
+    write_with_escapes(mem, new_text);
+    fclose(mem);
+
+    int in = open(filename, O_RDONLY);
+    if (in < 0)
+    {
+        perror(filename);
+        free(text);
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    FILE *out;
+    if (opts->to_stdout)
+        out = stdout;
+    else
+    {
+        int fd = open_temp_beside(filename, tmp, sizeof(tmp));
+        out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!out)
+        {
+            perror("Could not write file");
+            if (fd >= 0)
+            {
+                close(fd);
+                unlink(tmp);
+            }
+            close(in);
+            free(text);
+            return -1;
+        }
+    }
+
+    char *buf = malloc(STREAM_BLOCK);
+    if (!buf)
+    {
+        close(in);
+        free(text);
+        if (out != stdout)
+        {
+            fclose(out);
+            unlink(tmp);
+        }
+        return -1;
+    }
+
+    /* A large file is backed up while it is streamed */
+    IvBackupJob *backup = out != stdout && !opts->no_backup ? backup_start(filename, 0) : NULL;
+    stats_phase_begin(IV_PHASE_WRITE);
+    long long ln = 1;
+    size_t k = 0; /* first interval not entirely before ln */
+    int at_start = 1, skipping = 0, tail = 0;
+    int dirty = append, same = 0; /* same: the skipped line matches text[0..cmp) */
+    size_t cmp = 0;
+    ssize_t n;
+    while ((n = read(in, buf, STREAM_BLOCK)) > 0)
+    {
+        IV_STAT(bytes_read, n);
+        if (tail)
+        {
+            fwrite(buf, 1, (size_t)n, out);
+            continue;
+        }
+        size_t pos = 0;
+        while (pos < (size_t)n)
+        {
+            if (at_start)
+            {
+                if (ln > last)
+                {
+                    fwrite(buf + pos, 1, (size_t)n - pos, out);
+                    tail = 1;
+                    break;
+                }
+                while (k < niv && iv[k].end < ln)
+                    k++;
+                int in_range = k < niv && ln >= iv[k].start;
+                if (mode == 4 ? ln == iv[0].start : (in_range && mode != 2))
+                {
+                    fwrite(text, 1, tlen, out);
+                    dirty |= mode != 3;
+                }
+                skipping = in_range && (mode == 2 || mode == 3);
+                dirty |= skipping && mode == 2;
+                same = 1;
+                cmp = 0;
+                at_start = 0;
+            }
+            const char *nl = memchr(buf + pos, '\n', (size_t)n - pos);
+            size_t seg = nl ? (size_t)(nl - (buf + pos)) + 1 : (size_t)n - pos;
+            if (!skipping)
+                fwrite(buf + pos, 1, seg, out);
+            else if (same && cmp + seg <= tlen && memcmp(text + cmp, buf + pos, seg) == 0)
+                cmp += seg;
+            else
+                same = 0;
+            pos += seg;
+            if (nl)
+            {
+                dirty |= skipping && !(same && cmp == tlen);
+                at_start = 1;
+                ln++;
+            }
+        }
+    }
+    if (append)
+        fwrite(text, 1, tlen, out);
+    dirty |= skipping && !at_start && !(same && cmp == tlen); /* last line, no '\n' */
+
+    free(buf);
+    free(text);
+    close(in);
+    if (out == stdout)
+    {
+        stats_phase_end(IV_PHASE_WRITE);
+        return wrote_new ? 0 : -1;
+    }
+
+    stats_count_written(out);
+    int ok = !ferror(out);
+    ok &= fclose(out) == 0;
+    if (!ok || !dirty)
+    {
+        if (!ok)
+            perror("Could not write file");
+        unlink(tmp); /* !dirty: the same bytes, keep the file and its mtime */
+        backup_abandon(backup);
+    }
+    else
+    {
+        backup_finish(backup); /* ephemeral backups by default */
+        ok = replace_file_with(filename, tmp) == 0;
+    }
+    stats_phase_end(IV_PHASE_WRITE);
+    if (!ok)
+        return -2;
+    return wrote_new ? 0 : -1;
+}
+
+int stream_patch(const char *filename, long long count, long long start,
+                 long long end, const char *new_text, int mode, const IvOpts *opts)
+{
+    IvInterval one = {start, end};
+    return patch_stream(filename, &one, 1, mode == 4 ? start : end,
+                        mode != 2 && (start > count || count == 0),
+                        patch_writes_text(count, start, end, mode),
+                        new_text, mode, opts);
+}
+
+int stream_patch_set(const char *filename, const IvRangeSet *sel,
+                     const char *new_text, int mode, const IvOpts *opts)
+{
+    return patch_stream(filename, sel->iv, sel->n, sel->n ? sel->iv[sel->n - 1].end : 0,
+                        0, mode != 2 && sel->n > 0, new_text, mode, opts);
+}
+
+/* ── Streaming substitute ───────────────────────────────────────────────── */
+
+/* Lines in scope are NUL-terminated in place for the kernels, so the
+ * buffer keeps one byte spare. Bytes [run, start) are unchanged lines
+ * still to be copied. */
+long long substitute_stream(int fd, FILE *out, const IvRangeSet *sel,
+                            const IvReplacer *pairs, int npairs, int global,
+                            const IvMatcher *filter)
+{
+    size_t cap = 2 * STREAM_BLOCK + 1, len = 0, start = 0, run = 0;
+    char *buf = malloc(cap);
+    IV_STAT(allocs, 1);
+    if (!buf)
+        return -1;
+    long long lineno = 0, total = 0;
+    size_t k = 0; /* first interval not entirely before the next line */
+    int eof = 0, err = 0;
+    while (!eof)
+    {
+        if (cap - len < STREAM_BLOCK + 1)
+        {
+            char *tmp = realloc(buf, cap * 2);
+            IV_STAT(allocs, 1);
+            if (!tmp)
+            {
+                err = 1;
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+        ssize_t r = read(fd, buf + len, STREAM_BLOCK);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            err = 1;
+            break;
+        }
+        IV_STAT(bytes_read, r);
+        if (memchr(buf + len, 0, (size_t)r))
+        {
+            err = 2;
+            break;
+        }
+        eof = r == 0;
+        len += (size_t)r;
+
+        while (start < len && k < sel->n)
+        {
+            const char *nl = memchr(buf + start, '\n', len - start);
+            if (!nl && !eof)
+                break;
+            size_t end = nl ? (size_t)(nl - buf) + 1 : len;
+            if (++lineno < sel->iv[k].start)
+            {
+                start = end;
+                continue;
+            }
+            if (lineno == sel->iv[k].end)
+                k++;
+
+            char saved = buf[end];
+            buf[end] = '\0';
+            long long n;
+            char *line = substitute_line(pairs, npairs, global, filter, buf + start,
+                                         end - start, &n);
+            buf[end] = saved;
+            size_t from = start;
+            start = end;
+            if (!line)
+                continue; /* unchanged: part of the run */
+            if (out)
+            {
+                fwrite(buf + run, 1, from - run, out);
+                fputs(line, out);
+            }
+            free(line);
+            total += n;
+            run = end;
+        }
+        if (k == sel->n && !out)
+            break; /* only counting: nothing left to count */
+        if (k == sel->n)
+            start = len; /* past the selection: copied as it is */
+
+        if (out)
+            fwrite(buf + run, 1, start - run, out);
+        memmove(buf, buf + start, len - start);
+        len -= start;
+        start = run = 0;
+    }
+    IV_STAT(lines, lineno);
+    free(buf);
+    return err ? -err : total;
+}
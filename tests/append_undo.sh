@@ -0,0 +1,62 @@
+#!/bin/sh
+# Undoing an append (-a) must refuse when the file changed after it.
+# Usage: sh tests/append_undo.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/bk" XDG_DATA_HOME="$T/xdg"
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+for pack in 0 1; do
+    export IV_BACKUP_PACK=$pack
+    rm -rf bk
+    echo "IV_BACKUP_PACK=$pack"
+
+    # An undo that still applies
+    printf 'one\ntwo\n' > a
+    "$IV" -a a three -q
+    "$IV" -a a four -q
+    "$IV" -u a 2 2>/dev/null
+    check "undo of two appends" "$(cat a)" "$(printf 'one\ntwo')"
+
+    # File rewritten outside iv, other size and same size
+    printf 'one\ntwo\n' > b
+    "$IV" -a b tail -q
+    echo "totally different content" > b
+    "$IV" -u b 2>/dev/null
+    check "rewritten file: -u fails" "$?" 1
+    check "rewritten file: kept" "$(cat b)" "totally different content"
+    printf 'one\ntwo\n' > c
+    "$IV" -a c tail -q
+    printf 'ONE\nTWO\nTAIL\n' > c
+    "$IV" -u c 2>/dev/null
+    check "same-size rewrite: -u fails" "$?" 1
+    "$IV" -lsbak c 1 >/dev/null 2>&1
+    check "same-size rewrite: -lsbak fails" "$?" 1
+    check "same-size rewrite: kept" "$(cat c)" "$(printf 'ONE\nTWO\nTAIL')"
+
+    # An edit without backup between the append and the undo
+    printf 'one\ntwo\n' > g
+    "$IV" -a g tail -q
+    "$IV" -r g 1 CHANGED --no-backup -q
+    "$IV" -u g 2>/dev/null
+    check "--no-backup edit: -u fails" "$?" 1
+    check "--no-backup edit: kept" "$(cat g)" "$(printf 'CHANGED\ntwo\ntail')"
+    "$IV" -diff g >/dev/null 2>&1
+    check "--no-backup edit: -diff fails" "$?" 1
+done
+
+exit $fail
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Each file gets its own backup directory, also when several files of one
+# directory are edited in a single run.
+# Usage: sh tests/backup_dir.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/bk" XDG_DATA_HOME="$T/xdg"
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+# No repository: the directory is named after each file
+mkdir plain
+printf 'a\nb\n' > plain/f
+printf 'c\nd\n' > plain/g
+"$IV" -p plain/f plain/g 1 Z >/dev/null
+check "no repo: one directory per file" "$(ls bk | sed 's/%.*//' | sort | tr '\n' ' ')" "f g "
+"$IV" -u plain/g 2>/dev/null
+check "no repo: undo of the second file" "$(cat plain/g)" "$(printf 'c\nd')"
+
+# A repository: both under its name
+mkdir -p repo/.git
+printf 'a\n' > repo/f
+printf 'c\n' > repo/g
+"$IV" -p repo/f repo/g 1 Z >/dev/null
+check "repo: named after the root" "$(ls bk | grep -c '^repo%')" 2
+"$IV" -u repo/g 2>/dev/null
+check "repo: undo of the second file" "$(cat repo/g)" c
+
+exit $fail
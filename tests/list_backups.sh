@@ -0,0 +1,41 @@
+#!/bin/sh
+# Listing backups (-l, -lsbak) must not write to the backup root.
+# Usage: sh tests/list_backups.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/bk" XDG_DATA_HOME="$T/xdg"
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+# Empty root: nothing created
+mkdir bk
+"$IV" -l >/dev/null 2>&1
+"$IV" -lsbak >/dev/null 2>&1
+check "empty root: left empty" "$(ls -A bk)" ""
+
+# Missing catalog: the slots are listed from the directories, not stored
+printf 'one\n' > f
+"$IV" -r f 1 two -q
+rm -f bk/.catalog bk/.catalog.lock
+check "missing catalog: -lsbak lists the slot" "$("$IV" -lsbak f 2>/dev/null | grep -c '/1\.bak')" 1
+"$IV" -l >/dev/null 2>&1
+check "missing catalog: not written" "$(ls -A bk | grep -c '^\.catalog')" 0
+
+# The next backup stores it again
+"$IV" -r f 1 three -q
+check "next backup: catalog stored" "$([ -f bk/.catalog ] && echo yes)" yes
+
+exit $fail
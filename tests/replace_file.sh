@@ -0,0 +1,46 @@
+#!/bin/sh
+# Writing an edited file back must keep its mode, hard links and symlinks.
+# Usage: sh tests/replace_file.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/bk" XDG_DATA_HOME="$T/xdg"
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+# Plain file: replaced by rename, mode kept
+printf 'one\ntwo\n' > a
+chmod 640 a
+"$IV" -r a 1 ONE -q
+check "plain file: edited" "$(cat a)" "$(printf 'ONE\ntwo')"
+check "plain file: mode kept" "$(stat -c %a a)" 640
+
+# Hard-linked file: rewritten in place, both names see the edit
+printf 'one\ntwo\n' > b
+ln b b.link
+"$IV" -d b 2 -q
+check "hard link: edited" "$(cat b.link)" one
+check "hard link: still linked" "$(stat -c %h b)" 2
+
+# Symlink: the target is edited and the link stays a link
+printf 'one\ntwo\n' > c
+ln -s c c.sym
+"$IV" -i c.sym 1 zero -q
+check "symlink: target edited" "$(cat c)" "$(printf 'zero\none\ntwo')"
+check "symlink: still a link" "$([ -L c.sym ] && echo yes)" yes
+
+check "no temporary files left" "$(ls -A | grep -c '\.iv')" 0
+
+exit $fail
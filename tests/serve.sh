@@ -0,0 +1,50 @@
+#!/bin/sh
+# Commands sent to iv --serve see the client's environment, and --follow
+# never ties up the server.
+# Usage: sh tests/serve.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/server" XDG_DATA_HOME="$T/xdg"
+"$IV" --serve "$T/s.sock" </dev/null >/dev/null 2>&1 &
+server=$!
+trap 'kill -9 $server 2>/dev/null; rm -rf "$T"' EXIT
+i=0
+while [ ! -S "$T/s.sock" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+# The backup goes where the client says, and undo finds it there
+printf 'a\nb\n' > f
+IV_SOCKET="$T/s.sock" IV_BACKUP_DIR="$T/client" "$IV" -r f 1 Q -q
+check "client IV_BACKUP_DIR: backup there" "$(ls "$T/client" 2>/dev/null | grep -c '%f$')" 1
+check "client IV_BACKUP_DIR: none in the server's" "$([ -e "$T/server" ] && echo yes)" ""
+IV_SOCKET="$T/s.sock" IV_BACKUP_DIR="$T/client" "$IV" -u f 2>/dev/null
+check "client IV_BACKUP_DIR: undo" "$(cat f)" "$(printf 'a\nb')"
+
+# --follow runs in the client; the server keeps answering
+IV_SOCKET="$T/s.sock" "$IV" -nv f b --follow </dev/null >follow.out 2>&1 &
+follow=$!
+sleep 0.3
+echo bb >> f
+out=$(IV_SOCKET="$T/s.sock" timeout 5 "$IV" -wc f)
+check "--follow: server still answers" "$out" 3
+sleep 1.2
+kill $follow 2>/dev/null
+check "--follow: appended line seen" "$(grep -c 'bb' follow.out)" 1
+
+exit $fail
@@ -0,0 +1,37 @@
+#!/bin/sh
+# --stats=json writes one valid JSON object, whatever the command looks like.
+# Usage: sh tests/stats.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+# The object up to the phases
+head_of()
+{
+    printf '%s\n' "$1" | sed 's/,"phases":{.*}$//'
+}
+
+printf 'a\n' > f
+out=$("$IV" -wc f --stats=json 2>&1 >/dev/null | tail -n 1)
+check "plain command" "$(head_of "$out")" '{"command":"-wc"'
+out=$("$IV" 'a"b\c' --stats=json 2>&1 >/dev/null | tail -n 1)
+check "quote and backslash escaped" "$(head_of "$out")" '{"command":"a\"b\\c"'
+tab=$(printf '\t')
+out=$("$IV" "x${tab}y" --stats=json 2>&1 >/dev/null | tail -n 1)
+check "control byte escaped" "$(head_of "$out")" '{"command":"x\u0009y"'
+
+exit $fail
@@ -0,0 +1,40 @@
+#!/bin/sh
+# -s -E sees each line as -n and -m do: $ matches before the newline.
+# Usage: sh tests/substitute.sh [path/to/iv]
+
+IV=${1:-./iv}
+case $IV in /*) ;; *) IV=$(pwd)/$IV ;; esac
+T=$(mktemp -d "${TMPDIR:-/tmp}/iv_test.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+export IV_BACKUP_DIR="$T/bk" XDG_DATA_HOME="$T/xdg"
+fail=0
+
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+
+printf 'aa\nba\nab\n' > e
+check "-n 'a\$'" "$("$IV" -n e 'a$' -E | tr '\n' ' ')" "1 2 "
+"$IV" -s e 'a$' X -E >/dev/null 2>&1
+check "-s 'a\$'" "$(cat e)" "$(printf 'aX\nbX\nab')"
+
+printf 'aa\nba\nab\n' > e
+"$IV" -s e '$' '!' -E -g >/dev/null 2>&1
+check "-s '\$' adds before the newline" "$(cat e)" "$(printf 'aa!\nba!\nab!')"
+
+printf 'aa\nba\nab' > e
+"$IV" -s e 'b$' X -E >/dev/null 2>&1
+check "-s 'b\$' on a last line without newline" "$(cat e)" "$(printf 'aa\nba\naX')"
+
+printf 'aa\nba\nab\n' > e
+"$IV" -d e -m 'a$' -E >/dev/null 2>&1
+check "-d -m 'a\$' agrees" "$(cat e)" ab
+
+exit $fail
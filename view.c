@@ -2,80 +2,270 @@
 /* Copyright (C) 2026 Iván Ezequiel Rodriguez */
 
 #include "iv.h"
+#include <unistd.h>
+#include <errno.h>
 
-void show_file(char *lines[], int count, int no_numbers)
+void show_file(char *lines[], long long count, int no_numbers)
 {
-    for (int i = 0; i < count; i++)
+    for (long long i = 0; i < count; i++)
     {
         if (no_numbers)
             printf("%s", lines[i]);
         else
-            printf("%4d | %s", i + 1, lines[i]);
+            printf("%4lld | %s", i + 1, lines[i]);
     }
 }
 
-void show_range(char *lines[], int count, int start, int end, int no_numbers)
+void show_range(char *lines[], long long count, long long start, long long end,
+                int no_numbers)
 {
     if (start < 1)
         start = 1;
     if (end > count)
         end = count;
-    for (int i = start - 1; i < end; i++)
+    for (long long i = start - 1; i < end; i++)
     {
         if (no_numbers)
             printf("%s", lines[i]);
         else
-            printf("%4d | %s", i + 1, lines[i]);
+            printf("%4lld | %s", i + 1, lines[i]);
     }
 }
 
-int wc_lines(char *lines[], int count)
+long long wc_lines(char *lines[], long long count)
 {
+    (void)lines;
     return count;
 }
 
-void find_line_numbers(char *lines[], int count, const char *pattern, int json)
+/* ── -n / -nv ───────────────────────────────────────────────────────────── */
+
+#define FIND_BLOCK (1 << 16)
+
+/* Output state: matches found, the last line printed (for the "--" between
+ * context groups), how many lines of after-context are still due and the
+ * first interval of f->scope not yet behind. */
+typedef struct
 {
-    if (!pattern || !*pattern)
-        return;
-    if (json)
+    const IvFind *f;
+    long long found;
+    long long last;
+    long long pending;
+    size_t k;
+} FindOut;
+
+static int has_context(const IvFind *f)
+{
+    return f->print_lines && !f->count && (f->before || f->after);
+}
+
+static void find_begin(FindOut *o, const IvFind *f)
+{
+    memset(o, 0, sizeof(*o));
+    o->f = f;
+    if (f->json && !f->count && !f->print_lines)
         printf("{\"lines\":[");
-    int first = 1;
-    for (int i = 0; i < count; i++)
+}
+
+/* -nv line: "%4lld | " for matches, "%4lld - " for context lines */
+static void find_print(FindOut *o, long long lineno, const char *line,
+                       size_t len, int match)
+{
+    const IvFind *f = o->f;
+    if (has_context(f) && o->last && lineno > o->last + 1)
+        fputs("--\n", stdout);
+    o->last = lineno;
+    if (!f->no_numbers)
+        printf(match ? "%4lld | " : "%4lld - ", lineno);
+    fwrite(line, 1, len, stdout);
+}
+
+static void find_match(FindOut *o, long long lineno, const char *line, size_t len)
+{
+    const IvFind *f = o->f;
+    o->found++;
+    if (f->count)
+        return;
+    if (f->print_lines)
+    {
+        find_print(o, lineno, line, len, 1);
+        o->pending = has_context(f) ? f->after : 0;
+    }
+    else if (f->json)
+        printf(o->found > 1 ? ",%lld" : "%lld", lineno);
+    else
+        printf("%lld\n", lineno);
+}
+
+/* Lines are asked for in order; the cursor moves past an interval on its
+ * last line, so find_done() knows the scope is over without reading on. */
+static int find_in_scope(FindOut *o, long long lineno)
+{
+    const IvRangeSet *s = o->f->scope;
+    if (!s)
+        return 1;
+    while (o->k < s->n && s->iv[o->k].end < lineno)
+        o->k++;
+    if (o->k == s->n || s->iv[o->k].start > lineno)
+        return 0;
+    if (s->iv[o->k].end == lineno)
+        o->k++;
+    return 1;
+}
+
+/* --max reached or the scope is over, and no after-context left to print */
+static int find_done(const FindOut *o)
+{
+    const IvFind *f = o->f;
+    return ((f->max && o->found >= f->max) || (f->scope && o->k == f->scope->n)) &&
+           o->pending == 0;
+}
+
+static int find_limit(const FindOut *o)
+{
+    return o->f->max && o->found >= o->f->max;
+}
+
+static long long find_end(FindOut *o)
+{
+    const IvFind *f = o->f;
+    if (f->count)
+        printf(f->json ? "{\"count\":%lld}\n" : "%lld\n", o->found);
+    else if (f->json && !f->print_lines)
+        printf("]}\n");
+    return o->found;
+}
+
+long long find_lines(char *lines[], long long count, const IvMatcher *m, const IvFind *f)
+{
+    FindOut o;
+    long long before = has_context(f) ? f->before : 0;
+    find_begin(&o, f);
+    for (long long i = 0; i < count && !find_done(&o); i++)
     {
-        if (strstr(lines[i], pattern))
+        size_t len = strlen(lines[i]);
+        int in = find_in_scope(&o, i + 1);
+        if (in && !find_limit(&o) && matcher_match(m, lines[i], len))
         {
-            if (json)
-            {
-                if (!first)
-                    printf(",");
-                printf("%d", i + 1);
-                first = 0;
-            }
-            else
-            {
-                printf("%d\n", i + 1);
-            }
+            /* before-context: lines not printed yet, at most f->before */
+            long long from = i - before > o.last ? i - before : o.last;
+            for (long long k = from; k < i; k++)
+                find_print(&o, k + 1, lines[k], strlen(lines[k]), 0);
+            find_match(&o, i + 1, lines[i], len);
+        }
+        else if (o.pending > 0)
+        {
+            find_print(&o, i + 1, lines[i], len, 0);
+            o.pending--;
         }
+        else if (!in && f->scope && o.k < f->scope->n)
+            i = f->scope->iv[o.k].start - 2; /* on to the next interval */
     }
-    if (json)
-        printf("]}\n");
+    return find_end(&o);
 }
 
-void find_matching_lines(char *lines[], int count, const char *pattern, int no_numbers)
+/* Before-context in the streaming path is a ring of the last f->before
+ * unprinted lines, kept as spans of the read buffer; compaction keeps the
+ * bytes from the oldest span on. */
+typedef struct
 {
-    if (!pattern || !*pattern)
-        return;
-    for (int i = 0; i < count; i++)
+    size_t off, len;
+    long long lineno;
+} LineSpan;
+
+long long find_stream(int fd, const IvMatcher *m, const IvFind *f)
+{
+    size_t cap = 2 * FIND_BLOCK, len = 0, start = 0;
+    int before = has_context(f) ? f->before : 0;
+    char *buf = malloc(cap);
+    LineSpan *ring = before ? malloc((size_t)before * sizeof(*ring)) : NULL;
+    IV_STAT(allocs, 2);
+    if (!buf || (before && !ring))
     {
-        if (strstr(lines[i], pattern))
+        free(buf);
+        free(ring);
+        return -1;
+    }
+    FindOut o;
+    long long lineno = 0;
+    int eof = 0, err = 0, ring_head = 0, ring_n = 0;
+    find_begin(&o, f);
+    while (!eof && !find_done(&o))
+    {
+        if (cap - len < FIND_BLOCK)
+        {
+            /* a line (or the before-context) longer than the buffer */
+            char *tmp = realloc(buf, cap * 2);
+            IV_STAT(allocs, 1);
+            if (!tmp)
+            {
+                err = 1;
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+        ssize_t r = read(fd, buf + len, FIND_BLOCK);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            err = 1;
+            break;
+        }
+        IV_STAT(bytes_read, r);
+        eof = r == 0;
+        len += (size_t)r;
+
+        while (start < len && !find_done(&o))
+        {
+            const char *nl = memchr(buf + start, '\n', len - start);
+            if (!nl && !eof)
+                break;
+            size_t end = nl ? (size_t)(nl - buf) + 1 : len;
+            lineno++;
+            if (find_in_scope(&o, lineno) && !find_limit(&o) &&
+                matcher_match(m, buf + start, end - start))
+            {
+                for (; ring_n > 0; ring_n--)
+                {
+                    const LineSpan *sp = &ring[(ring_head + before - ring_n) % before];
+                    find_print(&o, sp->lineno, buf + sp->off, sp->len, 0);
+                }
+                find_match(&o, lineno, buf + start, end - start);
+            }
+            else if (o.pending > 0)
+            {
+                find_print(&o, lineno, buf + start, end - start, 0);
+                o.pending--;
+            }
+            else if (before)
+            {
+                ring[ring_head] = (LineSpan){start, end - start, lineno};
+                ring_head = (ring_head + 1) % before;
+                if (ring_n < before)
+                    ring_n++;
+            }
+            start = end;
+        }
+
+        size_t keep = start;
+        if (ring_n > 0)
         {
-            if (no_numbers)
-                printf("%s", lines[i]);
-            else
-                printf("%4d | %s", i + 1, lines[i]);
+            size_t oldest = ring[(ring_head + before - ring_n) % before].off;
+            keep = oldest < keep ? oldest : keep;
+            for (int k = 0; k < before; k++)
+                ring[k].off -= ring[k].off >= keep ? keep : ring[k].off;
         }
+        memmove(buf, buf + keep, len - keep);
+        len -= keep;
+        start -= keep;
     }
+    IV_STAT(lines, lineno);
+    free(buf);
+    free(ring);
+    find_end(&o);
+    return err ? -1 : o.found;
 }
 
 int stream_file_with_numbers(const char *path)
@@ -85,10 +275,10 @@ int stream_file_with_numbers(const char *path)
         return -1;
     char *line = NULL;
     size_t cap = 0;
-    int n = 0;
+    long long n = 0;
     while (getline(&line, &cap, f) != -1)
     {
-        printf("%4d | %s", ++n, line);
+        printf("%4lld | %s", ++n, line);
     }
     free(line);
     fclose(f);